@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+# Writes a machine generated script of at least the given size (default
+# 1MB) for benchmarking the parser, e.g.
+#	bench/gen_script.py 1000000 > big.js && ./parser --parse-only big.js
+import random
+import sys
+
+size = int(sys.argv[1]) if len(sys.argv) > 1 else 1000000
+rand = random.Random(42)
+names = ["alpha", "beta_2", "gamma", "delta", "eps_0", "zeta9", "eta", "the_ta"]
+chars = "abcdefghijklmnopqrstuvwxyz0123456789_"
+
+
+# identifiers start with a letter, then have letters, digits and _,
+# words are only used after a prefix so they can start with anything
+def word(n):
+    s = ""
+    while True:
+        s += chars[n % len(chars)]
+        n //= len(chars)
+        if n == 0:
+            return s
+
+
+def expr(depth):
+    r = rand.random()
+    if depth > 3 or r < 0.3:
+        return rand.choice([str(rand.randint(0, 999)), rand.choice(names),
+                            rand.choice(names) + ".x", "'c'", '"str"'])
+    if r < 0.6:
+        return "(" + expr(depth + 1) + " " + rand.choice("+-*/%<>") + " " + expr(depth + 1) + ")"
+    if r < 0.75:
+        return rand.choice(names) + "[" + expr(depth + 1) + "]"
+    if r < 0.9:
+        return "call" + word(rand.randint(0, 50)) + "(" + expr(depth + 1) + ", " + expr(depth + 1) + ")"
+    return "[" + expr(depth + 1) + ", " + expr(depth + 1) + "]"
+
+
+def stmt(depth):
+    r = rand.random()
+    if depth < 3 and r < 0.1:
+        return "while(" + expr(0) + "){\n" + block(depth + 1) + "}\n"
+    if depth < 3 and r < 0.2:
+        return "if(" + expr(0) + "){\n" + block(depth + 1) + "} else {\n" + block(depth + 1) + "}\n"
+    if r < 0.35:
+        return rand.choice(names) + ".x = " + expr(0) + ";\n"
+    return rand.choice(names) + " = " + expr(0) + ";\n"
+
+
+def block(depth):
+    return "".join(stmt(depth) for _ in range(rand.randint(1, 5)))
+
+
+out = ["{\n"]
+written = 0
+n = 0
+while written < size:
+    params = ", ".join(names[:3])
+    body = "let " + names[3] + " = {};\n" + block(0) + "return " + expr(0) + ";\n"
+    f = "fun f" + word(n) + "(" + params + "){\n" + body + "}\n"
+    out.append(f)
+    written += len(f)
+    n += 1
+out.append("}\n")
+sys.stdout.write("".join(out))
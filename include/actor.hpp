@@ -0,0 +1,95 @@
+#ifndef ACTOR_HPP
+#define ACTOR_HPP
+
+#include <vector>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <memory>
+#include <sstream>
+
+#include "object.hpp"
+
+/*
+ * Actors: closures running on isolates of their own that only talk to
+ * each other through messages.
+ *
+ * 	spawn(f, args...)	starts f on a new thread in a new isolate and
+ * 				gives the number of its mailbox
+ * 	send(to, value)		puts a copy of value in mailbox to
+ * 	transfer(to, value)	the same, but moves the arrays in value rather
+ * 				than copying them, which leaves the sender's empty
+ * 	receive()		waits for the next message in the caller's mailbox
+ *
+ * The isolate running the script has mailbox 0.
+ *
+ * Heaps aren't shared, so a message is copied once when it is sent,
+ * into a heap of its own, and that heap is moved into the receiver's
+ * when it is received. Strings never change and share their text
+ * instead of copying it. Only arrays in the sender's own heap can be
+ * transferred, anything else is copied.
+ *
+ * Actors share the script's program and see its named functions, but
+ * not the globals its top level sets. A script finishes once all of
+ * its actors have, and their output follows the script's.
+ */
+
+typedef struct Message{
+	Heap heap;	// everything the values refer to
+	std::vector<ObjPtr> values;
+} Message;
+
+class Actors{
+	private:
+	typedef struct Mailbox{
+		std::mutex lock;
+		std::condition_variable ready;
+		std::deque<std::unique_ptr<Message>> messages;
+	} Mailbox;
+
+	typedef struct Actor{
+		std::thread thread;
+		std::stringstream out;
+		bool joined = false;
+	} Actor;
+
+	std::mutex lock;	// guards the tables
+	std::deque<Mailbox> mailboxes;
+	std::list<Actor> actors;
+
+	Mailbox *mailbox(int);
+
+	public:
+	typedef std::function<void(int self, Message &, std::ostream &)> Body;
+
+	Actors(void);
+
+	/*
+	 * Copies values into a message, the originals are left
+	 * alone unless their arrays are to be moved.
+	 */
+	static std::unique_ptr<Message> pack(std::vector<ObjPtr> &, bool move = false);
+	// moves the message into the current heap
+	static std::vector<ObjPtr> unpack(Message &);
+
+	/*
+	 * Runs body on a thread of its own with the starting message,
+	 * returns the new actor's mailbox.
+	 */
+	int spawn(std::unique_ptr<Message>, Body);
+
+	// returns false if there is no such mailbox
+	bool send(int to, std::unique_ptr<Message>);
+	std::unique_ptr<Message> receive(int self);
+
+	/*
+	 * Waits for every actor, including those started while
+	 * waiting, and writes out what they printed in order.
+	 */
+	void join(std::ostream &);
+};
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+#include <type_traits>
+
+/*
+ * A bump pointer allocator for the parse tree.
+ *
+ * Nodes are carved out of large blocks and never freed one at a
+ * time; the whole tree goes when the arena does, after compilation.
+ * Pointers between nodes don't own anything, so building the tree is
+ * just bumping a pointer and copying one around is free.
+ *
+ * Nodes still own their vectors and strings, so anything that isn't
+ * trivially destructible has its destructor recorded and run when
+ * the arena is reset.
+ */
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+class Arena{
+	private:
+	typedef struct Destructor{
+		void (*destroy)(void *);
+		void *object;
+	} Destructor;
+
+	std::vector<char *> blocks;
+	char *next = nullptr;
+	char *limit = nullptr;
+	std::vector<Destructor> destructors;
+
+	void *grow(size_t size, size_t align);
+
+	template<typename T>
+	static void destroy(void *object){
+		static_cast<T *>(object)->~T();
+	}
+
+	public:
+	Arena(void){ }
+	Arena(const Arena &) = delete;
+	Arena &operator=(const Arena &) = delete;
+	~Arena(void){ reset(); }
+
+	void *allocate(size_t size, size_t align){
+		size_t pad = -(size_t)next & (align - 1);
+		if(next == nullptr || size + pad > (size_t)(limit - next))
+			return grow(size, align);
+		void *p = next + pad;
+		next += pad + size;
+		return p;
+	}
+
+	template<typename T, typename... Args>
+	T *make(Args&&... args){
+		void *p = allocate(sizeof(T), alignof(T));
+		T *t = new (p) T(std::forward<Args>(args)...);
+		if(!std::is_trivially_destructible<T>::value)
+			destructors.push_back({ destroy<T>, t });
+		return t;
+	}
+
+	/*
+	 * Destroys everything allocated so far and frees the blocks.
+	 */
+	void reset(void);
+};
+
+#endif
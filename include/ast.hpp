@@ -2,34 +2,121 @@
 #define  AST_HPP
 
 #include <set>
-#include <memory>
 #include <map>
+#include <algorithm>
 
 #include "parser.h"
 #include "instruction.hpp"
 
+class FunctionStmt;
+class BlockStmt;
+
+using ScopeInfo = std::map<std::string, int>;
+
+/*
+ * A function body left to be compiled when it is first called, with
+ * the scope it was found in.
+ */
+typedef struct LazyBody{
+	BlockStmt *body;
+	ScopeInfo context;	// arguments, captures and locals
+	int frame_size;
+	int locals;
+	int code;		// index of its code object, a stub until it's compiled
+	bool compiled = false;
+} LazyBody;
+
 class CompilationState{
 	private:
-		int while_loops { 0 };
-		int if_statements { 0 };
-		int anon_functions { 0 };
-		std::map<std::string, int> label_map;
-		std::vector<int> loop_idxs;
-	public:
-		int get_loop() { return *loop_idxs.end(); }
-		int new_loop() {
-			loop_idxs.push_back(while_loops++);
+		// start and end labels of the loops being compiled
+		std::vector<std::pair<int, int>> loops;
+
+		// slots of the frame being compiled
+		int frame_size { 0 };
+		int frame_max { 0 };
+
+		std::map<std::string, FunctionStmt *> functions;
+		std::set<std::string> inlined;
+		std::vector<std::string> inlining;
+	public:
+		LabelTable &labels;
+		// the top level is code[0], functions are added as they're found
+		std::vector<CodeObject> &code;
+		// where function bodies are deferred to, if they're compiled lazily
+		std::vector<LazyBody> *lazy = nullptr;
+		// largest expression inline_cost() that is inlined, 0 turns it off
+		int inline_limit { 16 };
+		// functions that are assigned to, so can't be inlined
+		std::set<std::string> reassigned;
+
+		CompilationState(LabelTable &labels, std::vector<CodeObject> &code)
+			: labels(labels), code(code) { }
+
+		int new_label() { return labels.new_label(); }
+		std::pair<int, int> get_loop() { return loops.back(); }
+		std::pair<int, int> new_loop() {
+			loops.push_back({ new_label(), new_label() });
 			return get_loop();
 		}
-		void end_loop() { loop_idxs.pop_back(); }
-		int new_if() { return if_statements++; }
-		int new_anon_function() { return anon_functions++; }
-		void set_label(std::string label, int location) { label_map[label] = location; }
-		int& get_label(std::string label) { return label_map[label]; }
+		void end_loop() { loops.pop_back(); }
+
+		// returns the index of a new function's code object
+		int new_code(std::string name, int arity) {
+			CodeObject c;
+			c.name = name;
+			c.label = new_label();
+			c.arity = arity;
+			code.push_back(c);
+			return code.size() - 1;
+		}
+		void end_code(int index, int frame_size, int locals, int extra,
+					  std::vector<Instruction> &body);
+		// compiles a function's body now, or leaves a stub for it
+		void function_body(int index, BlockStmt *, ScopeInfo &,
+						   int frame_size, int locals);
+		void emit_body(int index, BlockStmt *, ScopeInfo &,
+					   int frame_size, int locals);
+
+		/*
+		 * Frames are sized once the body has been compiled,
+		 * so inlined calls can ask for extra slots.
+		 */
+		using Frame = std::pair<int, int>;
+		Frame begin_frame(int size) {
+			Frame outer = { frame_size, frame_max };
+			frame_size = frame_max = size;
+			return outer;
+		}
+		// returns the number of extra slots the frame needs
+		int end_frame(int size, Frame outer) {
+			int extra = frame_max - size;
+			frame_size = outer.first;
+			frame_max = outer.second;
+			return extra;
+		}
+		int new_slot() {
+			frame_max = std::max(frame_max, frame_size + 1);
+			return frame_size++;
+		}
+		void free_slots(int count) { frame_size -= count; }
+
+		void add_function(std::string, FunctionStmt *);
+		FunctionStmt *find_function(std::string);
+		// the functions seen so far, for compiling the rest later
+		const std::map<std::string, FunctionStmt *> &all_functions(void) { return functions; }
+		void set_functions(const std::map<std::string, FunctionStmt *> &f) { functions = f; }
+		// calls to these aren't inlined while they're being compiled
+		void begin_function(std::string name) { inlining.push_back(name); }
+		void end_function(void) { inlining.pop_back(); }
+		bool begin_inline(std::string);
+		void end_inline(void) { inlining.pop_back(); }
+		/*
+		 * Adds inlined functions that the program assigns to
+		 * to reassigned, returns false if there were any.
+		 */
+		bool check_inlined(std::vector<Instruction>&);
 };
 
-using ScopeInfo = std::map<std::string, int>;
-
 class Expression{
 	public:
 	virtual void 
@@ -37,14 +124,25 @@ class Expression{
 
 	virtual void
 	get_variables(std::set<std::string>&);
+
+	/*
+	 * Size of the expression when inlining, or -1 if it
+	 * can't be moved into another function.
+	 */
+	virtual int inline_cost(void){ return -1; }
 };
 
-using ExprPtr = std::shared_ptr<Expression>;
+/*
+ * Nodes are allocated in an Arena by the parser and live until it is
+ * reset, so the pointers between them don't own anything.
+ */
+using ExprPtr = Expression *;
 
 class UnitExp : public Expression{
 	public:
 	UnitExp(void);
 	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
+	int inline_cost(void);
 };
 
 class IntExp : public Expression{
@@ -54,6 +152,7 @@ class IntExp : public Expression{
 	public:
 	IntExp(int);
 	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
+	int inline_cost(void);
 };
 
 class FloatExp : public Expression{
@@ -63,12 +162,14 @@ class FloatExp : public Expression{
 	public:
 	FloatExp(float);
 	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
+	int inline_cost(void);
 };
 
 class ObjectExp : public Expression{
 	public:
 	ObjectExp();
 	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
+	int inline_cost(void);
 };
 
 class VectorExp : public Expression{
@@ -76,8 +177,9 @@ class VectorExp : public Expression{
 
 	public:
 	VectorExp();
-	VectorExp(std::vector<ExprPtr>&);
+	VectorExp(std::vector<ExprPtr>);
 	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
+	int inline_cost(void);
 	void get_variables(std::set<std::string>&);
 };
 
@@ -85,8 +187,9 @@ class StringExp : public Expression{
 	std::string str;
 
 	public:
-	StringExp(std::vector<char>&);
+	StringExp(std::string);
 	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
+	int inline_cost(void);
 	void get_variables(std::set<std::string>&);
 };
 
@@ -98,6 +201,8 @@ class VarExp : public Expression{
 	public:
 	VarExp(const std::string&);
 	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
+	int inline_cost(void);
+	std::string get_name(void){ return var_name; }
 	void get_variables(std::set<std::string>&);
 };
 
@@ -105,13 +210,15 @@ class BlockStmt;
 class ClosureExp : public Expression{
 	private:
 	std::vector<std::string> arguments;
-	std::shared_ptr<BlockStmt> body;
+	BlockStmt *body;
 
 	public:
-	ClosureExp(std::initializer_list<std::string>, std::shared_ptr<BlockStmt>);
-	ClosureExp(std::vector<std::string> const&, std::shared_ptr<BlockStmt>);
+	ClosureExp(std::initializer_list<std::string>, BlockStmt *);
+	ClosureExp(std::vector<std::string> const&, BlockStmt *);
 	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
 	void get_variables(std::set<std::string>&);
+	std::vector<std::string> &get_arguments(void){ return arguments; }
+	ExprPtr returned(void);
 };
 
 enum BinOp 
@@ -127,6 +234,7 @@ class BinExp : public Expression{
 	public:
 	BinExp(enum BinOp, ExprPtr, ExprPtr);
 	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
+	int inline_cost(void);
 	void get_variables(std::set<std::string>&);
 };
 
@@ -151,6 +259,64 @@ class FFICallExp : public Expression{
 	public:
 	FFICallExp(std::string, std::vector<ExprPtr >);
 	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
+	int inline_cost(void);
+	void get_variables(std::set<std::string>&);
+};
+
+/*
+ * spawn(), send(), transfer() and receive(), see actor.hpp.
+ */
+class ActorExp : public Expression{
+	private:
+	std::string name;
+	std::vector<ExprPtr> arguments;
+
+	public:
+	ActorExp(std::string, std::vector<ExprPtr>);
+	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
+	void get_variables(std::set<std::string>&);
+};
+
+/*
+ * parallel_map(), parallel_reduce() and parallel_for(), which
+ * share the calls to a closure out over threads.
+ */
+class ParallelExp : public Expression{
+	private:
+	std::string name;
+	std::vector<ExprPtr> arguments;
+
+	public:
+	ParallelExp(std::string, std::vector<ExprPtr>);
+	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
+	void get_variables(std::set<std::string>&);
+};
+
+/*
+ * fiber(), yield(), join() and the channel builtins, see fiber.hpp.
+ */
+class FiberExp : public Expression{
+	private:
+	std::string name;
+	std::vector<ExprPtr> arguments;
+
+	public:
+	FiberExp(std::string, std::vector<ExprPtr>);
+	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
+	void get_variables(std::set<std::string>&);
+};
+
+/*
+ * The io_ builtins and await(), see io.hpp.
+ */
+class IoExp : public Expression{
+	private:
+	enum OpCode op;
+	std::vector<ExprPtr> arguments;
+
+	public:
+	IoExp(enum OpCode, std::vector<ExprPtr>);
+	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
 	void get_variables(std::set<std::string>&);
 };
 
@@ -163,7 +329,7 @@ class AccessorExp : public Expression{
 	void set_setter(bool);
 };
 
-using AccessPtr = std::shared_ptr<AccessorExp>;
+using AccessPtr = AccessorExp *;
 
 class FieldAccessor: public AccessorExp{
 	private:
@@ -174,6 +340,7 @@ class FieldAccessor: public AccessorExp{
 	public:
 	FieldAccessor(std::string);
 	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
+	int inline_cost(void);
 	void set_sub_expr(ExprPtr);
 };
 
@@ -185,6 +352,7 @@ class ArrayAccessor: public AccessorExp{
 	public:
 	ArrayAccessor(ExprPtr exp);
 	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
+	int inline_cost(void);
 	void get_variables(std::set<std::string>&);
 	void set_sub_expr(ExprPtr);
 };
@@ -198,6 +366,8 @@ class ClosureCallExp : public AccessorExp{
 	ClosureCallExp(ExprPtr exp, std::initializer_list<ExprPtr >);
 	ClosureCallExp(ExprPtr exp, std::vector<ExprPtr >);
 	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
+	int inline_cost(void);
+	bool emit_inline(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
 	void get_variables(std::set<std::string>&);
 	void set_setter(bool);
 	void set_sub_expr(ExprPtr);
@@ -211,6 +381,7 @@ class GetFieldExp : public Expression{
 	public:
 	GetFieldExp(AccessPtr  acc, ExprPtr );
 	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
+	int inline_cost(void);
 	void get_variables(std::set<std::string>&);
 };
 
@@ -225,8 +396,20 @@ class Statement{
 	virtual bool is_DeclareStmt(void){
 		return false;
 	}
+	// the expression returned if this is just a return
+	virtual ExprPtr returned(void){
+		return nullptr;
+	}
+	// whether it has a fun statement, which is bound at start up
+	virtual bool defines_functions(void){
+		return false;
+	}
+	// whether it has a yield statement, making its function a generator
+	virtual bool yields(void){
+		return false;
+	}
 };
-using StmtPtr = std::shared_ptr<Statement>;
+using StmtPtr = Statement *;
 
 class ExpressionStmt : public Statement{
 	private:
@@ -244,6 +427,7 @@ class ReturnStmt : public Statement{
 	ReturnStmt(ExprPtr );
 	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
 	void get_variables(std::set<std::string>&);
+	ExprPtr returned(void){ return exp; }
 };
 
 class DeclareStmt : public Statement{
@@ -280,6 +464,9 @@ class BlockStmt : public Statement{
 	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
 	virtual void find_DeclareStmts(std::vector<std::string>&);
 	void get_variables(std::set<std::string>&);
+	ExprPtr returned(void);
+	bool defines_functions(void);
+	bool yields(void);
 };
 
 class IfStmt : public Statement{
@@ -294,32 +481,72 @@ class IfStmt : public Statement{
 	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
 	virtual void find_DeclareStmts(std::vector<std::string>&);
 	void get_variables(std::set<std::string>&);
+	bool defines_functions(void);
+	bool yields(void);
 };
 
 class WhileStmt : public Statement{
 	private:
 	ExprPtr exp;
-	std::shared_ptr<BlockStmt> body;
+	BlockStmt *body;
 
 	public:
-	WhileStmt(ExprPtr , std::shared_ptr<BlockStmt>);
+	WhileStmt(ExprPtr , BlockStmt *);
 	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
 	virtual void find_DeclareStmts(std::vector<std::string>&);
 	void get_variables(std::set<std::string>&);
+	bool defines_functions(void);
+	bool yields(void);
+};
+
+/*
+ * for(var in exp) body, over an array's elements, a dictionary's keys
+ * or a generator's values. var is a local of the function it's in.
+ */
+class ForStmt : public Statement{
+	private:
+	std::string var;
+	ExprPtr exp;
+	BlockStmt *body;
+
+	public:
+	ForStmt(const std::string&, ExprPtr, BlockStmt *);
+	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
+	virtual void find_DeclareStmts(std::vector<std::string>&);
+	void get_variables(std::set<std::string>&);
+	bool defines_functions(void);
+	bool yields(void);
+};
+
+/*
+ * yield exp; in a generator, see generator.hpp.
+ */
+class YieldStmt : public Statement{
+	private:
+	ExprPtr exp;
+
+	public:
+	YieldStmt(ExprPtr);
+	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
+	void get_variables(std::set<std::string>&);
+	bool yields(void){ return true; }
 };
 
 class FunctionStmt : public Statement{
 	private:
 	std::string name;
 	std::vector<std::string> arguments;
-	std::shared_ptr<BlockStmt>body;
+	BlockStmt *body;
 
 	public:
 	FunctionStmt(const std::string&, std::initializer_list<std::string>, 
-				std::shared_ptr<BlockStmt>);
+				BlockStmt *);
 	FunctionStmt(const std::string&, std::vector<std::string>, 
-				std::shared_ptr<BlockStmt>);
+				BlockStmt *);
 	void emit(CompilationState&, ScopeInfo&, std::vector<Instruction>&);
+	std::vector<std::string> &get_arguments(void){ return arguments; }
+	ExprPtr returned(void);
+	bool defines_functions(void){ return true; }
 };
 
 class SetFieldStmt : public Statement{
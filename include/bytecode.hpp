@@ -0,0 +1,197 @@
+#ifndef BYTECODE_HPP
+#define BYTECODE_HPP
+
+#include <vector>
+#include <map>
+#include <string>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+#include "instruction.hpp"
+
+/*
+ * The packed form a program is run in, once labels have been resolved.
+ *
+ * Every instruction is a single 32 bit word: the low byte holds the
+ * opcode and the upper 24 bits a signed operand. Strings, floats and
+ * pointers live in pools (strings are interned) and the operand is
+ * their index. An int operand that doesn't fit in 24 bits sets
+ * WIDE_BIT in the opcode byte and is stored in the wide pool instead.
+ *
+ * Instructions keep their positions, so an ip means the same thing
+ * here as it does in the Instruction stream the Program was built from.
+ *
+ * A Program never changes once it has been built, so isolates running
+ * the same script share one. Each runs it through a ProgramView of its
+ * own, which holds whatever the isolate adds to or patches in it.
+ *
+ * A Program can be saved to a .pjb file and loaded again without
+ * parsing. The file is a PjbHeader followed by these sections, each a
+ * multiple of 4 bytes and in the machine's byte order:
+ * 	functions	a FunctionProto for each function
+ * 	names		offsets into the string data, then the string data
+ * 	floats
+ * 	wide
+ * 	code
+ * Programs with pointer operands (FFI_CALL) can't be saved.
+ */
+
+typedef uint32_t Code;
+
+#define PJB_MAGIC "PJB"
+#define PJB_VERSION 3
+
+typedef struct PjbHeader{
+	char magic[4];
+	uint32_t version;
+	uint32_t opcodes;	// the file is only valid for the same instruction set
+	uint32_t functions;
+	uint32_t names;
+	uint32_t string_bytes;
+	uint32_t floats;
+	uint32_t wide;
+	uint32_t code;
+} PjbHeader;
+
+#define WIDE_BIT 0x80
+#define OPCODE_MASK 0x7f
+#define OPERAND_MAX ((1 << 23) - 1)
+#define OPERAND_MIN (-(1 << 23))
+
+static_assert(CLOS_LBL < WIDE_BIT, "opcodes must fit in 7 bits");
+
+/*
+ * A function's code is the range [start, end) of the program, starting
+ * with its LABEL. Functions are laid out after the top level, so code
+ * that isn't called stays out of the way of code that is.
+ */
+typedef struct FunctionProto{
+	int32_t name;	// index into the names, -1 for closures
+	int32_t start, end;
+	int32_t arity;
+	int32_t frame_size;
+} FunctionProto;
+
+class Program{
+	private:
+	// the code built here, loaded programs run from the mapping
+	std::vector<Code> built;
+	const Code *code = nullptr;
+	int count = 0;
+
+	std::vector<char *> names;
+	std::map<std::string, int> name_index;
+	std::vector<float> floats;
+	std::vector<void *> pointers;
+	std::vector<int32_t> wide;
+
+	// names before this point live in the mapping
+	int mapped_names = 0;
+	void *mapping = nullptr;
+	size_t mapping_size = 0;
+
+	int intern(const char *);
+	Code encode(Instruction);
+	bool valid(void) const;
+	void add_functions(const std::vector<CodeObject> &);
+
+	Program(void) {}
+
+	public:
+	// named ones are bound to globals on start up
+	std::vector<FunctionProto> functions;
+
+	/*
+	 * Packs the code link_code() laid out for these code objects.
+	 */
+	Program(const std::vector<Instruction> &, const std::vector<CodeObject> &);
+	~Program();
+
+	/*
+	 * Writes the program to a .pjb file, returns false on failure.
+	 */
+	bool save(const char *) const;
+
+	/*
+	 * Maps a .pjb file, returns nullptr if it isn't one, was
+	 * built for other opcodes or indexes outside its sections.
+	 */
+	static Program *load(const char *);
+
+	const char *name(int index) const { return names[index]; }
+
+	int size(void) const { return count; }
+
+	Instruction operator[](int ip) const{
+		Code c = code[ip];
+		Instruction i;
+		i.op = (enum OpCode)(c & OPCODE_MASK);
+		int32_t operand = (int32_t)c >> 8;
+		if(c & WIDE_BIT) operand = wide[operand];
+		switch(instruction_types[i.op]){
+			case String: i.str = names[operand]; break;
+			case Float: i.f = floats[operand]; break;
+			case Ptr: i.ptr = pointers[operand]; break;
+			default: i.i = operand; break;
+		}
+		return i;
+	}
+
+	// bytes taken by the code and by the pools
+	size_t code_size(void) const;
+	size_t pool_size(void) const;
+};
+
+/*
+ * A Program as one isolate runs it.
+ *
+ * Code the isolate adds while it runs (specialised copies, functions
+ * compiled lazily) goes after the end of the shared code, unpacked.
+ * The only instructions ever patched are function labels (with
+ * SPEC_ENTRY, or the jump out of a lazily compiled stub) and foreign
+ * calls, which become FFI_CALLs once their symbol is resolved. So
+ * patches are kept in a side table that is only looked at when one of
+ * those is fetched, and everything else comes straight from the
+ * shared code.
+ */
+class ProgramView{
+	private:
+	std::shared_ptr<const Program> program;
+	int shared_size;
+	std::vector<Instruction> added;
+	std::unordered_map<int, Instruction> patched;	// by ip
+
+	public:
+	// the program's protos then those of code added to it
+	std::vector<FunctionProto> functions;
+
+	ProgramView(std::shared_ptr<const Program>);
+
+	const Program &shared(void) const { return *program; }
+	const char *name(int index) const { return program->name(index); }
+
+	int size(void) const { return shared_size + added.size(); }
+
+	Instruction operator[](int ip) const{
+		if(ip >= shared_size) return added[ip - shared_size];
+		Instruction i = (*program)[ip];
+		if((i.op == LABEL || i.op == FFI_CALL_SYM) && !patched.empty()){
+			auto found = patched.find(ip);
+			if(found != patched.end()) return found->second;
+		}
+		return i;
+	}
+
+	// in the shared code only LABELs and FFI_CALL_SYMs can be replaced
+	void set(int ip, Instruction);
+	void push_back(Instruction i){ added.push_back(i); }
+
+	/*
+	 * Records the protos of code objects that have been added,
+	 * they're never bound to globals so their names aren't kept.
+	 */
+	void add_functions(const std::vector<CodeObject> &);
+};
+
+#endif
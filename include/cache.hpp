@@ -0,0 +1,36 @@
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include <string>
+
+#include "bytecode.hpp"
+
+/*
+ * An on disk cache of compiled programs, kept under
+ * $XDG_CACHE_HOME/psuedo-js (or ~/.cache/psuedo-js).
+ *
+ * Entries are .pjb files named by a hash of the source text, the
+ * bytecode version, the parser binary and the options the program was
+ * compiled with, so editing a script simply stops its old entry from
+ * being found. Entries are written to a temporary file and renamed
+ * into place, which means concurrent processes only ever see whole
+ * files.
+ *
+ * Loading an entry touches it. Whenever one is stored, the entries
+ * used least recently are removed until the cache is back under
+ * CACHE_MAX_BYTES, so the ones old scripts and old parsers left
+ * behind don't pile up.
+ */
+
+#define CACHE_MAX_BYTES (64 << 20)
+
+/*
+ * The cache file for a source text, or an empty
+ * string if there is nowhere to keep the cache.
+ */
+std::string cache_path(const std::string &source, const std::string &options);
+
+Program *cache_load(const std::string &path);
+void cache_store(const Program &, const std::string &path);
+
+#endif
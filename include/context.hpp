@@ -3,18 +3,35 @@
 
 #include "object.hpp"
 
-class Context{
-	private:
+#include <ostream>
+#include <unordered_map>
+#include <unordered_set>
+
+/*
+ * The call frames and return addresses of one fiber.
+ */
+typedef struct Stack{
 	/*
 	 * Essentially a stack of call frames.
 	 */
-	std::list<std::vector<ObjPtr>> stack;
+	std::list<std::vector<ObjPtr>> frames;
 
 	//stores the return address from jmp_lnk
 	std::vector<int> ret_stack;
+} Stack;
+
+class Context{
+	private:
+	Stack main;
+	// the stack being run, switching fibers only changes this
+	Stack *stack = &main;
+	// the other fibers' stacks, which the context owns
+	std::unordered_set<Stack *> fibers;
 
 	//Stores handles for FFI
 	std::map<std::string, void*> ffi_handles;
+	// "module::symbol" to the function dlsym() found for it
+	std::unordered_map<std::string, void*> ffi_symbols;
 
 	public:
 	Context();
@@ -24,6 +41,7 @@ class Context{
 
 	ObjPtr get(int);
 	void put(ObjPtr, int);
+	int frame_size(void);
 
 	void push(ObjPtr);
 	ObjPtr pop(void);
@@ -39,10 +57,38 @@ class Context{
 	int ret(ObjPtr);
 	void link(int lnk);
 
-	void garbage_collect(void);
+	/*
+	 * Does what PUSH_FRAME and JMP_CLOS would with the arguments,
+	 * returning to ret, gives the address to jump to.
+	 */
+	int enter(Closure *, const std::vector<ObjPtr> &args, int ret);
+
+	/*
+	 * Returns the object like ret() would, but moves the frame onto
+	 * the stack given instead of popping it, where it returns into
+	 * ret. Gives the address returned to.
+	 */
+	int detach(ObjPtr, Stack *, int ret);
+
+	// a stack with an empty bottom frame for a new fiber
+	Stack *new_stack(void);
+	void free_stack(Stack *);
+	Stack *main_stack(void){ return &main; }
+	// makes the stack the one that is run, returns the old one
+	Stack *switch_stack(Stack *);
+
+	// frees what the stack can't reach in the current heap
+	void garbage_collect(std::ostream &);
 
 	bool ffi_load(std::string);
-	bool ffi_call_sym(std::string);
+	/*
+	 * Looks the symbol up the first time it's asked for and gives
+	 * the same function after that, nullptr if it can't be found.
+	 */
+	void *ffi_resolve(const char *);
+	bool ffi_call_sym(const char *);
+	// calls a function ffi_resolve() gave on the current frame
+	void ffi_call(void *);
 	
 };
 
@@ -0,0 +1,97 @@
+#ifndef FIBER_HPP
+#define FIBER_HPP
+
+#include <vector>
+#include <deque>
+#include <functional>
+
+#include "object.hpp"
+#include "context.hpp"
+
+/*
+ * Fibers: closures that take turns running in one isolate, on the
+ * thread running it.
+ *
+ * 	fiber(f, args...)	starts f as a new fiber, giving its number
+ * 	yield()			lets the next fiber that is ready run
+ * 	join(n)			waits for fiber n to return, giving its result
+ * 	channel()		makes a channel, giving its number
+ * 	chan_send(c, value)	queues value on channel c
+ * 	chan_receive(c)		waits for a value on channel c
+ *
+ * The script's top level is fiber 0. Every fiber has its own Stack of
+ * frames and return addresses in the Context, so switching fibers
+ * just changes which stack the Context uses. A new fiber doesn't run
+ * until the running one yields, waits or finishes. Fibers that are
+ * ready take turns in the order they became ready.
+ *
+ * A fiber returns into FIBER_EXIT, which the interpreter hands to
+ * exit(). Once the top level is done the other fibers run until they
+ * have all finished, or until every one left is waiting, which would
+ * otherwise never end.
+ *
+ * Switching only happens in the interpreter's own loop. In code run by
+ * the parallel builtins yield() does nothing, and join() or
+ * chan_receive() that would have to wait give null instead.
+ */
+
+#define FIBER_EXIT -2	// the return address at the bottom of a fiber
+
+class Fibers{
+	private:
+	typedef struct Fiber{
+		Stack *stack;
+		int ip = 0;	// where it carries on from
+		bool done = false;
+		ObjPtr result;
+		std::vector<int> joiners;	// fibers waiting for this one
+	} Fiber;
+
+	typedef struct Channel{
+		std::deque<ObjPtr> values;
+		std::deque<int> receivers;	// fibers waiting for a value
+	} Channel;
+
+	Context &ctxt;
+	std::vector<Fiber> fibers;
+	std::vector<Channel> channels;
+	std::deque<int> ready;
+	int running = 0;
+
+	// runs the next fiber that is ready, or stops if there isn't one
+	int next(void);
+
+	public:
+	/*
+	 * Called with false whenever fibers switch, and with true when
+	 * none are ready, when it may block. Returns false if it has
+	 * nothing that could wake a fiber.
+	 */
+	std::function<bool(bool block)> idle;
+
+	Fibers(Context &);
+
+	int current(void){ return running; }
+	/*
+	 * Stops the running fiber until it is woken, leaving what the
+	 * instruction at ip popped on the stack so it runs again.
+	 */
+	int suspend(int ip, ObjPtr retry);
+	void wake(int fiber){ ready.push_back(fiber); }
+
+	// all of these return the ip to carry on from, maybe in another fiber
+	int start(int ip, int arg_count);
+	int yield(int ip, bool can_switch);
+	int join(int ip, bool can_switch);
+	int channel(int ip);
+	int send(int ip);
+	int receive(int ip, bool can_switch);
+
+	/*
+	 * Called when the running fiber returns into FIBER_EXIT,
+	 * or when the top level has finished.
+	 */
+	int exit(void);
+};
+
+#endif
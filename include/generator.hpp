@@ -0,0 +1,64 @@
+#ifndef GENERATOR_HPP
+#define GENERATOR_HPP
+
+#include <vector>
+
+#include "object.hpp"
+#include "context.hpp"
+
+/*
+ * Generators: functions with a yield statement in them.
+ *
+ * 	fun count(n){ let i = 0; while(i < n){ yield i; i = i + 1; } }
+ * 	for(x in count(10)){ ... }
+ *
+ * Calling one doesn't run its body. Its code starts with GEN_START,
+ * which moves the call's frame onto a Stack of the Generator's own and
+ * returns the Generator instead. A for loop resumes it by switching the
+ * Context to that stack and jumping to where it left off. yield hands
+ * back a value and switches back again, so the frame, its locals and
+ * whatever it was in the middle of stay as they were until the next
+ * value is asked for. Nothing is copied either way. When the body
+ * returns, into GENERATOR_EXIT, the loop ends and the frame is freed.
+ *
+ * Generators run on the stack of whatever resumes them, inside another
+ * generator if need be, so fibers can't switch while one is running.
+ */
+
+#define GENERATOR_EXIT -3	// the return address at the bottom of a generator
+
+class Generator : public Iterator{
+	public:
+	Stack *stack;	// its frame, null once it has returned
+	int ip;		// where it carries on from
+	// what is running it and where that carries on from, while it runs
+	Stack *caller = nullptr;
+	int resume = -1;
+
+	Generator(Stack *, int ip);
+	~Generator();
+
+	void mark(void);
+	std::ostream& show(std::ostream&) const;
+};
+
+class Generators{
+	private:
+	Context &ctxt;
+	std::vector<Generator *> running;	// innermost last
+
+	public:
+	Generators(Context &);
+
+	bool busy(void){ return !running.empty(); }
+
+	// all of these return the ip to carry on from
+	int start(int ip);
+	// for ITER_NEXT on a generator, which is on top of the stack
+	int resume(int ip);
+	int yield(int ip);
+	// called when the running generator returns into GENERATOR_EXIT
+	int exit(void);
+};
+
+#endif
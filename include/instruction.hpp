@@ -3,6 +3,7 @@
 
 #include <string>
 #include <vector>
+#include <atomic>
 #include <iostream>
 
 #include "context.hpp"
@@ -15,13 +16,15 @@ enum OpCode{
 	DROP,
 
 
-	LABEL, //NOP stores a label
+	LABEL, //NOP stores a label number
 
 	JMP_CND,
 	JMP_LNK,
 	JMP_LBL, // transformed to JMP during preprocessing
 	JMP,
 	JMP_CLOS,
+	LOOP_LBL, // loop back edge, transformed to LOOP during preprocessing
+	LOOP,	  // a JMP that the jit counts
 
 	NEW_OBJ,
 	NEW_VEC,
@@ -59,6 +62,71 @@ enum OpCode{
 	GT,
 	GTE,
 
+	// unchecked versions of the above, only emitted
+	// when both operands are known to be ints
+	ADD_II,
+	MIN_II,
+	MUL_II,
+	DIV_II,
+	MOD_II,
+	LT_II,
+	LTE_II,
+	GT_II,
+	GTE_II,
+
+	// int ops speculated from type feedback, these check their
+	// operands and deoptimise by jumping i if they aren't ints
+	ADD_IG,
+	MIN_IG,
+	MUL_IG,
+	DIV_IG,
+	MOD_IG,
+	LT_IG,
+	LTE_IG,
+	GT_IG,
+	GTE_IG,
+	SPEC_ENTRY,	// replaces the label of a function that has been specialised
+	SPEC_CALL,	// calls a specialised function directly if the closure is for it
+	SPEC_LOOKUP,	// LOOKUP_S guarded on the type it has always given
+	LAZY_COMPILE,	// the body of a function that hasn't been compiled yet
+
+	// Actors, handled by the interpreter loop
+	SPAWN,		// starts the closure under i arguments on an isolate of its own
+	SEND,		// sends the top of the stack to the mailbox under it, moving its arrays if i
+	RECEIVE,	// waits for a message
+
+	// Parallel builtins, handled by the interpreter loop
+	PAR_MAP,	// maps the closure on top of the stack over the array under it
+	PAR_REDUCE,	// folds the closure under the initial value over the array under that
+	PAR_FOR,	// calls the closure on top of the stack with each int in the range under it
+
+	// Fibers, handled by the interpreter loop
+	FIBER,		// starts the closure under i arguments as a fiber
+	YIELD,		// lets the next fiber run
+	JOIN,		// waits for the fiber on top of the stack to finish
+	CHANNEL,	// makes a channel
+	CHAN_SEND,	// queues the top of the stack on the channel under it
+	CHAN_RECEIVE,	// waits for a value on the channel on top of the stack
+
+	// Asynchronous I/O, handled by the IoLoop
+	IO_READ,	// starts reading the file named on top of the stack
+	IO_WRITE,	// starts writing the top of the stack to the file named under it
+	IO_LISTEN,	// listens on the socket named on top of the stack
+	IO_ACCEPT,	// starts accepting a connection on the listener on top of the stack
+	IO_CONNECT,	// starts connecting to the socket named on top of the stack
+	IO_SEND,	// starts sending the top of the stack on the socket under it
+	IO_RECV,	// starts receiving on the socket on top of the stack
+	IO_CLOSE,	// closes the handle on top of the stack
+	AWAIT,		// waits for the operation on top of the stack
+
+	// Generators, GEN_START, GEN_YIELD and ITER_NEXT on a
+	// generator are handled by the interpreter loop
+	GEN_START,	// returns a generator that carries on from the next instruction
+	GEN_YIELD,	// hands the top of the stack to the loop running the generator
+	ITER,		// gives an iterator over what is on top of the stack
+	ITER_NEXT,	// moves the iterator on top of the stack on, giving whether it could
+	ITER_VALUE,	// gives the value the iterator on top of the stack is at
+
 	// Foreign function interface
 	FFI_LOAD,	//loads lib
 	FFI_CALL_SYM,	//calls based on sym
@@ -86,23 +154,42 @@ Instruction push_frame(int);
 Instruction ret(void);
 Instruction drop(void);
 
-Instruction label(const char *);
-Instruction label(std::string);
+Instruction label(int);
 
 Instruction jmp_cnd(int);
 Instruction jmp_lnk(int);
 Instruction jmp(int);
-Instruction jmp_lbl(const char *);
-Instruction jmp_lbl(std::string);
+Instruction jmp_lbl(int);
 Instruction jmp_closure(void);
-
-Instruction jmp(const char *);
-Instruction jmp(std::string);
+Instruction loop_lbl(int);
+Instruction spec_entry(int);
+Instruction spec_call(int);
+Instruction spec_lookup(int);
+Instruction lazy_compile(int);
+Instruction spawn(int);
+Instruction send(bool move);
+Instruction receive(void);
+Instruction par_map(void);
+Instruction par_reduce(void);
+Instruction par_for(void);
+Instruction fiber(int);
+Instruction yield(void);
+Instruction join(void);
+Instruction channel(void);
+Instruction chan_send(void);
+Instruction chan_receive(void);
+// any of the IO_ instructions or AWAIT, which have no operand
+Instruction io(enum OpCode);
+Instruction gen_start(void);
+Instruction gen_yield(void);
+Instruction iter(void);
+Instruction iter_next(void);
+Instruction iter_value(void);
 
 Instruction new_obj(void);
 Instruction new_vec(void);
 Instruction new_unit(void);
-Instruction new_closure(std::string);
+Instruction new_closure(int);
 Instruction new_string(const char*);
 
 Instruction closure_capture(int);
@@ -137,13 +224,67 @@ Instruction ffi_load(const char *);
 Instruction ffi_call_sym(const char *);
 Instruction ffi_call(void *);
 
-void process_labels(std::vector<Instruction> &ins);
+/*
+ * How many values an instruction pops and pushes
+ * on the current frame.
+ */
+void stack_effect(Instruction, int *pops, int *pushes);
+
+/*
+ * Labels are numbers handed out by a LabelTable as code is emitted,
+ * they only have to be unique within a program. They're handed out
+ * atomically so functions can be compiled on several threads at once.
+ */
+class LabelTable{
+	private:
+	std::atomic<int> count{0};
+
+	public:
+	LabelTable(void){ }
+	LabelTable(const LabelTable &l) : count(l.size()) { }
+	LabelTable &operator=(const LabelTable &l){
+		count = l.size();
+		return *this;
+	}
+
+	int new_label(void){ return count++; }
+	int size(void) const { return count; }
+};
+
+/*
+ * A function, or the top level, compiled on its own in label form.
+ * Functions start with their LABEL and never run off their end.
+ */
+typedef struct CodeObject{
+	std::string name;	// empty for closures and the top level
+	int label = -1;		// -1 for the top level
+	int arity = 0;
+	int frame_size = 0;	// arguments, captures, locals and inlining slots
+	std::vector<Instruction> code;
+	int start = -1, end = -1;	// where link_code() put it
+} CodeObject;
+
+/*
+ * Resolves JMP_LBL, LOOP_LBL and CLOS_LBL in a single pass, forward
+ * references are chained through the instructions waiting on a label
+ * and patched when it is reached.
+ */
+void process_labels(std::vector<Instruction> &ins, const LabelTable &, int base = 0);
+
+/*
+ * Lays the code objects out one after the other, the top level first
+ * with a RET so it stops before the functions, and resolves the labels.
+ * The code is meant to go at base in the program.
+ */
+std::vector<Instruction> link_code(std::vector<CodeObject> &, const LabelTable &,
+								   int base = 0);
 
 enum ParamType { None, Int, Float, String, Index, Ptr };
 const std::string instruction_names[]{
 	"SHOW_FRAME", "PUSH_FRAME", "RET", "DROP",
 	"LABEL",
 	"JMP_CND", "JMP_LNK", "JMP_LBL", "JMP", "JMP_CLOS",
+	"LOOP_LBL", "LOOP",
 	"NEW_OBJ", "NEW_VEC", "NEW_CLOS", "NEW_UNIT", "NEW_STRING",
 	"CLOS_CAP",
 	"LOAD_IMM_F", "LOAD_IMM_I", "LOAD_STK", "SET_STK",
@@ -152,13 +293,25 @@ const std::string instruction_names[]{
 	"LOOKUP_V", "INSERT_V",
 	"ADD", "MIN", "MUL", "DIV", "MOD",
 	"EQ", "LT", "LTE", "GT", "GTE",
+	"ADD_II", "MIN_II", "MUL_II", "DIV_II", "MOD_II",
+	"LT_II", "LTE_II", "GT_II", "GTE_II",
+	"ADD_IG", "MIN_IG", "MUL_IG", "DIV_IG", "MOD_IG",
+	"LT_IG", "LTE_IG", "GT_IG", "GTE_IG", "SPEC_ENTRY", "SPEC_CALL", "SPEC_LOOKUP",
+	"LAZY_COMPILE",
+	"SPAWN", "SEND", "RECEIVE",
+	"PAR_MAP", "PAR_REDUCE", "PAR_FOR",
+	"FIBER", "YIELD", "JOIN", "CHANNEL", "CHAN_SEND", "CHAN_RECEIVE",
+	"IO_READ", "IO_WRITE", "IO_LISTEN", "IO_ACCEPT", "IO_CONNECT",
+	"IO_SEND", "IO_RECV", "IO_CLOSE", "AWAIT",
+	"GEN_START", "GEN_YIELD", "ITER", "ITER_NEXT", "ITER_VALUE",
 	"FFI_LOAD", "FFI_CALL_SYM", "FFI_CALL",
 	"CLOS_LBL"
 };
 const ParamType instruction_types[]{
-	None, None, None, None,
-	String,
-	Int, Int, String, Int, None,
+	None, Int, None, None,
+	Int,
+	Int, Int, Int, Int, None,
+	Int, Int,
 	None, None, Int, None, String,
 	Int,
 	Float, Int, Int, Int,
@@ -167,7 +320,17 @@ const ParamType instruction_types[]{
 	None, None,
 	None, None, None, None, None,
 	None, None, None, None, None,
+	None, None, None, None, None,
+	None, None, None, None,
+	Int, Int, Int, Int, Int,
+	Int, Int, Int, Int, Int, Int, Int, Int,
+	Int, Int, None,
+	None, None, None,
+	Int, None, None, None, None, None,
+	None, None, None, None, None,
+	None, None, None, None,
+	None, None, None, None, None,
 	String, String, Ptr,
-	String
+	Int
 };
 #endif
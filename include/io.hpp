@@ -0,0 +1,132 @@
+#ifndef IO_HPP
+#define IO_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "object.hpp"
+#include "instruction.hpp"
+#include "context.hpp"
+#include "fiber.hpp"
+
+/*
+ * Asynchronous file and local socket I/O for the fibers of an isolate.
+ *
+ * 	io_read(path)		reads a whole file, giving a string
+ * 	io_write(path, string)	replaces a file, giving the bytes written
+ * 	io_listen(path)		listens on a unix socket, giving its handle now
+ * 	io_accept(listener)	waits for a connection, giving its handle
+ * 	io_connect(path)	connects to a unix socket, giving its handle
+ * 	io_send(handle, string)	sends all of string, giving the bytes sent
+ * 	io_recv(handle)		receives what has arrived, "" once it's closed
+ * 	io_close(handle)	closes a handle now
+ * 	await(operation)	waits for an operation, giving its result
+ *
+ * Apart from io_listen() and io_close() they start an operation and
+ * give its number straight away, so a fiber can have any number of
+ * them going at once. await() suspends the fiber until its operation
+ * completes, and other fibers run in the meantime. Awaiting anything
+ * that isn't an operation gives it back, and each operation can only
+ * be awaited once. Operations that fail give null.
+ *
+ * Handles are only good for the loop that gave them out; using
+ * anything else as one fails, or does nothing for io_close(). Of the
+ * operations that finish before anything awaits them, only the last
+ * IO_UNCLAIMED keep their results, and an older one is no longer an
+ * operation as far as await() is concerned.
+ *
+ * Sockets are non-blocking and watched with epoll. epoll can't watch
+ * regular files, so file operations, and connecting, run on a few
+ * threads of their own and wake the loop through an eventfd when they
+ * finish. Their results are turned into objects on the isolate's own
+ * thread, when they are awaited.
+ *
+ * When no fiber is ready and some are awaiting, the scheduler waits in
+ * epoll_wait(). Operations nobody awaits don't keep the script running,
+ * but files being written are finished before it exits.
+ */
+
+#define IO_THREADS 4
+#define IO_RECV_SIZE 65536
+#define IO_UNCLAIMED 1024
+
+class IoLoop{
+	private:
+	typedef struct Operation{
+		int id;
+		int op;			// the opcode that started it
+		int fd = -1;		// the socket it's on
+		std::string path;
+		std::string data;	// what is written or sent, or what was read
+		long value = 0;
+		bool done = false;
+		bool failed = false;
+		std::vector<int> waiters;	// fibers awaiting it
+	} Operation;
+
+	Fibers &fibers;
+	Context &ctxt;
+	int epoll_fd = -1;
+	int wake_fd = -1;	// written by the threads when they finish
+	int next_id = 1;	// 0 is null, which is never an operation
+	int pending = 0;	// operations that haven't finished
+	int awaiting = 0;	// fibers suspended by await()
+	std::unordered_map<int, Operation> ops;
+	std::deque<int> unclaimed;	// finished with nobody awaiting, oldest first
+	std::set<int> handles;	// the sockets it has opened
+	// the operations waiting on each socket, and the events asked for
+	std::map<int, std::vector<int>> watching;
+	std::map<int, uint32_t> events;
+
+	// file operations
+	std::mutex lock;
+	std::condition_variable queued;
+	std::deque<Operation *> work;
+	std::vector<int> finished;
+	std::vector<std::thread> threads;
+	bool stopping = false;
+
+	int begin(int op, int fd);
+	// the socket a handle is for, -1 if it isn't one of ours
+	int socket_of(ObjPtr);
+	void run_on_thread(int id);
+	void thread_main(void);
+	// tries a socket operation, watching its socket if it has to wait
+	void attempt(int id);
+	bool try_socket(Operation &);
+	void watch(int fd);
+	void complete(int id);
+	ObjPtr result(Operation &);
+
+	public:
+	IoLoop(Fibers &, Context &);
+	IoLoop(const IoLoop &) = delete;
+	IoLoop &operator=(const IoLoop &) = delete;
+	// finishes the file operations still queued
+	~IoLoop();
+
+	/*
+	 * Called instead of executing one of the IO_ instructions or
+	 * AWAIT at ip, returns the ip the interpreter should continue
+	 * from, which may be in another fiber.
+	 */
+	int execute(Instruction, int ip, bool can_switch);
+
+	/*
+	 * Handles whatever has finished, waiting for something to if
+	 * block is set. Returns false if nothing is outstanding.
+	 */
+	bool poll(bool block);
+
+	// whether fibers are awaiting operations
+	bool busy(void){ return awaiting > 0; }
+};
+
+#endif
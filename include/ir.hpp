@@ -0,0 +1,185 @@
+#ifndef IR_HPP
+#define IR_HPP
+
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+
+#include "instruction.hpp"
+
+/*
+ * A mid level SSA ir that sits between emit() and process_labels().
+ *
+ * emit() produces a code object of label form bytecode for each function
+ * (and the top level) whose only control flow comes from IfStmt,
+ * WhileStmt, BreakStmt, ContinueStmt and RET. Each one is split into basic blocks, its
+ * stack code is turned into a graph of values in SSA form, the passes
+ * below are run and the result is lowered back into label form.
+ * Arithmetic whose operands are proven to be ints is lowered to the
+ * unchecked typed opcodes.
+ *
+ * Locals (stack slots) are renamed into SSA values. Globals stay as loads
+ * and stores that are kept in order with everything else touching memory.
+ * Lowering keeps every SET_STK, so a value read from a local can always be
+ * found in some slot again. Values that can't (common subexpressions,
+ * hoisted values) are given extra temporary slots in the frame.
+ *
+ * Anything the builder doesn't understand leaves the function untouched.
+ */
+
+enum IrKind{
+	IR_OP,		// a single instruction, see IrValue::ins
+	IR_CALL,	// PUSH_FRAME followed by JMP_CLOS or a foreign call
+	IR_STORE,	// SET_STK of a local
+	IR_PHI,
+	IR_ENTRY,	// the value a local has when the function is entered
+};
+
+enum IrExit{
+	EXIT_FALL,	// falls into IrBlock::next
+	EXIT_JUMP,	// JMP_LBL to IrBlock::target
+	EXIT_LOOP,	// LOOP_LBL to IrBlock::target, kept for the jit
+	EXIT_COND,	// JMP_CND to target, falls through to next
+	EXIT_RET,
+	EXIT_END,	// falls off the end of the function
+};
+
+// what infer_types() knows about a value, otherwise a PointerType
+#define IR_ANY_TYPE -1
+#define IR_NO_TYPE -2	// not seen yet
+
+typedef struct IrBlock IrBlock;
+
+typedef struct IrValue{
+	int id;
+	enum IrKind kind;
+	Instruction ins;	// IR_OP, and the call instruction of IR_CALL
+	std::vector<struct IrValue *> args;	// in the order they were pushed
+	IrBlock *block;
+	int var = -1;		// local of IR_STORE, IR_PHI and IR_ENTRY
+	struct IrValue *replaced = nullptr;	// set when a pass replaces it
+	int type = IR_ANY_TYPE;
+	bool dead = false;
+} IrValue;
+
+struct IrBlock{
+	int id;
+	int first = 0, last = -1;	// item range while building
+	std::vector<IrValue *> phis;
+	std::vector<IrValue *> code;	// in program order
+	std::vector<IrBlock *> preds;
+
+	enum IrExit exit = EXIT_END;
+	IrBlock *target = nullptr;
+	IrBlock *next = nullptr;
+	IrValue *operand = nullptr;	// condition of EXIT_COND, result of EXIT_RET
+
+	// ssa construction
+	std::map<int, IrValue *> entry;	// value of each local on entry
+	std::map<int, IrValue *> defs;	// value of each local on exit
+	std::map<int, IrValue *> incomplete;
+	bool sealed = false;
+	bool filled = false;
+
+	bool reachable = false;
+	int rpo = -1;
+	int label = -1;	// given one when lowering jumps to it
+	IrBlock *idom = nullptr;
+	std::vector<IrBlock *> children;	// in the dominator tree
+};
+
+/*
+ * An instruction of the function.
+ */
+typedef struct IrItem{
+	int raw;	// index in the original stream
+	Instruction ins;
+} IrItem;
+
+class IrFunction{
+	private:
+	const std::vector<Instruction> &in;
+	LabelTable &labels;
+	int begin, end;
+	bool top;
+	bool ok = true;
+
+	std::vector<Instruction> head;	// function label and space for locals
+	std::vector<IrItem> items;
+
+	std::vector<IrBlock *> blocks;	// in layout order
+	std::vector<IrValue *> values;
+	std::set<int> vars;
+
+	// building
+	IrValue *new_value(enum IrKind, IrBlock *);
+	IrBlock *new_block(void);
+	void build(void);
+	void fill(IrBlock *);
+	void seal(IrBlock *);
+	IrValue *read_variable(int, IrBlock *);
+	IrValue *add_phi_operands(IrValue *);
+	IrValue *new_phi(int, IrBlock *);
+
+	// passes
+	void remove_trivial_phis(void);
+	void scalar_replace(void);
+	void forward_globals(void);
+	void dominators(void);
+	void gvn(IrBlock *, std::map<std::vector<long>, IrValue *> &);
+	void licm(void);
+	void dce(void);
+	void infer_types(void);
+
+	// lowering
+	std::map<IrValue *, int> uses;
+	std::set<IrValue *> used_in_block;
+	std::map<IrValue *, int> temp_of;
+	std::set<IrValue *> at_position;
+	std::set<IrBlock *> needs_label;
+	int temp_base = 0;
+	int temp_count = 0;
+
+	bool dry;
+	bool changed;
+	std::vector<Instruction> *out;
+	IrBlock *block;
+	std::map<int, IrValue *> cur;
+	std::set<IrValue *> emitted;
+	std::deque<IrValue *> pending;
+
+	void count_uses(void);
+	bool threadable(IrBlock *);
+	IrBlock *thread(IrBlock *);
+	int label_of(IrBlock *);
+	void put(Instruction);
+	void violation(IrValue *);
+	int location(IrValue *);
+	void emit_operand(IrValue *);
+	void compute(IrValue *, bool inlined);
+	void emit_block(IrBlock *, IrBlock *next);
+	void emit_exit(IrBlock *, IrBlock *next);
+	bool lower(std::vector<Instruction> &);
+	void copy_items(std::vector<Instruction> &);
+
+	public:
+	IrFunction(const std::vector<Instruction> &, LabelTable &,
+			   int begin, int end, bool top);
+	~IrFunction();
+
+	/*
+	 * Appends the optimised function to the output, or the
+	 * original one if it couldn't be optimised. Returns the
+	 * number of temporaries added to the frame.
+	 */
+	int optimise(std::vector<Instruction> &);
+};
+
+/*
+ * Runs the ir passes over a function or the top
+ * level, new labels are taken from the table.
+ */
+void optimise(CodeObject &, LabelTable &);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef ISOLATE_HPP
+#define ISOLATE_HPP
+
+#include <ostream>
+
+#include "object.hpp"
+#include "context.hpp"
+
+/*
+ * An instance of the vm: a heap, the stack and FFI handles of its
+ * Context, and its globals.
+ *
+ * Objects are allocated in the heap of the isolate the thread has
+ * entered, and only the objects in that heap can be changed. Isolates
+ * on different threads can read the same objects, as the workers of
+ * parallel_map() and the like read their caller's, but never change
+ * them (other than replacing the elements of an array), so they need
+ * no locking. A thread enters an isolate for as long as it runs code
+ * in it, and an isolate is only ever entered by one thread at a time.
+ */
+class Isolate{
+	private:
+	Heap heap;
+	Heap *outer = nullptr;	// the heap before it was entered
+
+	public:
+	Context ctxt;
+	Dictionary *globals;
+	std::ostream &out;	// where the program's output goes
+
+	Isolate(std::ostream &);
+	Isolate(const Isolate &) = delete;
+	Isolate &operator=(const Isolate &) = delete;
+
+	void enter(void);
+	void leave(void);
+
+	// collects the heap, the isolate has to be entered
+	void garbage_collect(void){ ctxt.garbage_collect(out); }
+	// moves everything allocated in the isolate into another heap
+	void move_objects(Heap &to){ to.adopt(heap); }
+};
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef JIT_HPP
+#define JIT_HPP
+
+#include <vector>
+#include <map>
+
+#include "instruction.hpp"
+#include "bytecode.hpp"
+
+/*
+ * A tracing jit for hot while loops.
+ *
+ * Every LOOP instruction (the back edge of a while loop) bumps a counter
+ * belonging to the loop header it jumps to. Once a header gets hot we
+ * record the instructions executed during one iteration of the loop
+ * along with the types that were seen, then compile the recording
+ * into a trace of specialised operations protected by type guards.
+ *
+ * Entering a trace is an on-stack replacement: the loop is usually
+ * already running (often the single top level loop of a script) so the
+ * stack slots and globals the trace touches are copied out of the
+ * Context into an OsrFrame, and their types are guarded once on entry
+ * rather than on every load. When a guard fails the OsrFrame is written
+ * back (deoptimised) and the interpreter resumes at the instruction the
+ * guard was protecting.
+ */
+
+#define HOT_LOOP_THRESHOLD 50
+#define MAX_TRACE_LENGTH 512
+#define MAX_RECORD_ATTEMPTS 3
+// entries refused by the entry guards before a trace is thrown away
+#define MAX_ENTRY_FAILURES 8
+
+// stands in for "any type" when a trace doesn't know a value's type
+#define ANY_TYPE -1
+
+enum TraceOpCode{
+	T_GENERIC,	// falls back to step_instruction
+
+	T_LOAD_IMM_I,
+	T_LOAD_IMM_F,
+	T_LOAD_SLOT,	// type already known
+	T_LOAD_SLOT_G,	// guarded on type
+	T_SET_SLOT,
+	T_GUARD_SLOT,	// checks a slot still has its entry type
+
+	T_ADD_II, T_SUB_II, T_MUL_II, T_DIV_II, T_MOD_II,
+	T_EQ_II, T_LT_II, T_LTE_II, T_GT_II, T_GTE_II,
+
+	T_ADD_FF, T_SUB_FF, T_MUL_FF, T_DIV_FF,
+	T_LT_FF, T_LTE_FF, T_GT_FF, T_GTE_FF,
+
+	T_GUARD_TRUE,	// JMP_CND that was taken while recording
+	T_GUARD_FALSE,	// JMP_CND that fell through while recording
+};
+
+typedef struct TraceOp{
+	enum TraceOpCode op;
+	int ip;		// where to resume if this op side exits
+	int type;	// expected type for guarded loads
+	union{
+		int slot;	// index into the OsrFrame
+		int i;
+		float f;
+	};
+	Instruction ins;	// original instruction for T_GENERIC
+} TraceOp;
+
+/*
+ * A variable the trace keeps in its OsrFrame, either
+ * a stack slot of the current frame or a global.
+ */
+typedef struct TraceSlot{
+	int index;	// stack index, unused for globals
+	ObjPtr *cell;	// global variable, nullptr for stack slots
+	int type;	// type required on entry, ANY_TYPE if not read first
+} TraceSlot;
+
+typedef struct Trace{
+	int header;	// ip of the loop header the trace starts at
+	int entry_failures = 0;
+	std::vector<TraceSlot> slots;
+	std::vector<TraceOp> ops;
+} Trace;
+
+typedef struct OsrFrame{
+	std::vector<ObjPtr> slots;
+} OsrFrame;
+
+class TraceJit{
+	private:
+	ProgramView &program;
+	Dictionary *globals;
+
+	// counts back edges taken to each loop header
+	std::vector<int> hotness;
+	std::vector<int> attempts;
+	std::map<int, Trace> traces;
+
+	// recording state
+	bool recording = false;
+	int record_header = -1;
+	int record_end = -1;
+	std::vector<int> recorded_ips;
+	std::vector<int> recorded_types;
+
+	void start_recording(int header, int back_edge);
+	void abort_recording(void);
+	bool compile_trace(void);
+
+	/*
+	 * Moves the live variables into the OsrFrame, returns
+	 * false if they don't have the types the trace expects.
+	 */
+	bool osr_enter(Context *, Trace&, OsrFrame&);
+	void deoptimise(Context *, Trace&, OsrFrame&);
+	int run_trace(Context *, Trace&, OsrFrame&);
+
+	public:
+	bool enabled = true;
+	std::ostream *log = nullptr;	// where compiled traces are reported, if anywhere
+
+	TraceJit(ProgramView &, Dictionary *);
+
+	bool is_recording(void) { return recording; }
+
+	/*
+	 * Called before the instruction at ip is executed
+	 * while a trace is being recorded.
+	 */
+	void record(Context *, int ip);
+
+	/*
+	 * Called instead of executing a LOOP instruction,
+	 * returns the ip the interpreter should continue from.
+	 */
+	int back_edge(Context *, int ip);
+};
+
+#endif
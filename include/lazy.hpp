@@ -0,0 +1,91 @@
+#ifndef LAZY_HPP
+#define LAZY_HPP
+
+#include <vector>
+#include <map>
+#include <set>
+#include <string>
+
+#include "ast.hpp"
+#include "arena.hpp"
+#include "bytecode.hpp"
+
+/*
+ * Compiles function bodies the first time they are called.
+ *
+ * When the program is compiled a function's code object is only a
+ * stub, its LABEL followed by LAZY_COMPILE, so the bytecode for
+ * functions that never run is never built. The parse tree and the
+ * label form code objects are kept here until every body has been
+ * compiled.
+ *
+ * The first call runs into LAZY_COMPILE, which compiles the body
+ * (and any closures inside it) with the scope and inlining decisions
+ * it would have had, appends it to the end of the program and turns
+ * the stub's LABEL into a jump to it, so later calls never come back
+ * here. Closures already point at the stub, so they keep working.
+ *
+ * Bodies that define named functions are compiled straight away, as
+ * the functions have to be bound to globals before the program runs.
+ *
+ * Compiling eagerly on more than one thread also leaves stubs, then
+ * compiles all of them with compile_all(). Each thread has its own
+ * CompilationState and code objects, which are merged in the order
+ * the bodies were found once they're done, so the layout of the
+ * program doesn't depend on how the work was shared out.
+ */
+
+class LazyCompiler{
+	private:
+	std::map<std::string, FunctionStmt *> functions;
+	std::set<std::string> reassigned;
+	int compiled = 0;
+
+	// compiles a body, returning its code object and any new ones
+	std::vector<int> build(int n);
+
+	public:
+	bool enabled = true;
+	bool use_ir = true;
+	int inline_limit = 16;
+	int threads = 1;	// used by compile_all()
+
+	// the parse tree, freed once every body has been compiled
+	Arena arena;
+	LabelTable labels;
+	// label form, code[0] is the top level
+	std::vector<CodeObject> code;
+	std::vector<LazyBody> bodies;
+
+	/*
+	 * Keeps what later bodies need from the state
+	 * the program was compiled with.
+	 */
+	void save(CompilationState &);
+
+	// whether function bodies are left as stubs while the program is compiled
+	bool defers(void) const { return enabled || threads > 1; }
+
+	/*
+	 * Compiles every body that hasn't been compiled yet, returning
+	 * the code objects that have to be optimised.
+	 */
+	std::vector<int> compile_all(void);
+
+	// runs the ir over the code objects, spread over the threads
+	void optimise_all(const std::vector<int> &);
+
+	/*
+	 * Called instead of executing the LAZY_COMPILE at ip,
+	 * returns the ip the interpreter should continue from.
+	 */
+	int compile(ProgramView &, int ip);
+
+	/*
+	 * Compiles whatever hasn't been compiled yet and
+	 * links the whole program, for saving it.
+	 */
+	Program *finish(void);
+};
+
+#endif
@@ -6,16 +6,20 @@
 #include <map>
 #include <iterator>
 #include <string>
+#include <memory>
 
 
 class Closure;
 class Object;
+class Iterator;
+class Generator;
+class Heap;
 struct object_ptr;
 typedef struct object_ptr ObjPtr;
 
 // we have 4 bits to store this in so we can have
 // 8 fundamental types.
-enum PointerType {INT, FLOAT, CLOSURE, ARRAY, DICT, STRING} ;
+enum PointerType {INT, FLOAT, CLOSURE, ARRAY, DICT, STRING, ITERATOR, GENERATOR} ;
 
 /*
  * Base class for all heap allocated data structures.
@@ -27,13 +31,11 @@ class Object{
 	/*
 	 * this is stuff for the garbage collection
 	 */
-	static Object object_list;
-
 	Object *prev = nullptr;
 	Object *next = nullptr;
+	Heap *heap = nullptr;	// the heap whose list it's in
 
-	void insert_after(Object *o);
-	void remove(void);
+	friend class Heap;
 	protected:
 	bool active = false; //GC helper
 
@@ -41,16 +43,63 @@ class Object{
 	public:
 
 	Object(); 
+	// the heap deletes everything through an Object *
+	virtual ~Object() {}
+
+	/*
+	 * Whether it is in the heap of the thread running. Only those can
+	 * be changed, other threads may be reading the rest.
+	 */
+	bool local(void) const;
 
 	virtual void mark(void);
 	virtual std::ostream& show(std::ostream&) const;
 
 	friend std::ostream& operator<<(std::ostream&, const Object&);
+};
+
+/*
+ * The objects allocated by one isolate, kept in a list for the
+ * collector. New objects go in the heap of the thread allocating
+ * them, so threads with heaps of their own never share a list.
+ * Threads that haven't been given one share a process wide heap.
+ */
+class Heap{
+	private:
+	Object *objects = nullptr;
+
+	static Heap shared;
+	static thread_local Heap *current;
+
+	void insert(Object *);
+	void remove(Object *);
+
+	public:
+	Heap(void){ }
+	Heap(const Heap &) = delete;
+	Heap &operator=(const Heap &) = delete;
+	// frees whatever is left
+	~Heap();
+
+	// the heap objects are allocated in on this thread
+	static Heap *get(void){ return current; }
+	// returns the heap that was being used
+	static Heap *set(Heap *);
+
+	/*
+	 * Frees the objects that haven't been marked since the last
+	 * collection and clears the marks of the rest.
+	 */
+	void gc_delete(std::ostream &);
 
-	//these should probably be private
-	static void gc_delete(void);
+	// moves the objects of another heap into this one
+	void adopt(Heap &);
+
+	friend class Object;
 };
 
+inline bool Object::local(void) const { return heap == Heap::get(); }
+
 void gc_sweep_vector(std::vector<ObjPtr> &vec);
 void gc_sweep_map(std::map<std::string, ObjPtr> &map);
 
@@ -94,11 +143,18 @@ class Dictionary_ : public Object, public std::map<k, v>{
 };
 typedef Dictionary_<std::string, ObjPtr> Dictionary;
 
+/*
+ * Strings never change, so their text can be shared, even between heaps.
+ */
 class StringObject : public Object {
 	private:
-	std::string str;
+	std::shared_ptr<const std::string> str;
 	public:
 	StringObject(std::string&&);
+	StringObject(std::shared_ptr<const std::string>);
+	// a string in the current heap with the same text
+	StringObject* share(void);
+	const std::string &text(void) const { return *str; }
 	void mark(void);
 	std::ostream& show(std::ostream&) const;
 	StringObject* add(StringObject* object);
@@ -120,6 +176,8 @@ struct object_ptr{
 	object_ptr(Dictionary*);
 	object_ptr(ArrayList*);
 	object_ptr(StringObject*);
+	object_ptr(Iterator*);
+	object_ptr(Generator*);
 
 	int32_t as_i(void);
 	float as_f(void);
@@ -128,11 +186,41 @@ struct object_ptr{
 	Dictionary* as_dict(void);
 	ArrayList* as_arr(void);
 	StringObject* as_string(void);
+	// iterators and generators, which are iterators too
+	Iterator* as_iter(void);
+	Generator* as_gen(void);
 
 	std::ostream& show(std::ostream&);
 
 } __attribute__((packed));
 
+/*
+ * What a for loop goes through. On its own it goes through the elements
+ * of an array, which it sees change as it goes, or the keys a dictionary
+ * had when it was made. Generators (see generator.hpp) are iterators
+ * that run a function for their values.
+ */
+class Iterator : public Object{
+	public:
+	ObjPtr source;	// the array, null if there is nothing to go through
+	int index = 0;
+	ObjPtr value;	// what it is at
+
+	Iterator(void){ }
+	Iterator(ObjPtr over);
+	// moves on to the next value, returns false at the end
+	bool next(void);
+
+	void mark(void);
+	std::ostream& show(std::ostream&) const;
+};
+
+/*
+ * Whether the object can be changed, complaining (once on
+ * each thread) that it can't if it isn't local().
+ */
+bool can_change(Object *, const char *op);
+
 ObjPtr add(ObjPtr, ObjPtr);
 ObjPtr sub(ObjPtr, ObjPtr);
 ObjPtr mul(ObjPtr, ObjPtr);
@@ -0,0 +1,29 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <functional>
+
+// most items parallel_ranges() callers should have a thread take at once
+#define MAX_GRAIN 1024
+
+/*
+ * Runs body(n, worker) for each n in [0, count) on up to threads
+ * threads, the calling thread being one of them. Items are handed
+ * out one at a time, so uneven items still share out well. worker
+ * is in [0, threads) and says which thread is running the item, so
+ * callers can keep state of their own for each one.
+ */
+void parallel_for(int count, int threads, const std::function<void(int, int)> &body);
+
+/*
+ * Runs body(lo, hi, worker) over ranges that together cover [0, count),
+ * for when there are too many items to hand out one at a time. Each
+ * thread starts with an equal share and takes up to grain items of it
+ * at a time. A thread that runs out steals the back half of what
+ * another has left, so threads that got the cheap items help out the
+ * rest. With one thread body is called once with the whole range.
+ */
+void parallel_ranges(int count, int threads, int grain,
+					 const std::function<void(int, int, int)> &body);
+
+#endif
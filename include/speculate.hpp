@@ -0,0 +1,144 @@
+#ifndef SPECULATE_HPP
+#define SPECULATE_HPP
+
+#include <vector>
+#include <map>
+#include <ostream>
+
+#include "instruction.hpp"
+#include "bytecode.hpp"
+
+/*
+ * Profile guided speculation for whole functions.
+ *
+ * While the baseline bytecode runs, the interpreter collects cheap
+ * per site feedback: the operand types of arithmetic, the targets of
+ * JMP_CLOS, the receiver and value types of LOOKUP_S and, for each
+ * function entered, how often it was called and the types of its
+ * arguments. A site stops being watched once it has been seen
+ * SITE_SAMPLES times, and a function's sites once it has been
+ * specialised or can't be, so code that is never hot costs little.
+ *
+ * Once a function is hot its body is copied to the end of the program
+ * and a forward type analysis is run over the copy, seeded with the
+ * argument types seen so far. Arithmetic proven to be on ints becomes
+ * the unchecked _II ops, arithmetic that has only ever seen ints
+ * becomes a guarded _IG op. LOOKUP_S that has only given ints from
+ * dicts becomes SPEC_LOOKUP, which checks the value it gives, so
+ * arithmetic on it can go unchecked. A call that has only ever gone
+ * to a function specialised on the argument types the analysis proves
+ * becomes SPEC_CALL, which checks the closure is for that function and
+ * goes straight to its copy. The function's label is then replaced
+ * with SPEC_ENTRY, which checks the argument types and picks the
+ * specialised copy or the baseline.
+ *
+ * The copy has the same layout as the baseline, and the frame it runs
+ * in is an ordinary interpreter frame, so deoptimising is just jumping
+ * to the same offset in the baseline: a failed guard leaves its
+ * operands on the stack for the generic op there, which notices it
+ * was speculated on. SPEC_LOOKUP and SPEC_CALL put back what they
+ * popped and jump there themselves. Copies are never freed, so return
+ * addresses into them stay valid after a specialisation is thrown
+ * away.
+ */
+
+#define HOT_FUNCTION_THRESHOLD 100
+#define MAX_FUNCTION_LENGTH 2048
+// guard failures or refused entries before a specialisation is dropped
+#define MAX_DEOPTS 16
+// times a site is profiled before its feedback is taken as settled
+#define SITE_SAMPLES 1000
+
+typedef struct SiteFeedback{
+	// arithmetic, masks of the PointerTypes seen
+	uint8_t left = 0, right = 0;
+	// LOOKUP_S
+	uint8_t receiver = 0, value = 0;
+	// JMP_CLOS
+	int target = -1;
+	bool polymorphic = false;
+	int count = 0;
+	int spec = -1;	// the specialisation guarding this site
+} SiteFeedback;
+
+typedef struct EntryFeedback{
+	int count = 0;
+	std::vector<uint8_t> slots;	// the arguments and captured variables
+	bool blocked = false;	// specialised, or can't be
+	int end = -1;	// where the function's code ends
+	int spec = -1;	// its specialisation
+} EntryFeedback;
+
+typedef struct Specialisation{
+	int entry;		// ip of the function's label
+	Instruction label;
+	int start, end;		// the copy
+	std::vector<int> types;	// required on entry, ANY_TYPE for anything
+	int deopts = 0;
+	bool valid = true;
+} Specialisation;
+
+// a SPEC_CALL or SPEC_LOOKUP
+typedef struct SpecSite{
+	int caller;	// the specialisation it is in
+	int baseline;	// the same instruction in the baseline
+	int callee = -1;	// the specialisation called, for SPEC_CALL
+	int target = -1;	// and where the closures for it point
+	const char *name = nullptr;	// the field looked up, for SPEC_LOOKUP
+} SpecSite;
+
+class Speculator{
+	private:
+	ProgramView &program;
+	int functions_seen = 0;	// protos whose entries are set up
+
+	std::vector<SiteFeedback> feedback;
+	std::vector<EntryFeedback> entries;	// indexed by the function's label
+	std::vector<Specialisation> specs;
+	std::vector<SpecSite> sites;
+
+	// instructions profile_site() cares about, a byte each as
+	// they are checked before every instruction
+	std::vector<uint8_t> watched;
+
+	void profile_site(Context *, int ip);
+	void record_entry(Context *, int ip);
+	// stops profiling a function, other than its guarded sites
+	void unwatch(int entry, bool guarded);
+	void specialise(int entry);
+	bool analyse(std::vector<Instruction> &, int base, int start,
+				 std::vector<int> &entry_types, int *rewrites);
+	void deopt(Specialisation &);
+	void invalidate(Specialisation &);
+
+	public:
+	bool enabled = true;
+
+	Speculator(ProgramView &);
+
+	/*
+	 * Called before the instruction at ip is executed.
+	 */
+	void profile(Context *ctxt, int ip){
+		if(watched[ip]) profile_site(ctxt, ip);
+	}
+
+	/*
+	 * Called instead of executing a SPEC_ENTRY instruction,
+	 * returns the ip the interpreter should continue from.
+	 */
+	int enter(Context *, int ip);
+	// likewise for SPEC_CALL and SPEC_LOOKUP
+	int call(Context *, int ip);
+	int lookup(Context *, int ip);
+
+	/*
+	 * Called when code has been appended to the program
+	 * by something other than the Speculator.
+	 */
+	void code_added(void);
+
+	void dump(std::ostream &);
+};
+
+#endif
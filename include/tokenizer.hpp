@@ -0,0 +1,55 @@
+#ifndef TOKENIZER_HPP
+#define TOKENIZER_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+/*
+ * Splits a source file into tokens in a single pass.
+ *
+ * Words (a letter, then letters, digits and _) are interned, so
+ * matching a keyword or reading an identifier doesn't look at the
+ * source again.
+ * Anything that isn't a word, number, string or character literal
+ * is a single character PUNCT token; multi character operators are
+ * matched by ParseInfo as runs of adjacent tokens, which is why every
+ * token keeps its position in the source.
+ */
+
+enum TokenType{
+	TOK_WORD,	// value is the index of its name
+	TOK_INT,	// value is the number
+	TOK_CHAR,	// value is the character
+	TOK_STRING,	// value is the index of its contents
+	TOK_PUNCT,	// value is the character
+	TOK_END,
+};
+
+typedef struct Token{
+	enum TokenType type;
+	int value;
+	int start, end;	// range in the source
+	int line;
+} Token;
+
+class TokenStream{
+	private:
+	std::unordered_map<std::string, int> name_index;
+	int intern(std::string &&);
+
+	public:
+	std::string source;
+	std::vector<Token> tokens;	// always ends with TOK_END
+	std::vector<std::string> names;
+	std::vector<std::string> strings;
+
+	TokenStream(std::string);
+
+	/*
+	 * Whether the source text of two tokens touch.
+	 */
+	bool adjacent(int a, int b) const { return tokens[a].end == tokens[b].start; }
+};
+
+#endif
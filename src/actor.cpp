@@ -0,0 +1,151 @@
+#include "actor.hpp"
+
+#include <map>
+
+Actors::Actors(void){
+	mailboxes.emplace_back();
+}
+
+/*
+ * Messages
+ */
+
+/*
+ * Copies o into the current heap, moving the arrays of sender's
+ * into the copies if sender isn't null.
+ */
+static ObjPtr copy_value(ObjPtr o, std::map<Object *, ObjPtr> &seen, Heap *sender){
+	Object *obj = o.as_o();
+	if(obj == nullptr) return o;
+	auto found = seen.find(obj);
+	if(found != seen.end()) return found->second;
+
+	ObjPtr copy;
+	switch(o.type){
+		case STRING:
+			copy = ObjPtr(o.as_string()->share());
+			seen[obj] = copy;
+			break;
+		case ARRAY:
+			{
+			ArrayList *from = o.as_arr();
+			ArrayList *to = new ArrayList();
+			copy = ObjPtr(to);
+			seen[obj] = copy;
+			bool owned = false;
+			if(sender != nullptr){
+				// it has to belong to the sender, not the message
+				Heap *message = Heap::set(sender);
+				owned = can_change(from, "transfer");
+				Heap::set(message);
+			}
+			if(owned) to->swap(*from);
+			else to->assign(from->begin(), from->end());
+			for(auto &e : *to) e = copy_value(e, seen, sender);
+			}
+			break;
+		case DICT:
+			{
+			Dictionary *from = o.as_dict();
+			Dictionary *to = new Dictionary();
+			copy = ObjPtr(to);
+			seen[obj] = copy;
+			for(auto &p : *from) to->emplace(p.first, copy_value(p.second, seen, sender));
+			}
+			break;
+		case CLOSURE:
+			{
+			// code addresses mean the same thing in every isolate
+			Closure *from = o.as_c();
+			Closure *to = new Closure(from->func_ptr);
+			copy = ObjPtr(to);
+			seen[obj] = copy;
+			for(auto e : from->env) to->push_var(copy_value(e, seen, sender));
+			}
+			break;
+		default:
+			break;
+	}
+	return copy;
+}
+
+std::unique_ptr<Message> Actors::pack(std::vector<ObjPtr> &values, bool move){
+	std::unique_ptr<Message> m(new Message());
+	Heap *outer = Heap::set(&m->heap);
+	std::map<Object *, ObjPtr> seen;
+	for(auto v : values) m->values.push_back(copy_value(v, seen, move ? outer : nullptr));
+	Heap::set(outer);
+	return m;
+}
+
+std::vector<ObjPtr> Actors::unpack(Message &m){
+	Heap::get()->adopt(m.heap);
+	return m.values;
+}
+
+/*
+ * Mailboxes
+ */
+
+Actors::Mailbox *Actors::mailbox(int n){
+	std::lock_guard<std::mutex> guard(lock);
+	if(n < 0 || n >= mailboxes.size()) return nullptr;
+	return &mailboxes[n];
+}
+
+bool Actors::send(int to, std::unique_ptr<Message> m){
+	Mailbox *box = mailbox(to);
+	if(box == nullptr) return false;
+	{
+		std::lock_guard<std::mutex> guard(box->lock);
+		box->messages.push_back(std::move(m));
+	}
+	box->ready.notify_one();
+	return true;
+}
+
+std::unique_ptr<Message> Actors::receive(int self){
+	Mailbox *box = mailbox(self);
+	std::unique_lock<std::mutex> guard(box->lock);
+	box->ready.wait(guard, [box](){ return !box->messages.empty(); });
+	std::unique_ptr<Message> m = std::move(box->messages.front());
+	box->messages.pop_front();
+	return m;
+}
+
+/*
+ * Threads
+ */
+
+int Actors::spawn(std::unique_ptr<Message> start, Body body){
+	std::lock_guard<std::mutex> guard(lock);
+	int self = mailboxes.size();
+	mailboxes.emplace_back();
+	actors.emplace_back();
+	Actor &actor = actors.back();
+	Message *m = start.release();
+	actor.thread = std::thread([body, self, m, &actor](){
+		std::unique_ptr<Message> message(m);
+		body(self, *message, actor.out);
+	});
+	return self;
+}
+
+void Actors::join(std::ostream &out){
+	for(;;){
+		Actor *next = nullptr;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			for(auto &actor : actors){
+				if(!actor.joined){
+					next = &actor;
+					break;
+				}
+			}
+		}
+		if(next == nullptr) return;
+		next->thread.join();
+		next->joined = true;
+		out << next->out.str();
+	}
+}
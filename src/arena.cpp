@@ -0,0 +1,27 @@
+#include <stdlib.h>
+
+#include "arena.hpp"
+
+void *Arena::grow(size_t size, size_t align){
+	// big nodes (there aren't really any) get a block to themselves
+	size_t block_size = ARENA_BLOCK_SIZE;
+	if(size + align > block_size) block_size = size + align;
+
+	char *block = (char *)malloc(block_size);
+	if(block == nullptr) throw std::bad_alloc();
+	blocks.push_back(block);
+	next = block;
+	limit = block + block_size;
+	return allocate(size, align);
+}
+
+void Arena::reset(void){
+	// in reverse, so nodes go before anything they were built from
+	for(auto d = destructors.rbegin(); d != destructors.rend(); d++){
+		d->destroy(d->object);
+	}
+	destructors.clear();
+	for(char *block : blocks) free(block);
+	blocks.clear();
+	next = limit = nullptr;
+}
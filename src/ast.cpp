@@ -3,6 +3,116 @@
 #include <iostream>
 
 
+/*
+ * Inlining
+ */
+
+void CompilationState::add_function(std::string name, FunctionStmt *function){
+	// the second definition of a name isn't the one that gets called
+	if(functions.count(name) != 0) reassigned.insert(name);
+	functions[name] = function;
+}
+
+FunctionStmt *CompilationState::find_function(std::string name){
+	if(reassigned.count(name) != 0 || functions.count(name) == 0) return nullptr;
+	return functions[name];
+}
+
+/*
+ * Builds a function's code once its body has been compiled: its
+ * label, space for its locals and inlined calls, then the body.
+ */
+void CompilationState::end_code(int index, int frame_size, int locals, int extra,
+								std::vector<Instruction> &body){
+	CodeObject &c = code[index];
+	c.frame_size = frame_size + extra;
+	c.code.reserve(locals + extra + body.size() + 3);
+	c.code.push_back( label(c.label) );
+	c.code.insert(c.code.end(), locals, new_obj());
+	c.code.insert(c.code.end(), extra, new_unit());
+	c.code.insert(c.code.end(), body.begin(), body.end());
+	// functions that don't return give back unit
+	c.code.push_back( new_unit() );
+	c.code.push_back( ret() );
+}
+
+void CompilationState::function_body(int index, BlockStmt *body, ScopeInfo &context,
+									 int frame_size, int locals){
+	// functions defined inside have to exist from the start
+	if(lazy == nullptr || body->defines_functions()){
+		emit_body(index, body, context, frame_size, locals);
+		return;
+	}
+
+	LazyBody b;
+	b.body = body;
+	b.context = context;
+	b.frame_size = frame_size;
+	b.locals = locals;
+	b.code = index;
+	CodeObject &c = code[index];
+	c.frame_size = frame_size;
+	c.code.push_back( label(c.label) );
+	c.code.push_back( lazy_compile(lazy->size()) );
+	lazy->push_back(b);
+}
+
+/*
+ * Compiles a function body, inlined calls may need more space.
+ */
+void CompilationState::emit_body(int index, BlockStmt *body, ScopeInfo &context,
+								 int frame_size, int locals){
+	std::string name = code[index].name;
+	std::vector<Instruction> body_is;
+	auto outer = begin_frame(frame_size);
+	if(!name.empty()) begin_function(name);
+	// a generator's frame is set up before it is handed back
+	if(body->yields()) body_is.push_back( gen_start() );
+	body->emit(*this, context, body_is);
+	if(!name.empty()) end_function();
+	int extra = end_frame(frame_size, outer);
+	end_code(index, frame_size, locals, extra, body_is);
+}
+
+bool CompilationState::begin_inline(std::string name){
+	if(std::find(inlining.begin(), inlining.end(), name) != inlining.end())
+		return false;
+	inlining.push_back(name);
+	if(name != "") inlined.insert(name);
+	return true;
+}
+
+bool CompilationState::check_inlined(std::vector<Instruction> &is){
+	bool ok = true;
+	for(auto i : is){
+		if(i.op == SET_GLB && inlined.count(i.str) != 0){
+			reassigned.insert(i.str);
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+static int inline_cost(std::vector<ExprPtr> &exps){
+	int cost = 0;
+	for(auto exp : exps){
+		int c = exp->inline_cost();
+		if(c < 0) return -1;
+		cost += c;
+	}
+	return cost;
+}
+
+static int inline_cost(int own, std::initializer_list<ExprPtr> exps){
+	int cost = own;
+	for(auto exp : exps){
+		int c = exp->inline_cost();
+		if(c < 0) return -1;
+		cost += c;
+	}
+	return cost;
+}
+
 void Expression::get_variables(std::set<std::string> &vars){
 }
 
@@ -13,6 +123,8 @@ void UnitExp::emit(CompilationState& state, ScopeInfo &context,
 	is.push_back( new_unit() );
 }
 
+int UnitExp::inline_cost(void){ return 1; }
+
 
 IntExp::IntExp(int i){
 	this->i = i;
@@ -23,6 +135,8 @@ void IntExp::emit(CompilationState& state, ScopeInfo &context,
 	is.push_back(load_imm_i(this->i));
 }
 
+int IntExp::inline_cost(void){ return 1; }
+
 FloatExp::FloatExp(float f){
 	this->f = f;
 }
@@ -32,6 +146,8 @@ void FloatExp::emit(CompilationState& state, ScopeInfo &context,
 	is.push_back(load_imm_f(this->f));
 }
 
+int FloatExp::inline_cost(void){ return 1; }
+
 ObjectExp::ObjectExp(){
 }
 
@@ -40,12 +156,12 @@ void ObjectExp::emit(CompilationState& state, ScopeInfo &context,
 	is.push_back( new_obj() );
 }
 
+int ObjectExp::inline_cost(void){ return 1; }
+
 VectorExp::VectorExp(){ }
 
-VectorExp::VectorExp(std::vector<ExprPtr > &es){
-	for(auto exp : es){
-		elems.push_back(exp);
-	}
+VectorExp::VectorExp(std::vector<ExprPtr> es){
+	elems = std::move(es);
 }
 
 void VectorExp::emit(CompilationState& state, ScopeInfo &context,
@@ -59,14 +175,19 @@ void VectorExp::emit(CompilationState& state, ScopeInfo &context,
 	}
 }
 
+int VectorExp::inline_cost(void){
+	int cost = ::inline_cost(elems);
+	return cost < 0 ? -1 : cost + elems.size() + 1;
+}
+
 void VectorExp::get_variables(std::set<std::string> &vars){
 	for(auto exp : elems){
 		exp->get_variables(vars);
 	}
 }
 
-StringExp::StringExp(std::vector<char>& cs){
-	str = std::string(cs.begin(), cs.end());
+StringExp::StringExp(std::string s){
+	str = std::move(s);
 }
 
 void StringExp::emit(CompilationState& state, ScopeInfo &context,
@@ -76,6 +197,8 @@ void StringExp::emit(CompilationState& state, ScopeInfo &context,
 
 void StringExp::get_variables(std::set<std::string> &vars){ }
 
+int StringExp::inline_cost(void){ return 1; }
+
 VarExp::VarExp(const std::string& s){
 	var_name = s;
 }
@@ -94,6 +217,8 @@ void VarExp::get_variables(std::set<std::string> &vars){
 	vars.insert(var_name);
 }
 
+int VarExp::inline_cost(void){ return 1; }
+
 
 BinExp::BinExp(enum BinOp op, ExprPtr l, ExprPtr r){
 	this->op = op;
@@ -148,6 +273,10 @@ void BinExp::get_variables(std::set<std::string> &vars){
 	right->get_variables(vars);
 }
 
+int BinExp::inline_cost(void){
+	return ::inline_cost(1, { left, right });
+}
+
 CallExp::CallExp(std::string name, std::initializer_list<ExprPtr > args){
 	this->name = name;
 	for(auto a : args){
@@ -157,9 +286,7 @@ CallExp::CallExp(std::string name, std::initializer_list<ExprPtr > args){
 
 CallExp::CallExp(std::string name, std::vector<ExprPtr > args){
 	this->name = name;
-	for(auto a : args){
-		this->arguments.push_back(a);
-	}
+	this->arguments = std::move(args);
 }
 
 void CallExp::emit(CompilationState& state, ScopeInfo &context,
@@ -168,8 +295,10 @@ void CallExp::emit(CompilationState& state, ScopeInfo &context,
 	for(auto a : arguments){
 		a->emit(state, context, is);
 	}
-	is.push_back( push_frame(arguments.size()) );
-	is.push_back( jmp_lbl(name.c_str()) );
+	// labels don't have names, so go through the function's global
+	is.push_back( load_glb(name.c_str()) );
+	is.push_back( push_frame(arguments.size()+1) );
+	is.push_back( jmp_closure() );
 }
 
 void CallExp::get_variables(std::set<std::string> &vars){
@@ -193,9 +322,7 @@ ClosureCallExp::ClosureCallExp(
 				ExprPtr exp,
 				std::vector<ExprPtr > args
 				){
-	for(auto a : args){
-		this->arguments.push_back(a);
-	}
+	this->arguments = std::move(args);
 	this->closure = exp;
 }
 
@@ -203,6 +330,7 @@ void ClosureCallExp::emit(CompilationState& state,
 			ScopeInfo &context,
 			std::vector<Instruction> &is
 			){
+	if(emit_inline(state, context, is)) return;
 	
 	for(auto a : arguments){
 		a->emit(state, context, is);
@@ -212,6 +340,68 @@ void ClosureCallExp::emit(CompilationState& state,
 	is.push_back( jmp_closure() );
 }
 
+/*
+ * Calls to small functions whose body is just a return, and closures
+ * that are called straight away, are replaced by the returned
+ * expression. The arguments are still evaluated first, in order, into
+ * extra slots of the caller's frame which stand in for the callee's.
+ */
+bool ClosureCallExp::emit_inline(CompilationState& state,
+			ScopeInfo &context,
+			std::vector<Instruction> &is
+			){
+	std::string name;
+	std::vector<std::string> *params = nullptr;
+	ExprPtr body = nullptr;
+	// what the body's other variables refer to
+	ScopeInfo inline_context;
+
+	if(auto var = dynamic_cast<VarExp *>(closure)){
+		name = var->get_name();
+		FunctionStmt *function = state.find_function(name);
+		if(context.count(name) != 0 || function == nullptr) return false;
+		params = &function->get_arguments();
+		body = function->returned();
+	} else if(auto clos = dynamic_cast<ClosureExp *>(closure)){
+		// a closure would capture the caller's variables right now
+		inline_context = context;
+		params = &clos->get_arguments();
+		body = clos->returned();
+	} else{
+		return false;
+	}
+
+	if(body == nullptr || params->size() != arguments.size()) return false;
+	int cost = body->inline_cost();
+	if(cost < 0 || cost > state.inline_limit) return false;
+	// recursion
+	if(!state.begin_inline(name)) return false;
+
+	for(auto a : arguments){
+		a->emit(state, context, is);
+	}
+	std::vector<int> slots;
+	for(int n = 0; n < params->size(); n++){
+		slots.push_back(state.new_slot());
+		inline_context[(*params)[n]] = slots[n];
+	}
+	for(int n = slots.size()-1; n >= 0; n--){
+		is.push_back( set_stk(slots[n]) );
+	}
+
+	body->emit(state, inline_context, is);
+	state.free_slots(slots.size());
+	state.end_inline();
+	return true;
+}
+
+int ClosureCallExp::inline_cost(void){
+	int cost = ::inline_cost(arguments);
+	int clos = closure->inline_cost();
+	if(cost < 0 || clos < 0) return -1;
+	return cost + clos + 2;
+}
+
 void ClosureCallExp::get_variables(std::set<std::string> &vars){
 	for(auto arg : arguments){
 		arg->get_variables(vars);
@@ -229,9 +419,7 @@ FFICallExp::FFICallExp(
 				std::vector<ExprPtr > args
 				){
 	this->func_name = func;
-	for(auto a : args){
-		this->arguments.push_back(a);
-	}
+	this->arguments = std::move(args);
 }
 
 void FFICallExp::emit(CompilationState& state, 
@@ -252,6 +440,97 @@ void FFICallExp::get_variables(std::set<std::string> &vars){
 	}
 }
 
+int FFICallExp::inline_cost(void){
+	int cost = ::inline_cost(arguments);
+	return cost < 0 ? -1 : cost + 2;
+}
+
+ActorExp::ActorExp(std::string name, std::vector<ExprPtr> args){
+	this->name = name;
+	this->arguments = std::move(args);
+}
+
+void ActorExp::emit(CompilationState& state, ScopeInfo &context,
+					std::vector<Instruction> &is){
+	for(auto a : arguments){
+		a->emit(state, context, is);
+	}
+	if(name == "spawn") is.push_back( spawn(arguments.size() - 1) );
+	else if(name == "send") is.push_back( send(false) );
+	else if(name == "transfer") is.push_back( send(true) );
+	else is.push_back( receive() );
+}
+
+void ActorExp::get_variables(std::set<std::string> &vars){
+	for(auto arg : arguments){
+		arg->get_variables(vars);
+	}
+}
+
+ParallelExp::ParallelExp(std::string name, std::vector<ExprPtr> args){
+	this->name = name;
+	this->arguments = std::move(args);
+}
+
+void ParallelExp::emit(CompilationState& state, ScopeInfo &context,
+					   std::vector<Instruction> &is){
+	for(auto a : arguments){
+		a->emit(state, context, is);
+	}
+	if(name == "parallel_map") is.push_back( par_map() );
+	else if(name == "parallel_reduce") is.push_back( par_reduce() );
+	else is.push_back( par_for() );
+}
+
+void ParallelExp::get_variables(std::set<std::string> &vars){
+	for(auto arg : arguments){
+		arg->get_variables(vars);
+	}
+}
+
+FiberExp::FiberExp(std::string name, std::vector<ExprPtr> args){
+	this->name = name;
+	this->arguments = std::move(args);
+}
+
+void FiberExp::emit(CompilationState& state, ScopeInfo &context,
+					std::vector<Instruction> &is){
+	for(auto a : arguments){
+		a->emit(state, context, is);
+	}
+	if(name == "fiber") is.push_back( fiber(arguments.size() - 1) );
+	else if(name == "yield") is.push_back( yield() );
+	else if(name == "join") is.push_back( join() );
+	else if(name == "channel") is.push_back( channel() );
+	else if(name == "chan_send") is.push_back( chan_send() );
+	else is.push_back( chan_receive() );
+}
+
+void FiberExp::get_variables(std::set<std::string> &vars){
+	for(auto arg : arguments){
+		arg->get_variables(vars);
+	}
+}
+
+IoExp::IoExp(enum OpCode op, std::vector<ExprPtr> args){
+	this->op = op;
+	this->arguments = std::move(args);
+}
+
+void IoExp::emit(CompilationState& state, ScopeInfo &context,
+				 std::vector<Instruction> &is){
+	for(auto a : arguments){
+		a->emit(state, context, is);
+	}
+	is.push_back( io(op) );
+}
+
+void IoExp::get_variables(std::set<std::string> &vars){
+	for(auto arg : arguments){
+		arg->get_variables(vars);
+	}
+}
+
 void AccessorExp::set_setter(bool flag){
 	is_setter = flag;
 }
@@ -278,6 +557,10 @@ void FieldAccessor::get_variables(std::set<std::string> &vars){
 	sub_exp->get_variables(vars);
 }
 
+int FieldAccessor::inline_cost(void){
+	return ::inline_cost(1, { sub_exp });
+}
+
 ArrayAccessor::ArrayAccessor(ExprPtr exp){
 	this->exp = exp;
 }
@@ -302,6 +585,10 @@ void ArrayAccessor::set_sub_expr(ExprPtr exp){
 	sub_exp = exp;
 }
 
+int ArrayAccessor::inline_cost(void){
+	return ::inline_cost(1, { sub_exp, exp });
+}
+
 /*
  * This now does the double duty of "getting" from arrays and
  * objects.
@@ -323,13 +610,17 @@ void GetFieldExp::get_variables(std::set<std::string> &vars){
 	accessor->get_variables(vars);
 }
 
-ClosureExp::ClosureExp(std::vector<std::string> const& args, std::shared_ptr<BlockStmt> body){
+int GetFieldExp::inline_cost(void){
+	return ::inline_cost(0, { expression, accessor });
+}
+
+ClosureExp::ClosureExp(std::vector<std::string> const& args, BlockStmt *body){
 
 	arguments.insert(arguments.begin(), args.begin(), args.end());
 	this->body = body;
 }
 
-ClosureExp::ClosureExp(std::initializer_list<std::string> args, std::shared_ptr<BlockStmt> body){
+ClosureExp::ClosureExp(std::initializer_list<std::string> args, BlockStmt *body){
 	arguments.insert(arguments.begin(), args.begin(), args.end());
 	this->body = body;
 }
@@ -340,12 +631,12 @@ void ClosureExp::get_variables(std::set<std::string> &vars){
 }
 
 void ClosureExp::emit(CompilationState& state, ScopeInfo& context, std::vector<Instruction>& is){
-	auto anon_i = std::to_string(state.new_anon_function());
+	int index = state.new_code("", arguments.size());
 	std::set<std::string> used;
 	get_variables(used);
 
 	// Create closure object
-	is.push_back( new_closure(".anon.function."+anon_i) );
+	is.push_back( new_closure(state.code[index].label) );
 
 	// We'll need a new context with args, captured variables and then local variables.
 	auto func_context = ScopeInfo();
@@ -379,12 +670,11 @@ void ClosureExp::emit(CompilationState& state, ScopeInfo& context, std::vector<I
 		stack_pos++;
 	}
 
-	// Compile the function
-	is.push_back( jmp_lbl(".anon.function.end."+anon_i) ); // jump over function body
-	is.push_back( label(".anon.function."+anon_i) );
-	is.insert(is.end(), locals.size(), new_obj()); // make space for locals
-	body->emit(state, func_context, is);
-	is.push_back( label(".anon.function.end."+anon_i) ); // push label
+	state.function_body(index, body, func_context, stack_pos, locals.size());
+}
+
+ExprPtr ClosureExp::returned(void){
+	return body->returned();
 }
 
 
@@ -476,9 +766,7 @@ void AssignStmt::get_variables(std::set<std::string> &vars){
 }
 
 BlockStmt::BlockStmt(std::vector<StmtPtr> inits){
-	for(auto stmt : inits){
-		this->statements.push_back(stmt);
-	}
+	this->statements = std::move(inits);
 }
 
 BlockStmt::BlockStmt(std::initializer_list<StmtPtr> inits){
@@ -506,10 +794,29 @@ void BlockStmt::get_variables(std::set<std::string> &vars){
 	}
 }
 
+bool BlockStmt::defines_functions(void){
+	for(auto stmt : statements){
+		if(stmt->defines_functions()) return true;
+	}
+	return false;
+}
+
+bool BlockStmt::yields(void){
+	for(auto stmt : statements){
+		if(stmt->yields()) return true;
+	}
+	return false;
+}
+
+ExprPtr BlockStmt::returned(void){
+	if(statements.size() != 1) return nullptr;
+	return statements[0]->returned();
+}
+
 IfStmt::IfStmt(ExprPtr exp, StmtPtr block){
 	this->exp = exp;
 	this->_if = block;
-	this->_else = std::shared_ptr<BlockStmt>(new BlockStmt({}));
+	this->_else = nullptr;
 }
 
 IfStmt::IfStmt(ExprPtr exp, StmtPtr block, StmtPtr block2){
@@ -520,23 +827,32 @@ IfStmt::IfStmt(ExprPtr exp, StmtPtr block, StmtPtr block2){
 
 void IfStmt::find_DeclareStmts(std::vector<std::string> &context){
 	this->_if->find_DeclareStmts(context);
-	this->_else->find_DeclareStmts(context);
+	if(_else != nullptr) _else->find_DeclareStmts(context);
 }
 
 void IfStmt::emit(CompilationState& state, ScopeInfo &context,
 				  std::vector<Instruction> &is){
-	auto if_i = std::to_string(state.new_if());
+	int else_label = state.new_label();
+	int end_label = state.new_label();
 
 	this->exp->emit(state, context, is);
 	is.push_back( jmp_cnd(2) ); // jump into _if
-	is.push_back( jmp_lbl(".if.else."+if_i) ); // jump past the _if into _else
+	is.push_back( jmp_lbl(else_label) ); // jump past the _if into _else
 
 	this->_if->emit(state, context, is);
-	is.push_back( jmp_lbl(".if.end."+if_i) ); //jump past else
+	is.push_back( jmp_lbl(end_label) ); //jump past else
+
+	is.push_back( label(else_label) );
+	if(_else != nullptr) _else->emit(state, context, is);
+	is.push_back( label(end_label) );
+}
 
-	is.push_back( label(".if.else."+if_i) );
-	this->_else->emit(state, context, is);
-	is.push_back( label(".if.end."+if_i) );
+bool IfStmt::defines_functions(void){
+	return _if->defines_functions() || (_else != nullptr && _else->defines_functions());
+}
+
+bool IfStmt::yields(void){
+	return _if->yields() || (_else != nullptr && _else->yields());
 }
 
 void IfStmt::get_variables(std::set<std::string> &vars){
@@ -546,7 +862,7 @@ void IfStmt::get_variables(std::set<std::string> &vars){
 }
 
 
-WhileStmt::WhileStmt(ExprPtr exp, std::shared_ptr<BlockStmt> block){
+WhileStmt::WhileStmt(ExprPtr exp, BlockStmt *block){
 	this->exp = exp;
 	this->body = block;
 }
@@ -556,33 +872,107 @@ void WhileStmt::find_DeclareStmts(std::vector<std::string> &context){
 }
 
 void WhileStmt::emit(CompilationState& state, ScopeInfo &context, std::vector<Instruction> &is){
-	auto while_id = std::to_string(state.new_loop());
+	auto loop = state.new_loop();
 
-	is.push_back( label(".while.start."+while_id) );
+	is.push_back( label(loop.first) );
 	exp->emit(state, context, is);
 	is.push_back( jmp_cnd(2) );
-	is.push_back( jmp_lbl(".while.end."+while_id) );
+	is.push_back( jmp_lbl(loop.second) );
 	body->emit(state, context, is);
-	is.push_back( jmp_lbl(".while.start."+while_id) );
-	is.push_back( label(".while.end."+while_id) );
+	is.push_back( loop_lbl(loop.first) ); // back edge
+	is.push_back( label(loop.second) );
 
 	state.end_loop();
 
 }
 
+bool WhileStmt::defines_functions(void){
+	return body->defines_functions();
+}
+
+bool WhileStmt::yields(void){
+	return body->yields();
+}
+
 void WhileStmt::get_variables(std::set<std::string> &vars){
 	exp->get_variables(vars);
 	body->get_variables(vars);
 }
 
+ForStmt::ForStmt(const std::string& var, ExprPtr exp, BlockStmt *block){
+	this->var = var;
+	this->exp = exp;
+	this->body = block;
+}
+
+void ForStmt::find_DeclareStmts(std::vector<std::string> &context){
+	context.push_back(var);
+	this->body->find_DeclareStmts(context);
+}
+
+/*
+ * The iterator is kept in a slot of its own, the loop moves it
+ * on and then fetches its value, so neither leaves anything on
+ * the stack and break and continue work as they do in a while.
+ */
+void ForStmt::emit(CompilationState& state, ScopeInfo &context, std::vector<Instruction> &is){
+	exp->emit(state, context, is);
+	is.push_back( iter() );
+	int it = state.new_slot();
+	is.push_back( set_stk(it) );
+
+	auto loop = state.new_loop();
+	is.push_back( label(loop.first) );
+	is.push_back( load_stk(it) );
+	is.push_back( iter_next() );
+	is.push_back( jmp_cnd(2) );
+	is.push_back( jmp_lbl(loop.second) );
+	is.push_back( load_stk(it) );
+	is.push_back( iter_value() );
+	// at the top level it's a global, as assignments are
+	if(context.count(var) != 0) is.push_back( set_stk(context.at(var)) );
+	else is.push_back( set_glb(var.c_str()) );
+	body->emit(state, context, is);
+	is.push_back( loop_lbl(loop.first) ); // back edge
+	is.push_back( label(loop.second) );
+	state.end_loop();
+
+	state.free_slots(1);
+}
+
+bool ForStmt::defines_functions(void){
+	return body->defines_functions();
+}
+
+bool ForStmt::yields(void){
+	return body->yields();
+}
+
+void ForStmt::get_variables(std::set<std::string> &vars){
+	exp->get_variables(vars);
+	body->get_variables(vars);
+}
+
+YieldStmt::YieldStmt(ExprPtr exp){
+	this->exp = exp;
+}
+
+void YieldStmt::emit(CompilationState& state, ScopeInfo &context,
+					 std::vector<Instruction> &is){
+	exp->emit(state, context, is);
+	is.push_back( gen_yield() );
+}
+
+void YieldStmt::get_variables(std::set<std::string> &vars){
+	exp->get_variables(vars);
+}
+
 FunctionStmt::FunctionStmt(
 				const std::string& name, 
 				std::vector<std::string> args,
-				std::shared_ptr<BlockStmt> body){
+				BlockStmt *body){
 
-	for(auto arg : args){
-		arguments.push_back(arg);
-	}
+	arguments = std::move(args);
 	this->name = name;
 	this->body = body;
 }
@@ -590,7 +980,7 @@ FunctionStmt::FunctionStmt(
 FunctionStmt::FunctionStmt(
 				const std::string& name, 
 				std::initializer_list<std::string> args,
-				std::shared_ptr<BlockStmt> body){
+				BlockStmt *body){
 
 	for(auto arg : args){
 		arguments.push_back(arg);
@@ -616,14 +1006,13 @@ void FunctionStmt::emit(CompilationState& state, ScopeInfo& context, std::vector
 		stack_pos++;
 	}
 	
-	is.push_back( jmp_lbl("."+name+".end") ); // jump over function body
-	is.push_back( label(name) ); // push label
-
-	//push space on stack for local variables
-	is.insert(is.end(), locals.size(), new_obj());
+	state.add_function(name, this);
+	int index = state.new_code(name, arguments.size());
+	state.function_body(index, body, func_context, stack_pos, locals.size());
+}
 
-	body->emit(state, func_context, is);
-	is.push_back( label("."+name+".end") );
+ExprPtr FunctionStmt::returned(void){
+	return body->returned();
 }
 
 SetFieldStmt::SetFieldStmt(AccessPtr obj,
@@ -654,11 +1043,9 @@ void LoadFFIStmt::emit(CompilationState& state, ScopeInfo &context,
 }
 
 void ContinueStmt::emit(CompilationState& state, ScopeInfo& context, std::vector<Instruction>& is){
-	auto loop_id = std::to_string(state.get_loop());
-	is.push_back( jmp_lbl(".while.start."+loop_id) );
+	is.push_back( jmp_lbl(state.get_loop().first) );
 }
 
 void BreakStmt::emit(CompilationState& state, ScopeInfo& context, std::vector<Instruction>& is){
-	auto loop_id = std::to_string(state.get_loop());
-	is.push_back( jmp_lbl(".while.end."+loop_id) );
+	is.push_back( jmp_lbl(state.get_loop().second) );
 }
@@ -0,0 +1,254 @@
+#include "bytecode.hpp"
+
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+Program::Program(const std::vector<Instruction> &is, const std::vector<CodeObject> &objects){
+	built.reserve(is.size());
+	for(const Instruction &i : is) built.push_back(encode(i));
+	code = built.data();
+	count = built.size();
+	add_functions(objects);
+}
+
+void Program::add_functions(const std::vector<CodeObject> &objects){
+	for(auto &c : objects){
+		if(c.label < 0) continue;
+		int name = c.name.empty() ? -1 : intern(c.name.c_str());
+		functions.push_back({ name, c.start, c.end, c.arity, c.frame_size });
+	}
+}
+
+Program::~Program(){
+	for(int n = mapped_names; n < names.size(); n++) free(names[n]);
+	if(mapping) munmap(mapping, mapping_size);
+}
+
+int Program::intern(const char *str){
+	auto found = name_index.find(str);
+	if(found != name_index.end()) return found->second;
+	int index = names.size();
+	names.push_back(strdup(str));
+	name_index.emplace(str, index);
+	return index;
+}
+
+Code Program::encode(Instruction i){
+	int32_t operand = 0;
+	switch(instruction_types[i.op]){
+		case String:
+			operand = intern(i.str);
+			break;
+		case Float:
+			operand = floats.size();
+			floats.push_back(i.f);
+			break;
+		case Ptr:
+			operand = pointers.size();
+			pointers.push_back(i.ptr);
+			break;
+		case Int:
+		case Index:
+			operand = i.i;
+			break;
+		default:
+			break;
+	}
+
+	Code op = i.op;
+	if(operand > OPERAND_MAX || operand < OPERAND_MIN){
+		op |= WIDE_BIT;
+		wide.push_back(operand);
+		operand = wide.size() - 1;
+	}
+	return op | (Code)operand << 8;
+}
+
+size_t Program::code_size(void) const{
+	return count * sizeof(Code);
+}
+
+size_t Program::pool_size(void) const{
+	size_t size = floats.size() * sizeof(float) +
+		pointers.size() * sizeof(void *) + wide.size() * sizeof(int32_t);
+	for(char *name : names) size += strlen(name) + 1;
+	return size;
+}
+
+/*
+ * Serialisation
+ */
+
+template<typename T>
+static void write_section(std::ofstream &out, const std::vector<T> &items){
+	out.write((const char *)items.data(), items.size() * sizeof(T));
+}
+
+bool Program::save(const char *path) const{
+	if(!pointers.empty()) return false;
+
+	std::vector<uint32_t> offsets;
+	std::string strings;
+	for(char *name : names){
+		offsets.push_back(strings.size());
+		strings.append(name, strlen(name) + 1);
+	}
+	strings.resize((strings.size() + 3) & ~3, '\0');
+
+	PjbHeader header = {};
+	memcpy(header.magic, PJB_MAGIC, 4);
+	header.version = PJB_VERSION;
+	header.opcodes = CLOS_LBL + 1;
+	header.functions = functions.size();
+	header.names = names.size();
+	header.string_bytes = strings.size();
+	header.floats = floats.size();
+	header.wide = wide.size();
+	header.code = count;
+
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if(!out) return false;
+	out.write((const char *)&header, sizeof(header));
+	write_section(out, functions);
+	write_section(out, offsets);
+	out.write(strings.data(), strings.size());
+	write_section(out, floats);
+	write_section(out, wide);
+	out.write((const char *)code, count * sizeof(Code));
+	return (bool)out;
+}
+
+Program *Program::load(const char *path){
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) return nullptr;
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size < sizeof(PjbHeader)){
+		close(fd);
+		return nullptr;
+	}
+	void *mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(mapping == MAP_FAILED) return nullptr;
+
+	const char *data = (const char *)mapping;
+	PjbHeader header;
+	memcpy(&header, data, sizeof(header));
+	// no count can exceed the file size, which keeps the sum from wrapping
+	uint64_t limit = st.st_size;
+	bool bounded = header.functions <= limit && header.names <= limit &&
+		header.string_bytes <= limit && header.floats <= limit &&
+		header.wide <= limit && header.code <= limit;
+	uint64_t size = sizeof(header) + (uint64_t)header.functions * sizeof(FunctionProto) +
+		(uint64_t)header.names * 4 + header.string_bytes + (uint64_t)header.floats * 4 +
+		(uint64_t)header.wide * 4 + (uint64_t)header.code * 4;
+	// the sections after the strings are read as words
+	if(memcmp(header.magic, PJB_MAGIC, 4) != 0 || header.version != PJB_VERSION ||
+		header.opcodes != CLOS_LBL + 1 || !bounded || size != limit ||
+		header.string_bytes % 4 != 0){
+		munmap(mapping, st.st_size);
+		return nullptr;
+	}
+
+	Program *p = new Program();
+	p->mapping = mapping;
+	p->mapping_size = st.st_size;
+
+	const FunctionProto *table = (const FunctionProto *)(data + sizeof(header));
+	p->functions.assign(table, table + header.functions);
+	const uint32_t *offsets = (const uint32_t *)(table + header.functions);
+	const char *strings = (const char *)(offsets + header.names);
+	// the last name has to end inside the strings
+	if(header.string_bytes > 0 && strings[header.string_bytes - 1] != '\0'){
+		delete p;
+		return nullptr;
+	}
+	for(int n = 0; n < header.names; n++){
+		if(offsets[n] >= header.string_bytes){
+			delete p;
+			return nullptr;
+		}
+		char *name = (char *)strings + offsets[n];
+		p->names.push_back(name);
+		p->name_index.emplace(name, n);
+	}
+	p->mapped_names = header.names;
+
+	const float *floats = (const float *)(strings + header.string_bytes);
+	p->floats.assign(floats, floats + header.floats);
+	const int32_t *wide = (const int32_t *)(floats + header.floats);
+	p->wide.assign(wide, wide + header.wide);
+	// never written to, so it's run straight from the mapping
+	p->code = (const Code *)(wide + header.wide);
+	p->count = header.code;
+	if(!p->valid()){
+		delete p;
+		return nullptr;
+	}
+	return p;
+}
+
+/*
+ * Checks everything operator[] and the protos index once, so a
+ * damaged file is turned away rather than read out of bounds.
+ */
+bool Program::valid(void) const{
+	for(const FunctionProto &f : functions){
+		if(f.name < -1 || f.name >= (int64_t)names.size()) return false;
+		if(f.start < 0 || f.start >= f.end || f.end > count) return false;
+		if(f.arity < 0 || f.frame_size < 0) return false;
+	}
+	for(int ip = 0; ip < count; ip++){
+		Code c = code[ip];
+		enum OpCode op = (enum OpCode)(c & OPCODE_MASK);
+		if(op > CLOS_LBL) return false;
+		// these index tables of the isolate's, which a saved program has none of
+		if(op == SPEC_ENTRY || op == SPEC_CALL || op == SPEC_LOOKUP ||
+			op == LAZY_COMPILE) return false;
+		int32_t operand = (int32_t)c >> 8;
+		if(c & WIDE_BIT){
+			if(operand < 0 || operand >= wide.size()) return false;
+			operand = wide[operand];
+		}
+		// jumps are relative, closures hold the absolute address
+		if(op == JMP || op == JMP_CND || op == JMP_LNK || op == LOOP || op == NEW_CLOS){
+			int64_t target = op == NEW_CLOS ? operand : (int64_t)ip + operand;
+			if(target < 0 || target >= count) return false;
+		}
+		size_t pool;
+		switch(instruction_types[op]){
+			case String: pool = names.size(); break;
+			case Float: pool = floats.size(); break;
+			// pointers are never saved
+			case Ptr: pool = 0; break;
+			default: continue;
+		}
+		if(operand < 0 || operand >= pool) return false;
+	}
+	return true;
+}
+
+/*
+ * ProgramView
+ */
+
+ProgramView::ProgramView(std::shared_ptr<const Program> p) : program(p){
+	shared_size = program->size();
+	functions = program->functions;
+}
+
+void ProgramView::set(int ip, Instruction i){
+	if(ip >= shared_size) added[ip - shared_size] = i;
+	else patched[ip] = i;
+}
+
+void ProgramView::add_functions(const std::vector<CodeObject> &objects){
+	for(auto &c : objects){
+		if(c.label < 0) continue;
+		functions.push_back({ -1, c.start, c.end, c.arity, c.frame_size });
+	}
+}
@@ -0,0 +1,124 @@
+#include "cache.hpp"
+
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static uint64_t fnv1a(uint64_t hash, const std::string &s){
+	for(unsigned char c : s){
+		hash ^= c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+static bool make_dirs(const std::string &path){
+	for(size_t i = 1; i <= path.size(); i++){
+		if(i < path.size() && path[i] != '/') continue;
+		std::string dir = path.substr(0, i);
+		if(mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) return false;
+	}
+	return true;
+}
+
+/*
+ * Identifies the compiler, so a rebuilt parser doesn't
+ * pick up programs the old one compiled.
+ */
+static std::string compiler_version(void){
+	std::string version = std::to_string(PJB_VERSION) + "." +
+		std::to_string(CLOS_LBL + 1);
+	struct stat st;
+	if(stat("/proc/self/exe", &st) == 0){
+		version += "." + std::to_string(st.st_size) +
+			"." + std::to_string(st.st_mtim.tv_sec) +
+			"." + std::to_string(st.st_mtim.tv_nsec);
+	}
+	return version;
+}
+
+std::string cache_path(const std::string &source, const std::string &options){
+	std::string dir;
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	if(xdg && xdg[0] == '/') dir = xdg;
+	else if(home && home[0]) dir = std::string(home) + "/.cache";
+	else return "";
+	dir += "/psuedo-js";
+	if(!make_dirs(dir)) return "";
+
+	std::string version = compiler_version() + " " + options;
+	uint64_t hash = fnv1a(14695981039346656037ull, version);
+	hash = fnv1a(hash, source);
+
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llx.pjb", (unsigned long long)hash);
+	return dir + name;
+}
+
+Program *cache_load(const std::string &path){
+	if(path.empty()) return nullptr;
+	Program *p = Program::load(path.c_str());
+	// the time it was last used, for evicting
+	if(p != nullptr) utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+	return p;
+}
+
+/*
+ * Removes the least recently used entries in dir
+ * until they add up to CACHE_MAX_BYTES or less.
+ */
+static void evict(const std::string &dir){
+	typedef struct Entry{
+		struct timespec used;
+		off_t size;
+		std::string path;
+	} Entry;
+
+	DIR *d = opendir(dir.c_str());
+	if(d == nullptr) return;
+	std::vector<Entry> entries;
+	off_t total = 0;
+	while(struct dirent *e = readdir(d)){
+		std::string name = e->d_name;
+		if(name.size() < 4 || name.compare(name.size() - 4, 4, ".pjb") != 0) continue;
+		std::string path = dir + "/" + name;
+		struct stat st;
+		if(stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) continue;
+		entries.push_back({ st.st_mtim, st.st_size, path });
+		total += st.st_size;
+	}
+	closedir(d);
+	if(total <= CACHE_MAX_BYTES) return;
+
+	std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b){
+		if(a.used.tv_sec != b.used.tv_sec) return a.used.tv_sec < b.used.tv_sec;
+		return a.used.tv_nsec < b.used.tv_nsec;
+	});
+	// processes that have an entry mapped keep their copy
+	for(Entry &e : entries){
+		if(total <= CACHE_MAX_BYTES) break;
+		if(unlink(e.path.c_str()) == 0) total -= e.size;
+	}
+}
+
+void cache_store(const Program &program, const std::string &path){
+	if(path.empty()) return;
+	// scripts on other threads may be storing the same entry
+	static std::atomic<int> stores(0);
+	std::string temp = path + "." + std::to_string(getpid()) + "." +
+		std::to_string(stores++) + ".tmp";
+	if(!program.save(temp.c_str()) || rename(temp.c_str(), path.c_str()) < 0){
+		unlink(temp.c_str());
+		return;
+	}
+	evict(path.substr(0, path.rfind('/')));
+}
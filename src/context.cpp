@@ -9,6 +9,7 @@ Context::Context(){
 }
 
 Context::~Context(){
+	for(Stack *s : fibers) delete s;
 }
 
 void Context::push_frame(int arg_count){
@@ -23,7 +24,7 @@ void Context::push_frame(int arg_count){
 	for(int i = 0; i < arg_count; i++){
 		args.push_back(pop());
 	}
-	stack.push_front(std::vector<ObjPtr>());
+	stack->frames.push_front(std::vector<ObjPtr>());
 
 	for(int i = args.size()-1; i >= 0; i--){
 		push(args[i]);
@@ -31,18 +32,18 @@ void Context::push_frame(int arg_count){
 }
 
 void Context::pop_frame(void){
-	if(stack.size() <= 1) return;
+	if(stack->frames.size() <= 1) return;
 	//puts("popping frame");
-	stack.pop_front();
+	stack->frames.pop_front();
 }
 
 void Context::push(ObjPtr o){
-	std::vector<ObjPtr> &callframe = this->stack.front();
+	std::vector<ObjPtr> &callframe = stack->frames.front();
 	callframe.push_back(o);
 }
 
 ObjPtr Context::pop(void){
-	std::vector<ObjPtr> &callframe = stack.front();
+	std::vector<ObjPtr> &callframe = stack->frames.front();
 	if(callframe.empty()){
 		return ObjPtr();
 	}
@@ -52,46 +53,93 @@ ObjPtr Context::pop(void){
 }
 
 void Context::link(int lnk){
-	ret_stack.push_back(lnk);
+	stack->ret_stack.push_back(lnk);
 }
 
 int Context::ret(ObjPtr o){
 	int out = -1;
-	if(!ret_stack.empty()){
-		out = ret_stack[ret_stack.size()-1];
-		ret_stack.pop_back();
+	if(!stack->ret_stack.empty()){
+		out = stack->ret_stack[stack->ret_stack.size()-1];
+		stack->ret_stack.pop_back();
 	}
 	pop_frame();
 	push(o);
 	return out;
 }
 
+int Context::enter(Closure *clos, const std::vector<ObjPtr> &args, int ret){
+	for(auto a : args) push(a);
+	push_frame(args.size());
+	for(auto o : clos->env) push(o);
+	link(ret);
+	return clos->get_func();
+}
+
+int Context::detach(ObjPtr o, Stack *to, int ret){
+	int out = -1;
+	if(!stack->ret_stack.empty()){
+		out = stack->ret_stack.back();
+		stack->ret_stack.pop_back();
+	}
+	to->frames.emplace_front();
+	to->frames.splice(to->frames.begin(), stack->frames, stack->frames.begin());
+	to->ret_stack.push_back(ret);
+	push(o);
+	return out;
+}
+
+Stack *Context::new_stack(void){
+	Stack *s = new Stack();
+	s->frames.emplace_front();
+	fibers.insert(s);
+	return s;
+}
+
+void Context::free_stack(Stack *s){
+	if(fibers.erase(s) != 0) delete s;
+}
+
+Stack *Context::switch_stack(Stack *s){
+	Stack *old = stack;
+	stack = s;
+	return old;
+}
+
 ObjPtr Context::get(int i){
-	std::vector<ObjPtr > &callframe = this->stack.front();
+	std::vector<ObjPtr > &callframe = stack->frames.front();
 	if(i >= 0 && i < callframe.size()){
 		return callframe[i];
 	}
 	return ObjPtr();
 }
 
+int Context::frame_size(void){
+	return stack->frames.front().size();
+}
+
 void Context::put(ObjPtr o, int i){
-	std::vector<ObjPtr> &callframe = this->stack.front();
+	std::vector<ObjPtr> &callframe = stack->frames.front();
 	if(i >= 0 && i < callframe.size()){
 		callframe[i] = o;
 	}
 }
 
-void Context::garbage_collect(void){
-	for(std::vector<ObjPtr> &v : stack){
+void Context::garbage_collect(std::ostream &out){
+	for(std::vector<ObjPtr> &v : main.frames){
 		gc_sweep_vector(v);
 	}
+	for(Stack *s : fibers){
+		for(std::vector<ObjPtr> &v : s->frames){
+			gc_sweep_vector(v);
+		}
+	}
 
-	Object::gc_delete();
+	Heap::get()->gc_delete(out);
 }
 
 
 void Context::show_frame(void){
-	std::vector<ObjPtr> &callframe = this->stack.front();
+	std::vector<ObjPtr> &callframe = stack->frames.front();
 	std::cout << "{\n";
 	for(auto o : callframe){
 		o.show(std::cout);
@@ -100,7 +148,7 @@ void Context::show_frame(void){
 }
 
 bool Context::ffi_load(std::string lib){
-	void *handle = dlopen(strdup(lib.c_str()), RTLD_NOW);
+	void *handle = dlopen(lib.c_str(), RTLD_NOW);
 
 	char *error = dlerror();
 	if(error){
@@ -117,29 +165,44 @@ bool Context::ffi_load(std::string lib){
  * ffi symbols are in the format:
  * 	module::symbol
  */
-bool Context::ffi_call_sym(std::string sym){
+void *Context::ffi_resolve(const char *name){
+	std::string sym = name;
+	auto found = ffi_symbols.find(sym);
+	if(found != ffi_symbols.end()) return found->second;
+
 	std::string delim = "::";
 	std::string module = sym.substr(0, sym.find(delim));
 	std::string symbol = sym.substr(sym.find(delim)+delim.size(), sym.size());
 
-	if(ffi_handles.count(module) < 1){
+	auto handle = ffi_handles.find(module);
+	if(handle == ffi_handles.end()){
 		std::cerr << "ffi_call_sym: cant find module: " << module << std::endl;
-		return false;
+		return nullptr;
 	}
 
-	void *handle = ffi_handles[module];
-	void (*func)(std::vector<ObjPtr>&)  = 
-		(void (*)(std::vector<ObjPtr>&))dlsym(handle, strdup(symbol.c_str()));
+	dlerror();
+	void *func = dlsym(handle->second, symbol.c_str());
 
 	char *error = dlerror();
 	if(error){
 		std::cerr << "ffi_call: " << error << std::endl;
-		return false;
+		return nullptr;
 	}
-	
-	// calls the foreign function
-	func(stack.front());
 
+	// failures aren't kept, the module may be loaded later
+	ffi_symbols[sym] = func;
+	return func;
+}
+
+bool Context::ffi_call_sym(const char *sym){
+	void *func = ffi_resolve(sym);
+	if(func == nullptr) return false;
+	ffi_call(func);
 	return true;
 }
 
+void Context::ffi_call(void *func){
+	// calls the foreign function
+	((void (*)(std::vector<ObjPtr>&))func)(stack->frames.front());
+}
+
@@ -0,0 +1,146 @@
+#include "fiber.hpp"
+
+Fibers::Fibers(Context &ctxt) : ctxt(ctxt){
+	fibers.emplace_back();
+	fibers[0].stack = ctxt.main_stack();
+}
+
+int Fibers::next(void){
+	if(idle) idle(false);
+	while(ready.empty() && idle && idle(true));
+	if(ready.empty()){
+		// everything has finished or is waiting, so stop
+		running = 0;
+		ctxt.switch_stack(fibers[0].stack);
+		return -1;
+	}
+	running = ready.front();
+	ready.pop_front();
+	ctxt.switch_stack(fibers[running].stack);
+	return fibers[running].ip;
+}
+
+int Fibers::suspend(int ip, ObjPtr retry){
+	ctxt.push(retry);
+	fibers[running].ip = ip;
+	return next();
+}
+
+/*
+ * Fibers
+ */
+
+int Fibers::start(int ip, int arg_count){
+	// the closure is under its arguments
+	std::vector<ObjPtr> args(arg_count);
+	for(int n = arg_count - 1; n >= 0; n--) args[n] = ctxt.pop();
+	Closure *clos = ctxt.pop().as_c();
+	if(clos == nullptr){
+		ctxt.push(ObjPtr());
+		return ip + 1;
+	}
+
+	Fiber f;
+	f.stack = ctxt.new_stack();
+	Stack *old = ctxt.switch_stack(f.stack);
+	f.ip = ctxt.enter(clos, args, FIBER_EXIT);
+	ctxt.switch_stack(old);
+
+	int id = fibers.size();
+	fibers.push_back(f);
+	ready.push_back(id);
+	ctxt.push(ObjPtr(id));
+	return ip + 1;
+}
+
+int Fibers::yield(int ip, bool can_switch){
+	ctxt.push(ObjPtr());
+	if(!can_switch) return ip + 1;
+	// fibers waiting on something else may be woken by now
+	if(ready.empty() && idle) idle(false);
+	if(ready.empty()) return ip + 1;
+	fibers[running].ip = ip + 1;
+	ready.push_back(running);
+	return next();
+}
+
+int Fibers::join(int ip, bool can_switch){
+	ObjPtr id = ctxt.pop();
+	int n = id.as_i();
+	if(id.type != INT || n < 0 || n >= fibers.size() || n == running){
+		ctxt.push(ObjPtr());
+		return ip + 1;
+	}
+	if(fibers[n].done){
+		ctxt.push(fibers[n].result);
+		return ip + 1;
+	}
+	if(!can_switch){
+		ctxt.push(ObjPtr());
+		return ip + 1;
+	}
+	fibers[n].joiners.push_back(running);
+	return suspend(ip, id);
+}
+
+int Fibers::exit(void){
+	Fiber &f = fibers[running];
+	f.done = true;
+	// the top level leaves nothing to return
+	if(running != 0) f.result = ctxt.pop();
+	for(int j : f.joiners) ready.push_back(j);
+	f.joiners.clear();
+
+	Stack *finished = running != 0 ? f.stack : nullptr;
+	int ip = next();
+	if(finished != nullptr) ctxt.free_stack(finished);
+	return ip;
+}
+
+/*
+ * Channels
+ */
+
+int Fibers::channel(int ip){
+	ctxt.push(ObjPtr((int)channels.size()));
+	channels.emplace_back();
+	return ip + 1;
+}
+
+int Fibers::send(int ip){
+	ObjPtr value = ctxt.pop();
+	ObjPtr c = ctxt.pop();
+	int n = c.as_i();
+	ctxt.push(ObjPtr());
+	if(c.type != INT || n < 0 || n >= channels.size()) return ip + 1;
+
+	Channel &ch = channels[n];
+	ch.values.push_back(value);
+	if(!ch.receivers.empty()){
+		ready.push_back(ch.receivers.front());
+		ch.receivers.pop_front();
+	}
+	return ip + 1;
+}
+
+int Fibers::receive(int ip, bool can_switch){
+	ObjPtr c = ctxt.pop();
+	int n = c.as_i();
+	if(c.type != INT || n < 0 || n >= channels.size()){
+		ctxt.push(ObjPtr());
+		return ip + 1;
+	}
+
+	Channel &ch = channels[n];
+	if(!ch.values.empty()){
+		ctxt.push(ch.values.front());
+		ch.values.pop_front();
+		return ip + 1;
+	}
+	if(!can_switch){
+		ctxt.push(ObjPtr());
+		return ip + 1;
+	}
+	ch.receivers.push_back(running);
+	return suspend(ip, c);
+}
@@ -0,0 +1,69 @@
+#include "generator.hpp"
+
+Generator::Generator(Stack *stack, int ip) : stack(stack), ip(ip){
+}
+
+Generator::~Generator(){
+	delete stack;
+}
+
+void Generator::mark(void){
+	if(active) return;
+	Iterator::mark();
+	if(stack == nullptr) return;
+	for(std::vector<ObjPtr> &v : stack->frames){
+		gc_sweep_vector(v);
+	}
+}
+
+std::ostream& Generator::show(std::ostream& os) const{
+	return os << "GENERATOR";
+}
+
+Generators::Generators(Context &ctxt) : ctxt(ctxt){
+}
+
+int Generators::start(int ip){
+	Stack *stack = new Stack();
+	Generator *g = new Generator(stack, ip + 1);
+	return ctxt.detach(ObjPtr(g), stack, GENERATOR_EXIT);
+}
+
+int Generators::resume(int ip){
+	Generator *g = ctxt.pop().as_gen();
+	// one that is already running can't be resumed again
+	if(g == nullptr || g->stack == nullptr || g->caller != nullptr ||
+		!can_change(g, "ITER_NEXT")){
+		ctxt.push(ObjPtr(0));
+		return ip + 1;
+	}
+	g->caller = ctxt.switch_stack(g->stack);
+	g->resume = ip + 1;
+	running.push_back(g);
+	return g->ip;
+}
+
+int Generators::yield(int ip){
+	ObjPtr value = ctxt.pop();
+	if(running.empty()) return ip + 1;
+	Generator *g = running.back();
+	running.pop_back();
+	g->value = value;
+	g->ip = ip + 1;
+	ctxt.switch_stack(g->caller);
+	g->caller = nullptr;
+	ctxt.push(ObjPtr(1));
+	return g->resume;
+}
+
+int Generators::exit(void){
+	Generator *g = running.back();
+	running.pop_back();
+	g->value = ObjPtr();
+	ctxt.switch_stack(g->caller);
+	g->caller = nullptr;
+	delete g->stack;
+	g->stack = nullptr;
+	ctxt.push(ObjPtr(0));
+	return g->resume;
+}
@@ -1,7 +1,37 @@
 #include "instruction.hpp"
 
 #include <iostream>
+#include <cstdlib>
 #include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+/*
+ * The typed ops trust the compiler that both operands
+ * are ints, so the payload is used without checking.
+ */
+#define INT_OP(OP) \
+	{ \
+	ObjPtr a = ctxt->pop(); \
+	ObjPtr b = ctxt->pop(); \
+	ctxt->push(ObjPtr((int32_t)((int32_t)b.data OP (int32_t)a.data))); \
+	} \
+	break;
+
+#define GUARDED_INT_OP(OP) \
+	{ \
+	ObjPtr a = ctxt->pop(); \
+	ObjPtr b = ctxt->pop(); \
+	if(a.type != INT || b.type != INT){ \
+		ctxt->push(b); \
+		ctxt->push(a); \
+		step = i.i; \
+		break; \
+	} \
+	ctxt->push(ObjPtr((int32_t)((int32_t)b.data OP (int32_t)a.data))); \
+	} \
+	break;
 
 void step_instruction(Context * ctxt, 
 					Instruction i, 
@@ -10,6 +40,16 @@ void step_instruction(Context * ctxt,
 	int step = 1;
 	switch(i.op){
 		case LABEL: // essentially a nop
+		case SPEC_ENTRY: case SPEC_CALL: case SPEC_LOOKUP: // handled by the Speculator
+		case LAZY_COMPILE: // handled by the LazyCompiler
+		case SPAWN: case SEND: case RECEIVE: // handled by the Actors
+		case PAR_MAP: case PAR_REDUCE: case PAR_FOR: // run on the workers
+		case FIBER: case YIELD: case JOIN: // handled by the Fibers
+		case CHANNEL: case CHAN_SEND: case CHAN_RECEIVE:
+		case IO_READ: case IO_WRITE: case IO_LISTEN: // handled by the IoLoop
+		case IO_ACCEPT: case IO_CONNECT: case IO_SEND:
+		case IO_RECV: case IO_CLOSE: case AWAIT:
+		case GEN_START: case GEN_YIELD: // handled by the Generators
 			break;
 		case SHOW_FRAME:
 			ctxt->show_frame();
@@ -25,6 +65,7 @@ void step_instruction(Context * ctxt,
 			step = 0;
 			break;
 		case JMP:
+		case LOOP:
 			step = i.i;
 			break;
 		case JMP_LNK:
@@ -119,12 +160,13 @@ void step_instruction(Context * ctxt,
 			ObjPtr obj = ctxt->pop();
 			ObjPtr b = ctxt->pop();
 			Dictionary *dict = nullptr;
-			if(dict = obj.as_dict())
+			if((dict = obj.as_dict()) && can_change(dict, "INSERT_S")){
 				//TODO: We erase here because emplace doesn't overwrite,
 				// This could probably be improved by using iterators.
 				dict->erase(i.str);
 				dict->emplace(i.str, b);
 			}
+			}
 			break;
 		case LOOKUP_V:
 			{
@@ -143,11 +185,36 @@ void step_instruction(Context * ctxt,
 			ObjPtr vec = ctxt->pop();
 			ObjPtr adding = ctxt->pop();
 			ArrayList *arr = nullptr;
+			// replacing an element moves nothing, so it can be done
+			// to a shared array, which is how parallel_for() gives results
 			if(arr = vec.as_arr())
 				arr->at(index.as_i()) = adding;
 			}
 			break;
 
+		case ITER:
+			{
+			ObjPtr over = ctxt->pop();
+			// a generator is its own iterator
+			if(over.type == GENERATOR) ctxt->push(over);
+			else ctxt->push(ObjPtr(new Iterator(over)));
+			}
+			break;
+		case ITER_NEXT:
+			{
+			// generators are resumed by the interpreter loop
+			ObjPtr it = ctxt->pop();
+			ctxt->push(ObjPtr(it.type == ITERATOR && can_change(it.as_o(), "ITER_NEXT") &&
+							  it.as_iter()->next()));
+			}
+			break;
+		case ITER_VALUE:
+			{
+			Iterator *it = ctxt->pop().as_iter();
+			ctxt->push(it != nullptr ? it->value : ObjPtr());
+			}
+			break;
+
 		case ADD:
 			{
 			ObjPtr a = ctxt->pop();
@@ -221,6 +288,26 @@ void step_instruction(Context * ctxt,
 			}
 			break;
 
+		case ADD_II: INT_OP(+)
+		case MIN_II: INT_OP(-)
+		case MUL_II: INT_OP(*)
+		case DIV_II: INT_OP(/)
+		case MOD_II: INT_OP(%)
+		case LT_II: INT_OP(<)
+		case LTE_II: INT_OP(<=)
+		case GT_II: INT_OP(>)
+		case GTE_II: INT_OP(>=)
+
+		case ADD_IG: GUARDED_INT_OP(+)
+		case MIN_IG: GUARDED_INT_OP(-)
+		case MUL_IG: GUARDED_INT_OP(*)
+		case DIV_IG: GUARDED_INT_OP(/)
+		case MOD_IG: GUARDED_INT_OP(%)
+		case LT_IG: GUARDED_INT_OP(<)
+		case LTE_IG: GUARDED_INT_OP(<=)
+		case GT_IG: GUARDED_INT_OP(>)
+		case GTE_IG: GUARDED_INT_OP(>=)
+
 		case FFI_LOAD:
 			ctxt->ffi_load(i.str);
 			break;
@@ -233,7 +320,10 @@ void step_instruction(Context * ctxt,
 			ctxt->ret(ctxt->pop());
 			break;
 		case FFI_CALL:
-			puts("TODO: implement ffi_call");
+			ctxt->link((*ip) + 1);
+
+			if(i.ptr != nullptr) ctxt->ffi_call(i.ptr);
+			ctxt->ret(ctxt->pop());
 			break;
 		default:
 			std::cout << "error unimplemented op code" << std::endl;
@@ -259,6 +349,115 @@ Instruction drop(void){
 	return {.op = DROP};
 }
 
+Instruction spec_entry(int i){
+	Instruction out;
+	out.op = SPEC_ENTRY;
+	out.i = i;
+	return out;
+}
+
+Instruction spec_call(int i){
+	Instruction out;
+	out.op = SPEC_CALL;
+	out.i = i;
+	return out;
+}
+
+Instruction spec_lookup(int i){
+	Instruction out;
+	out.op = SPEC_LOOKUP;
+	out.i = i;
+	return out;
+}
+
+Instruction lazy_compile(int i){
+	Instruction out;
+	out.op = LAZY_COMPILE;
+	out.i = i;
+	return out;
+}
+
+Instruction spawn(int i){
+	Instruction out;
+	out.op = SPAWN;
+	out.i = i;
+	return out;
+}
+
+Instruction send(bool move){
+	Instruction out;
+	out.op = SEND;
+	out.i = move;
+	return out;
+}
+
+Instruction receive(void){
+	return {.op = RECEIVE};
+}
+
+Instruction par_map(void){
+	return {.op = PAR_MAP};
+}
+
+Instruction par_reduce(void){
+	return {.op = PAR_REDUCE};
+}
+
+Instruction par_for(void){
+	return {.op = PAR_FOR};
+}
+
+Instruction fiber(int i){
+	Instruction out;
+	out.op = FIBER;
+	out.i = i;
+	return out;
+}
+
+Instruction yield(void){
+	return {.op = YIELD};
+}
+
+Instruction join(void){
+	return {.op = JOIN};
+}
+
+Instruction channel(void){
+	return {.op = CHANNEL};
+}
+
+Instruction chan_send(void){
+	return {.op = CHAN_SEND};
+}
+
+Instruction chan_receive(void){
+	return {.op = CHAN_RECEIVE};
+}
+
+Instruction io(enum OpCode op){
+	return {.op = op};
+}
+
+Instruction gen_start(void){
+	return {.op = GEN_START};
+}
+
+Instruction gen_yield(void){
+	return {.op = GEN_YIELD};
+}
+
+Instruction iter(void){
+	return {.op = ITER};
+}
+
+Instruction iter_next(void){
+	return {.op = ITER_NEXT};
+}
+
+Instruction iter_value(void){
+	return {.op = ITER_VALUE};
+}
+
 Instruction jmp_cnd(int i){
 	Instruction out;
 	out.op = JMP_CND;
@@ -279,17 +478,10 @@ Instruction jmp_lnk(int i){
 	return out;
 }
 
-Instruction jmp_lbl(const char *c){
-	Instruction out;
-	out.op = JMP_LBL;
-	out.str = strdup(c);
-	return out;
-}
-
-Instruction jmp_lbl(std::string str){
+Instruction jmp_lbl(int label){
 	Instruction out;
 	out.op = JMP_LBL;
-	out.str = strdup(str.c_str());
+	out.i = label;
 	return out;
 }
 
@@ -299,17 +491,17 @@ Instruction jmp_closure(void){
 	return out;
 }
 
-Instruction label(const char *c){
+Instruction loop_lbl(int label){
 	Instruction out;
-	out.op = LABEL;
-	out.str = strdup(c);
+	out.op = LOOP_LBL;
+	out.i = label;
 	return out;
 }
 
-Instruction label(std::string str){
+Instruction label(int label){
 	Instruction out;
 	out.op = LABEL;
-	out.str = strdup(str.c_str());
+	out.i = label;
 	return out;
 }
 
@@ -324,17 +516,30 @@ Instruction new_unit(void){
 	return {.op = NEW_UNIT};
 }
 
+/*
+ * String operands are interned, so instructions can be copied and
+ * thrown away freely, and compiling the same name again (lazily, or
+ * on several threads) doesn't allocate it again. They are kept until
+ * the process exits, a Program keeps copies of its own.
+ */
+static char *operand(const char *str){
+	static std::mutex lock;
+	static std::unordered_set<std::string> names;
+	std::lock_guard<std::mutex> guard(lock);
+	return const_cast<char *>(names.insert(str).first->c_str());
+}
+
 Instruction new_string(const char* str){
 	Instruction out;
 	out.op = NEW_STRING;
-	out.str = strdup(str);
+	out.str = operand(str);
 	return out;
 }
 
-Instruction new_closure(std::string str){
+Instruction new_closure(int label){
 	Instruction out;
 	out.op = CLOS_LBL;
-	out.str = strdup(str.c_str());
+	out.i = label;
 	return out;
 }
 
@@ -373,7 +578,7 @@ Instruction load_stk(int i){
 Instruction load_glb(const char *c){
 	Instruction out;
 	out.op = LOAD_GLB;
-	out.str = strdup(c);
+	out.str = operand(c);
 	return out;
 }
 
@@ -388,41 +593,41 @@ Instruction set_stk(int i){
 Instruction set_glb(const char *c){
 	Instruction out;
 	out.op = SET_GLB;
-	out.str = strdup(c);
+	out.str = operand(c);
 	return out;
 }
 
 Instruction insert_s(const char *c){
 	Instruction out;
 	out.op = INSERT_S;
-	out.str = strdup(c);
+	out.str = operand(c);
 	return out;
 }
 
 Instruction lookup_s(const char *c){
 	Instruction out;
 	out.op = LOOKUP_S;
-	out.str = strdup(c);
+	out.str = operand(c);
 	return out;
 }
 
 Instruction ffi_load(const char *c){
 	Instruction out;
 	out.op = FFI_LOAD;
-	out.str = strdup(c);
+	out.str = operand(c);
 	return out;
 }
 
 Instruction ffi_call_sym(const char *c){
 	Instruction out;
 	out.op = FFI_CALL_SYM;
-	out.str = strdup(c);
+	out.str = operand(c);
 	return out;
 }
 
 Instruction ffi_call(void *func_ptr){
 	Instruction out;
-	out.op = FFI_LOAD;
+	out.op = FFI_CALL;
 	out.ptr = func_ptr;
 	return out;
 }
@@ -442,39 +647,126 @@ Instruction lte(void){ return {.op = LTE}; }
 Instruction gt(void){ return {.op = GT}; }
 Instruction gte(void){ return {.op = GTE}; }
 
-void process_labels(std::vector<Instruction> &ins){
-	std::map<std::string, int> lookup_table;
-
-	// scan for label addresses
-	for(int ins_ptr = 0; ins_ptr < ins.size(); ins_ptr++){
-		Instruction instr = ins[ins_ptr];
-		if(instr.op == LABEL){
-			lookup_table[instr.str] = ins_ptr;
-		}
+void stack_effect(Instruction i, int *pops, int *pushes){
+	*pops = 0;
+	*pushes = 0;
+	switch(i.op){
+		case DROP: case JMP_CND: case RET:
+		case SET_STK: case SET_GLB: case GEN_YIELD:
+			*pops = 1; break;
+		case NEW_OBJ: case NEW_VEC: case NEW_UNIT:
+		case NEW_STRING: case NEW_CLOS: case CLOS_LBL:
+		case LOAD_IMM_I: case LOAD_IMM_F:
+		case LOAD_STK: case LOAD_GLB:
+			*pushes = 1; break;
+		// the result of a call is pushed when it returns
+		case JMP_CLOS: case JMP_LNK: case SPEC_CALL:
+		case FFI_CALL_SYM: case FFI_CALL:
+			*pushes = 1; break;
+		case PUSH_FRAME: *pops = i.i; break;
+		case CLOS_CAP: case LOOKUP_S: case SPEC_LOOKUP:
+			*pops = 1; *pushes = 1; break;
+		case INSERT_S: *pops = 2; break;
+		case LOOKUP_V: *pops = 2; *pushes = 1; break;
+		case SPAWN: *pops = i.i + 1; *pushes = 1; break;
+		case SEND: *pops = 2; *pushes = 1; break;
+		case RECEIVE: *pushes = 1; break;
+		case PAR_MAP: *pops = 2; *pushes = 1; break;
+		case PAR_REDUCE: case PAR_FOR: *pops = 3; *pushes = 1; break;
+		case FIBER: *pops = i.i + 1; *pushes = 1; break;
+		case YIELD: case CHANNEL: *pushes = 1; break;
+		case JOIN: case CHAN_RECEIVE: *pops = 1; *pushes = 1; break;
+		case CHAN_SEND: *pops = 2; *pushes = 1; break;
+		case IO_READ: case IO_LISTEN: case IO_ACCEPT: case IO_CONNECT:
+		case IO_RECV: case IO_CLOSE: case AWAIT:
+			*pops = 1; *pushes = 1; break;
+		case IO_WRITE: case IO_SEND: *pops = 2; *pushes = 1; break;
+		case ITER: case ITER_NEXT: case ITER_VALUE:
+			*pops = 1; *pushes = 1; break;
+		case INSERT_V: *pops = 3; break;
+		case ADD: case MIN: case MUL: case DIV: case MOD:
+		case EQ: case LT: case LTE: case GT: case GTE:
+		case ADD_II: case MIN_II: case MUL_II: case DIV_II: case MOD_II:
+		case LT_II: case LTE_II: case GT_II: case GTE_II:
+		case ADD_IG: case MIN_IG: case MUL_IG: case DIV_IG: case MOD_IG:
+		case LT_IG: case LTE_IG: case GT_IG: case GTE_IG:
+			*pops = 2; *pushes = 1; break;
+		default: break;
 	}
+}
+
+/*
+ * Points a resolved instruction at its label, jumps are
+ * relative and closures hold the absolute address.
+ */
+static void patch(Instruction &instr, int ins_ptr, int absolute, int base){
+	instr.i = instr.op == NEW_CLOS ? base + absolute : absolute - ins_ptr;
+}
+
+void process_labels(std::vector<Instruction> &ins, const LabelTable &labels, int base){
+	std::vector<int> address(labels.size(), -1);
+	// the last instruction waiting on each label, each one
+	// holds the one before it in i until it is patched
+	std::vector<int> waiting(labels.size(), -1);
 
-	// changes jmp_lbl to the appropriate jmp
 	for(int ins_ptr = 0; ins_ptr < ins.size(); ins_ptr++){
-		Instruction instr = ins[ins_ptr];
-		if(instr.op == JMP_LBL){
-			int absolute = lookup_table[instr.str];
-			int relative = absolute - ins_ptr;
-			free(instr.str);
-			ins[ins_ptr].op = JMP;
-			ins[ins_ptr].i = relative;
+		Instruction &instr = ins[ins_ptr];
+		switch(instr.op){
+			case LABEL:
+				{
+				int l = instr.i;
+				address[l] = ins_ptr;
+				for(int w = waiting[l]; w >= 0; ){
+					int next = ins[w].i;
+					patch(ins[w], w, ins_ptr, base);
+					w = next;
+				}
+				waiting[l] = -1;
+				}
+				break;
+			case JMP_LBL:
+			case LOOP_LBL:
+			case CLOS_LBL:
+				{
+				int l = instr.i;
+				instr.op = instr.op == JMP_LBL ? JMP :
+					instr.op == LOOP_LBL ? LOOP : NEW_CLOS;
+				if(address[l] >= 0){
+					patch(instr, ins_ptr, address[l], base);
+				} else{
+					instr.i = waiting[l];
+					waiting[l] = ins_ptr;
+				}
+				}
+				break;
+			default:
+				break;
 		}
 	}
+	// a jump left waiting would run off to whatever its chain held
+	for(int l = 0; l < waiting.size(); l++){
+		if(waiting[l] == -1) continue;
+		std::cerr << "process_labels: label " << l << " is used at "
+			<< base + waiting[l] << " but never defined" << std::endl;
+		abort();
+	}
+}
 
-	// changes clos_lbl to the appropriate closure
-	for(int ins_ptr = 0; ins_ptr < ins.size(); ins_ptr++){
-		Instruction instr = ins[ins_ptr];
-		if(instr.op == CLOS_LBL){
-			int absolute = lookup_table[instr.str];
-			free(instr.str);
-			ins[ins_ptr].op = NEW_CLOS;
-			ins[ins_ptr].i = absolute;
-		}
+std::vector<Instruction> link_code(std::vector<CodeObject> &code,
+								   const LabelTable &labels, int base){
+	size_t size = 1;
+	for(auto &c : code) size += c.code.size();
+	std::vector<Instruction> is;
+	is.reserve(size);
+
+	for(auto &c : code){
+		c.start = base + is.size();
+		is.insert(is.end(), c.code.begin(), c.code.end());
+		if(c.label < 0) is.push_back(ret());
+		c.end = base + is.size();
 	}
+	process_labels(is, labels, base);
+	return is;
 }
 
 std::ostream& operator<<(std::ostream& os, const Instruction& i){
@@ -0,0 +1,405 @@
+#include "io.hpp"
+
+#include <sstream>
+#include <cstring>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+IoLoop::IoLoop(Fibers &fibers, Context &ctxt) : fibers(fibers), ctxt(ctxt){
+}
+
+IoLoop::~IoLoop(){
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	queued.notify_all();
+	for(auto &t : threads) t.join();
+	for(int fd : handles) close(fd);
+	if(epoll_fd >= 0) close(epoll_fd);
+	if(wake_fd >= 0) close(wake_fd);
+}
+
+static std::string text_of(ObjPtr o){
+	StringObject *s = o.as_string();
+	if(s != nullptr) return s->text();
+	std::stringstream out;
+	o.show(out);
+	return out.str();
+}
+
+static bool unix_address(const std::string &path, sockaddr_un *addr){
+	if(path.empty() || path.size() >= sizeof(addr->sun_path)) return false;
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	memcpy(addr->sun_path, path.c_str(), path.size());
+	return true;
+}
+
+static int listen_on(const std::string &path){
+	sockaddr_un addr;
+	if(!unix_address(path, &addr)) return -1;
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0) return -1;
+	// a socket left behind by an earlier run, but nothing else
+	struct stat st;
+	if(stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path.c_str());
+	if(bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Operations
+ */
+
+int IoLoop::begin(int op, int fd){
+	if(epoll_fd < 0){
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		epoll_event ev = {};
+		ev.events = EPOLLIN;
+		ev.data.fd = wake_fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+	}
+	int id = next_id++;
+	Operation &o = ops[id];
+	o.id = id;
+	o.op = op;
+	o.fd = fd;
+	pending++;
+	return id;
+}
+
+int IoLoop::socket_of(ObjPtr handle){
+	if(handle.type != INT || handles.count(handle.as_i()) == 0) return -1;
+	return handle.as_i();
+}
+
+void IoLoop::complete(int id){
+	Operation &o = ops[id];
+	o.done = true;
+	pending--;
+	if(!o.failed && (o.op == IO_ACCEPT || o.op == IO_CONNECT)) handles.insert(o.value);
+	for(int w : o.waiters) fibers.wake(w);
+	awaiting -= o.waiters.size();
+	if(!o.waiters.empty()){
+		o.waiters.clear();
+		return;
+	}
+	// the oldest result nobody has come for is dropped
+	unclaimed.push_back(id);
+	if(unclaimed.size() > IO_UNCLAIMED){
+		ops.erase(unclaimed.front());
+		unclaimed.pop_front();
+	}
+}
+
+ObjPtr IoLoop::result(Operation &o){
+	if(o.failed) return ObjPtr();
+	switch(o.op){
+		case IO_READ: case IO_RECV:
+			return ObjPtr(new StringObject(std::move(o.data)));
+		default:
+			return ObjPtr((int)o.value);
+	}
+}
+
+int IoLoop::execute(Instruction i, int ip, bool can_switch){
+	int id = 0;
+	switch(i.op){
+		case IO_READ: case IO_CONNECT:
+			id = begin(i.op, -1);
+			ops[id].path = text_of(ctxt.pop());
+			run_on_thread(id);
+			break;
+		case IO_WRITE:
+			{
+			std::string data = text_of(ctxt.pop());
+			id = begin(IO_WRITE, -1);
+			ops[id].path = text_of(ctxt.pop());
+			ops[id].data = std::move(data);
+			run_on_thread(id);
+			}
+			break;
+		case IO_SEND:
+			{
+			std::string data = text_of(ctxt.pop());
+			id = begin(IO_SEND, socket_of(ctxt.pop()));
+			ops[id].data = std::move(data);
+			attempt(id);
+			}
+			break;
+		case IO_ACCEPT: case IO_RECV:
+			id = begin(i.op, socket_of(ctxt.pop()));
+			attempt(id);
+			break;
+		case IO_LISTEN:
+			{
+			int fd = listen_on(text_of(ctxt.pop()));
+			if(fd >= 0) handles.insert(fd);
+			ctxt.push(fd >= 0 ? ObjPtr(fd) : ObjPtr());
+			}
+			return ip + 1;
+		case IO_CLOSE:
+			{
+			int fd = socket_of(ctxt.pop());
+			if(fd < 0){
+				ctxt.push(ObjPtr());
+				return ip + 1;
+			}
+			handles.erase(fd);
+			// anything still waiting on it fails
+			for(int waiting : watching[fd]){
+				ops[waiting].failed = true;
+				complete(waiting);
+			}
+			watching.erase(fd);
+			if(events.erase(fd) != 0) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+			close(fd);
+			ctxt.push(ObjPtr());
+			}
+			return ip + 1;
+		case AWAIT:
+			{
+			ObjPtr v = ctxt.pop();
+			auto found = v.type == INT ? ops.find(v.as_i()) : ops.end();
+			if(found == ops.end()){
+				ctxt.push(v);
+				return ip + 1;
+			}
+			Operation &o = found->second;
+			if(!o.done && can_switch){
+				o.waiters.push_back(fibers.current());
+				awaiting++;
+				return fibers.suspend(ip, v);
+			}
+			while(!o.done) poll(true);
+			ctxt.push(result(o));
+			ops.erase(found);
+			}
+			return ip + 1;
+		default:
+			break;
+	}
+	ctxt.push(ObjPtr(id));
+	return ip + 1;
+}
+
+/*
+ * Files, on the threads
+ */
+
+void IoLoop::run_on_thread(int id){
+	if(threads.empty()){
+		for(int n = 0; n < IO_THREADS; n++) threads.emplace_back(&IoLoop::thread_main, this);
+	}
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		work.push_back(&ops[id]);
+	}
+	queued.notify_one();
+}
+
+static void read_file(const std::string &path, std::string *out, bool *failed){
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0){
+		*failed = true;
+		return;
+	}
+	char buf[IO_RECV_SIZE];
+	for(;;){
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0) *failed = true;
+		if(n <= 0) break;
+		out->append(buf, n);
+	}
+	close(fd);
+}
+
+static long write_file(const std::string &path, const std::string &data){
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fd < 0) return -1;
+	size_t written = 0;
+	while(written < data.size()){
+		ssize_t n = write(fd, data.data() + written, data.size() - written);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0) break;
+		written += n;
+	}
+	close(fd);
+	return written == data.size() ? (long)written : -1;
+}
+
+static int connect_to(const std::string &path){
+	sockaddr_un addr;
+	if(!unix_address(path, &addr)) return -1;
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0) return -1;
+	if(connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0){
+		close(fd);
+		return -1;
+	}
+	// only the loop uses it from now on
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+void IoLoop::thread_main(void){
+	for(;;){
+		Operation *o;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			queued.wait(guard, [this](){ return !work.empty() || stopping; });
+			// what was queued is finished before stopping
+			if(work.empty()) return;
+			o = work.front();
+			work.pop_front();
+		}
+		switch(o->op){
+			case IO_READ:
+				read_file(o->path, &o->data, &o->failed);
+				break;
+			case IO_WRITE:
+				o->value = write_file(o->path, o->data);
+				o->failed = o->value < 0;
+				o->data.clear();
+				break;
+			case IO_CONNECT:
+				o->value = connect_to(o->path);
+				o->failed = o->value < 0;
+				break;
+		}
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			finished.push_back(o->id);
+		}
+		uint64_t one = 1;
+		ssize_t ignored = write(wake_fd, &one, sizeof(one));
+		(void)ignored;
+	}
+}
+
+/*
+ * Sockets, on the loop
+ */
+
+bool IoLoop::try_socket(Operation &o){
+	for(;;){
+		ssize_t n;
+		switch(o.op){
+			case IO_ACCEPT:
+				n = accept4(o.fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				if(n >= 0){
+					o.value = n;
+					return true;
+				}
+				break;
+			case IO_SEND:
+				if(o.value == o.data.size()) return true;
+				n = send(o.fd, o.data.data() + o.value, o.data.size() - o.value, MSG_NOSIGNAL);
+				if(n >= 0){
+					o.value += n;
+					continue;
+				}
+				break;
+			case IO_RECV:
+				{
+				char buf[IO_RECV_SIZE];
+				n = recv(o.fd, buf, sizeof(buf), 0);
+				if(n >= 0){
+					o.data.assign(buf, n);
+					return true;
+				}
+				}
+				break;
+			default:
+				return true;
+		}
+		if(errno == EINTR) continue;
+		if(errno == EAGAIN || errno == EWOULDBLOCK) return false;
+		o.failed = true;
+		return true;
+	}
+}
+
+void IoLoop::attempt(int id){
+	Operation &o = ops[id];
+	if(o.fd < 0) o.failed = true;
+	if(o.failed || try_socket(o)){
+		complete(id);
+		return;
+	}
+	watching[o.fd].push_back(id);
+	watch(o.fd);
+}
+
+void IoLoop::watch(int fd){
+	uint32_t wanted = 0;
+	for(int id : watching[fd]) wanted |= ops[id].op == IO_SEND ? EPOLLOUT : EPOLLIN;
+	auto had = events.find(fd);
+	if(wanted == 0){
+		watching.erase(fd);
+		if(had != events.end()){
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+			events.erase(had);
+		}
+		return;
+	}
+	if(had != events.end() && had->second == wanted) return;
+
+	epoll_event ev = {};
+	ev.events = wanted;
+	ev.data.fd = fd;
+	int how = had == events.end() ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	if(epoll_ctl(epoll_fd, how, fd, &ev) < 0){
+		// not something epoll can wait on, so it never will be ready
+		for(int id : watching[fd]){
+			ops[id].failed = true;
+			complete(id);
+		}
+		watching.erase(fd);
+		return;
+	}
+	events[fd] = wanted;
+}
+
+bool IoLoop::poll(bool block){
+	if(pending == 0) return false;
+	epoll_event ready[64];
+	int n = epoll_wait(epoll_fd, ready, 64, block ? -1 : 0);
+	for(int k = 0; k < n; k++){
+		int fd = ready[k].data.fd;
+		if(fd == wake_fd){
+			uint64_t count;
+			ssize_t ignored = read(wake_fd, &count, sizeof(count));
+			(void)ignored;
+			std::vector<int> done;
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				done.swap(finished);
+			}
+			for(int id : done) complete(id);
+			continue;
+		}
+
+		std::vector<int> waiting;
+		waiting.swap(watching[fd]);
+		for(int id : waiting){
+			if(try_socket(ops[id])) complete(id);
+			else watching[fd].push_back(id);
+		}
+		watch(fd);
+	}
+	return true;
+}
@@ -0,0 +1,1368 @@
+#include "ir.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+/*
+ * Functions start with a NEW_OBJ for each of their locals and a NEW_UNIT
+ * for each slot of inlined calls (as does the top level), but the body
+ * can start with an object literal or unit as well. Statements leave the
+ * stack as they found it, so whatever the first block of the body takes
+ * off the stack was pushed by the body.
+ */
+static int prologue_length(const std::vector<Instruction> &in, int begin, int end){
+	int i = begin;
+	while(i < end && (in[i].op == NEW_OBJ || in[i].op == NEW_UNIT)) i++;
+	int run = i - begin;
+
+	int depth = 0;
+	for(int k = i; k < end; k++){
+		Instruction ins = in[k];
+		if(ins.op == LABEL || ins.op == LOOP_LBL || ins.op == JMP_LBL) break;
+		int pops, pushes;
+		stack_effect(ins, &pops, &pushes);
+		depth += pushes - pops;
+		if(ins.op == JMP_CND || ins.op == RET) break;
+	}
+	return std::max(0, std::min(run, run + depth));
+}
+
+void optimise(CodeObject &code, LabelTable &labels){
+	std::vector<Instruction> out;
+	IrFunction function(code.code, labels, 0, code.code.size(), code.label < 0);
+	code.frame_size += function.optimise(out);
+	code.code = out;
+}
+
+/*
+ * Value classification
+ */
+
+static IrValue *resolve(IrValue *v){
+	while(v != nullptr && v->replaced != nullptr) v = v->replaced;
+	return v;
+}
+
+// rematerialised wherever they are used
+static bool is_const(IrValue *v){
+	return v->kind == IR_OP &&
+		(v->ins.op == LOAD_IMM_I || v->ins.op == LOAD_IMM_F ||
+		 v->ins.op == NEW_UNIT);
+}
+
+// always produces an int or a float
+static bool is_numeric(IrValue *v){
+	v = resolve(v);
+	if(v->kind != IR_OP) return false;
+	switch(v->ins.op){
+		case LOAD_IMM_I: case LOAD_IMM_F:
+		case MIN: case MUL: case DIV: case MOD:
+		case EQ: case LT: case LTE: case GT: case GTE:
+			return true;
+		case ADD:
+			return is_numeric(v->args[0]) && is_numeric(v->args[1]);
+		default:
+			return false;
+	}
+}
+
+/*
+ * Pure values only depend on their arguments, so they can be moved,
+ * merged and removed freely. ADD is only pure on numbers as it also
+ * appends to vectors.
+ */
+static bool is_pure(IrValue *v){
+	if(v->kind != IR_OP) return false;
+	switch(v->ins.op){
+		case LOAD_IMM_I: case LOAD_IMM_F: case NEW_UNIT:
+		case MIN: case MUL: case DIV: case MOD:
+		case EQ: case LT: case LTE: case GT: case GTE:
+			return true;
+		case ADD:
+			return is_numeric(v);
+		default:
+			return false;
+	}
+}
+
+// values that can be removed when nothing uses them
+static bool is_removable(IrValue *v){
+	if(is_pure(v)) return true;
+	if(v->kind != IR_OP) return false;
+	switch(v->ins.op){
+		case NEW_OBJ: case NEW_VEC: case NEW_STRING:
+		case CLOS_LBL: case CLOS_CAP: case LOAD_GLB:
+		case LOAD_STK:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// reads or writes globals or the heap, these stay in order
+static bool has_memory_effect(IrValue *v){
+	if(v->kind == IR_CALL) return true;
+	if(v->kind != IR_OP) return false;
+	switch(v->ins.op){
+		case LOAD_GLB: case SET_GLB:
+		case INSERT_S: case INSERT_V:
+		case LOOKUP_S: case LOOKUP_V:
+		case FFI_LOAD:
+		case SPAWN: case SEND: case RECEIVE:
+		case PAR_MAP: case PAR_REDUCE: case PAR_FOR:
+		case FIBER: case YIELD: case JOIN:
+		case CHANNEL: case CHAN_SEND: case CHAN_RECEIVE:
+		case IO_READ: case IO_WRITE: case IO_LISTEN:
+		case IO_ACCEPT: case IO_CONNECT: case IO_SEND:
+		case IO_RECV: case IO_CLOSE: case AWAIT:
+		case GEN_START: case GEN_YIELD:
+		case ITER: case ITER_NEXT: case ITER_VALUE:
+		// fields of scalar replaced objects
+		case LOAD_STK: case SET_STK:
+			return true;
+		case ADD:
+			return !is_pure(v);
+		default:
+			return false;
+	}
+}
+
+// lets a generator run, which can change any global
+static bool runs_code(IrValue *v){
+	return v->kind == IR_OP && (v->ins.op == ITER_NEXT || v->ins.op == GEN_YIELD);
+}
+
+static bool produces_value(IrValue *v){
+	if(v->kind == IR_CALL) return true;
+	if(v->kind != IR_OP) return false;
+	switch(v->ins.op){
+		case SET_GLB: case INSERT_S: case INSERT_V: case FFI_LOAD:
+		case SET_STK: case GEN_START: case GEN_YIELD:
+			return false;
+		default:
+			return true;
+	}
+}
+
+/*
+ * Building
+ */
+
+IrFunction::IrFunction(const std::vector<Instruction> &in, LabelTable &labels,
+					   int begin, int end, bool top)
+	: in(in), labels(labels), begin(begin), end(end), top(top){
+	int i = begin;
+	if(!top) head.push_back(in[i++]);
+	int locals = prologue_length(in, i, end);
+	for(int n = 0; n < locals; n++) head.push_back(in[i++]);
+
+	for(; i < end; i++){
+		IrItem item;
+		item.raw = i;
+		item.ins = in[i];
+		items.push_back(item);
+	}
+}
+
+IrFunction::~IrFunction(){
+	for(IrValue *v : values) delete v;
+	for(IrBlock *b : blocks) delete b;
+}
+
+IrValue *IrFunction::new_value(enum IrKind kind, IrBlock *b){
+	IrValue *v = new IrValue();
+	v->id = values.size();
+	v->kind = kind;
+	v->block = b;
+	v->ins.op = LABEL;
+	v->ins.ptr = nullptr;
+	values.push_back(v);
+	return v;
+}
+
+IrBlock *IrFunction::new_block(void){
+	IrBlock *b = new IrBlock();
+	b->id = blocks.size();
+	blocks.push_back(b);
+	return b;
+}
+
+IrValue *IrFunction::new_phi(int var, IrBlock *b){
+	IrValue *phi = new_value(IR_PHI, b);
+	phi->var = var;
+	b->phis.push_back(phi);
+	return phi;
+}
+
+/*
+ * SSA construction following Braun et al. "Simple and Efficient
+ * Construction of Static Single Assignment Form".
+ */
+IrValue *IrFunction::read_variable(int var, IrBlock *b){
+	auto def = b->defs.find(var);
+	if(def != b->defs.end()) return resolve(def->second);
+
+	IrValue *value;
+	if(!b->sealed){
+		value = new_phi(var, b);
+		b->incomplete[var] = value;
+	} else if(b->preds.size() == 1){
+		value = read_variable(var, b->preds[0]);
+	} else{
+		// break cycles through loops with an operandless phi
+		IrValue *phi = new_phi(var, b);
+		b->defs[var] = phi;
+		value = add_phi_operands(phi);
+	}
+	b->defs[var] = value;
+	return value;
+}
+
+IrValue *IrFunction::add_phi_operands(IrValue *phi){
+	for(IrBlock *pred : phi->block->preds){
+		phi->args.push_back(read_variable(phi->var, pred));
+	}
+	return phi;
+}
+
+void IrFunction::seal(IrBlock *b){
+	for(auto &incomplete : b->incomplete){
+		add_phi_operands(incomplete.second);
+	}
+	b->incomplete.clear();
+	b->sealed = true;
+}
+
+void IrFunction::build(void){
+	if(items.empty()){
+		ok = false;
+		return;
+	}
+
+	std::map<int, int> label_item;
+	std::map<int, int> raw_item;
+	for(int k = 0; k < items.size(); k++){
+		raw_item[items[k].raw] = k;
+		if(items[k].ins.op == LABEL)
+			label_item[items[k].ins.i] = k;
+	}
+
+	// find the leaders
+	std::vector<bool> leader(items.size() + 1, false);
+	std::vector<int> cnd_target(items.size(), -1);
+	leader[0] = true;
+	for(int k = 0; k < items.size(); k++){
+		Instruction &ins = items[k].ins;
+		switch(ins.op){
+			case LABEL:
+				leader[k] = true;
+				break;
+			case JMP_LBL:
+			case LOOP_LBL:
+			case RET:
+				leader[k+1] = true;
+				break;
+			case JMP_CND:
+				{
+				auto target = raw_item.find(items[k].raw + ins.i);
+				if(target == raw_item.end()){
+					ok = false;
+					return;
+				}
+				cnd_target[k] = target->second;
+				leader[k+1] = true;
+				leader[target->second] = true;
+				}
+				break;
+			case LOAD_STK:
+			case SET_STK:
+			case CLOS_CAP:
+				vars.insert(ins.index);
+				break;
+			default:
+				break;
+		}
+	}
+
+	IrBlock *entry = new_block();
+	std::vector<IrBlock *> block_of(items.size());
+	for(int k = 0; k < items.size(); k++){
+		if(leader[k]){
+			IrBlock *b = new_block();
+			b->first = k;
+		}
+		blocks.back()->last = k;
+		block_of[k] = blocks.back();
+	}
+
+	// find the exits
+	entry->exit = EXIT_FALL;
+	entry->next = blocks[1];
+	for(int n = 1; n < blocks.size(); n++){
+		IrBlock *b = blocks[n];
+		IrBlock *following = n+1 < blocks.size() ? blocks[n+1] : nullptr;
+		IrItem &last = items[b->last];
+		enum OpCode op = last.ins.op;
+
+		if(op == JMP_LBL || op == LOOP_LBL){
+			auto label = label_item.find(last.ins.i);
+			if(label == label_item.end()){
+				ok = false;
+				return;
+			}
+			b->exit = op == JMP_LBL ? EXIT_JUMP : EXIT_LOOP;
+			b->target = block_of[label->second];
+		} else if(op == JMP_CND){
+			if(following == nullptr){
+				ok = false;
+				return;
+			}
+			b->exit = EXIT_COND;
+			b->target = block_of[cnd_target[b->last]];
+			b->next = following;
+		} else if(op == RET){
+			b->exit = EXIT_RET;
+		} else if(following != nullptr){
+			b->exit = EXIT_FALL;
+			b->next = following;
+		} else{
+			b->exit = EXIT_END;
+		}
+	}
+
+	// reachability and predecessors
+	std::vector<IrBlock *> work = { entry };
+	entry->reachable = true;
+	while(!work.empty()){
+		IrBlock *b = work.back();
+		work.pop_back();
+		for(IrBlock *succ : { b->target, b->next }){
+			if(succ == nullptr) continue;
+			succ->preds.push_back(b);
+			if(!succ->reachable){
+				succ->reachable = true;
+				work.push_back(succ);
+			}
+		}
+	}
+
+	// the values of the locals when the function is entered
+	for(int var : vars){
+		IrValue *v = new_value(IR_ENTRY, entry);
+		v->var = var;
+		entry->defs[var] = v;
+	}
+	entry->entry = entry->defs;
+	entry->sealed = true;
+	entry->filled = true;
+
+	for(int n = 1; n < blocks.size() && ok; n++){
+		IrBlock *b = blocks[n];
+		if(!b->reachable) continue;
+		fill(b);
+
+		for(IrBlock *other : blocks){
+			if(!other->reachable || other->sealed) continue;
+			bool ready = true;
+			for(IrBlock *pred : other->preds) ready = ready && pred->filled;
+			if(ready) seal(other);
+		}
+	}
+}
+
+void IrFunction::fill(IrBlock *b){
+	for(int var : vars){
+		b->entry[var] = read_variable(var, b);
+	}
+
+	std::vector<IrValue *> stack;
+	auto pop = [&]() -> IrValue *{
+		if(stack.empty()){
+			ok = false;
+			return nullptr;
+		}
+		IrValue *v = stack.back();
+		stack.pop_back();
+		return v;
+	};
+	auto op = [&](Instruction ins, int pops) -> IrValue *{
+		IrValue *v = new_value(IR_OP, b);
+		v->ins = ins;
+		v->args.resize(pops);
+		for(int n = pops-1; n >= 0; n--) v->args[n] = pop();
+		b->code.push_back(v);
+		return v;
+	};
+
+	for(int k = b->first; k <= b->last && ok; k++){
+		Instruction ins = items[k].ins;
+		switch(ins.op){
+			case LABEL:
+			case JMP_LBL:
+			case LOOP_LBL:
+				break;
+			case LOAD_IMM_I: case LOAD_IMM_F:
+			case NEW_OBJ: case NEW_VEC: case NEW_UNIT:
+			case NEW_STRING: case CLOS_LBL: case LOAD_GLB:
+				stack.push_back(op(ins, 0));
+				break;
+			case SET_GLB:
+				op(ins, 1);
+				break;
+			case INSERT_S:
+				op(ins, 2);
+				break;
+			case INSERT_V:
+				op(ins, 3);
+				break;
+			case LOOKUP_S:
+				stack.push_back(op(ins, 1));
+				break;
+			case LOOKUP_V:
+			case ADD: case MIN: case MUL: case DIV: case MOD:
+			case EQ: case LT: case LTE: case GT: case GTE:
+				stack.push_back(op(ins, 2));
+				break;
+			case FFI_LOAD:
+				op(ins, 0);
+				break;
+			case SPAWN:
+				stack.push_back(op(ins, ins.i + 1));
+				break;
+			case SEND:
+				stack.push_back(op(ins, 2));
+				break;
+			case RECEIVE:
+				stack.push_back(op(ins, 0));
+				break;
+			case PAR_MAP:
+				stack.push_back(op(ins, 2));
+				break;
+			case PAR_REDUCE: case PAR_FOR:
+				stack.push_back(op(ins, 3));
+				break;
+			case FIBER:
+				stack.push_back(op(ins, ins.i + 1));
+				break;
+			case YIELD: case CHANNEL:
+				stack.push_back(op(ins, 0));
+				break;
+			case JOIN: case CHAN_RECEIVE:
+				stack.push_back(op(ins, 1));
+				break;
+			case CHAN_SEND: case IO_WRITE: case IO_SEND:
+				stack.push_back(op(ins, 2));
+				break;
+			case IO_READ: case IO_LISTEN: case IO_ACCEPT: case IO_CONNECT:
+			case IO_RECV: case IO_CLOSE: case AWAIT:
+			case ITER: case ITER_NEXT: case ITER_VALUE:
+				stack.push_back(op(ins, 1));
+				break;
+			case GEN_START:
+				op(ins, 0);
+				break;
+			case GEN_YIELD:
+				op(ins, 1);
+				break;
+			case LOAD_STK:
+				stack.push_back(read_variable(ins.index, b));
+				break;
+			case SET_STK:
+				{
+				IrValue *v = new_value(IR_STORE, b);
+				v->var = ins.index;
+				v->args.push_back(pop());
+				b->code.push_back(v);
+				b->defs[ins.index] = v->args[0];
+				}
+				break;
+			case CLOS_CAP:
+				{
+				IrValue *v = op(ins, 1);
+				v->args.push_back(read_variable(ins.index, b));
+				stack.push_back(v);
+				}
+				break;
+			case DROP:
+				pop();
+				break;
+			case PUSH_FRAME:
+				{
+				if(k+1 > b->last ||
+					(items[k+1].ins.op != JMP_CLOS &&
+					 items[k+1].ins.op != FFI_CALL_SYM &&
+					 items[k+1].ins.op != FFI_CALL)){
+					ok = false;
+					break;
+				}
+				IrValue *v = new_value(IR_CALL, b);
+				v->ins = items[++k].ins;
+				v->args.resize(ins.i);
+				for(int n = ins.i-1; n >= 0; n--) v->args[n] = pop();
+				b->code.push_back(v);
+				stack.push_back(v);
+				}
+				break;
+			case JMP_CND:
+			case RET:
+				b->operand = pop();
+				break;
+			default:
+				ok = false;
+				break;
+		}
+	}
+
+	// statements leave the stack as they found it
+	if(!stack.empty()) ok = false;
+	b->filled = true;
+}
+
+/*
+ * Passes
+ */
+
+/*
+ * Copy propagation: copies between locals disappear while building the
+ * SSA form, this removes the phis that only merge one value.
+ */
+void IrFunction::remove_trivial_phis(void){
+	bool changed = true;
+	while(changed){
+		changed = false;
+		for(IrBlock *b : blocks){
+			for(IrValue *phi : b->phis){
+				if(phi->replaced != nullptr) continue;
+				IrValue *same = nullptr;
+				bool trivial = true;
+				for(IrValue *arg : phi->args){
+					arg = resolve(arg);
+					if(arg == phi || arg == same) continue;
+					if(same != nullptr){
+						trivial = false;
+						break;
+					}
+					same = arg;
+				}
+				if(trivial && same != nullptr){
+					phi->replaced = same;
+					changed = true;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Copy propagation for globals: a load of a global that was stored or
+ * loaded earlier in the block, with no call or generator running in
+ * between, reuses the value.
+ * The same goes for the slots of scalar replaced objects.
+ */
+void IrFunction::forward_globals(void){
+	for(IrBlock *b : blocks){
+		std::map<std::string, IrValue *> known;
+		// fields of scalar replaced objects, calls can't see these
+		std::map<int, IrValue *> fields;
+		for(IrValue *v : b->code){
+			if(v->kind == IR_CALL || runs_code(v)){
+				known.clear();
+			} else if(v->kind == IR_OP && v->ins.op == LOAD_GLB){
+				auto found = known.find(v->ins.str);
+				if(found != known.end()) v->replaced = resolve(found->second);
+				else known[v->ins.str] = v;
+			} else if(v->kind == IR_OP && v->ins.op == SET_GLB){
+				known[v->ins.str] = resolve(v->args[0]);
+			} else if(v->kind == IR_OP && v->ins.op == LOAD_STK){
+				auto found = fields.find(v->ins.index);
+				if(found != fields.end()) v->replaced = resolve(found->second);
+				else fields[v->ins.index] = v;
+			} else if(v->kind == IR_OP && v->ins.op == SET_STK){
+				fields[v->ins.index] = resolve(v->args[0]);
+			}
+		}
+	}
+}
+
+/*
+ * Escape analysis and scalar replacement. An object or vector literal
+ * that is only ever read and written through (or kept in locals) can't
+ * be seen by anything else, so instead of allocating it each of its
+ * fields or elements is given a slot in the frame.
+ *
+ * The allocation mustn't reach a phi, since then an older allocation
+ * from the same site could still be alive when a new one is made.
+ */
+void IrFunction::scalar_replace(void){
+	typedef std::pair<IrValue *, int> Use;
+	std::map<IrValue *, std::vector<Use>> users;
+	std::set<IrValue *> escaped;
+	std::vector<IrValue *> allocations;
+
+	// every block gets a phi for every local, only the ones
+	// something reads from matter, and everything they merge escapes
+	std::vector<IrValue *> phis;
+	std::set<IrValue *> visited;
+	auto use_phi = [&](IrValue *v){
+		v = resolve(v);
+		if(v->kind != IR_PHI || !visited.insert(v).second) return;
+		escaped.insert(v);
+		phis.push_back(v);
+	};
+
+	for(IrBlock *b : blocks){
+		if(!b->reachable) continue;
+		for(IrValue *v : b->code){
+			for(int n = 0; n < v->args.size(); n++){
+				users[resolve(v->args[n])].push_back({ v, n });
+				use_phi(v->args[n]);
+			}
+			if(v->kind == IR_OP && (v->ins.op == NEW_OBJ || v->ins.op == NEW_VEC))
+				allocations.push_back(v);
+		}
+		if(b->operand != nullptr){
+			escaped.insert(resolve(b->operand));
+			use_phi(b->operand);
+		}
+	}
+	while(!phis.empty()){
+		IrValue *phi = phis.back();
+		phis.pop_back();
+		for(IrValue *arg : phi->args){
+			escaped.insert(resolve(arg));
+			use_phi(arg);
+		}
+	}
+
+	auto const_index = [](IrValue *v) -> int{
+		v = resolve(v);
+		if(v->kind == IR_OP && v->ins.op == LOAD_IMM_I) return v->ins.i;
+		return -1;
+	};
+
+	if(temp_base == 0) for(int var : vars) temp_base = std::max(temp_base, var + 1);
+
+	for(IrValue *alloc : allocations){
+		if(alloc->replaced != nullptr || escaped.count(alloc)) continue;
+		bool vector = alloc->ins.op == NEW_VEC;
+
+		// a vector literal is built by appending to the new vector,
+		// each append gives the same vector back
+		std::vector<IrValue *> appends;
+		IrValue *last = alloc;
+		while(vector && users[last].size() == 1){
+			Use use = users[last][0];
+			IrValue *user = use.first;
+			if(user->kind != IR_OP || user->ins.op != ADD || use.second != 0 ||
+				escaped.count(user))
+				break;
+			appends.push_back(user);
+			last = user;
+		}
+		int length = appends.size();
+
+		bool escapes = false;
+		for(Use use : users[last]){
+			IrValue *user = use.first;
+			if(user->kind == IR_STORE) continue;
+			if(user->kind != IR_OP){
+				escapes = true;
+				break;
+			}
+			switch(user->ins.op){
+				case INSERT_S: escapes = vector || use.second != 1; break;
+				case LOOKUP_S: escapes = vector; break;
+				case LOOKUP_V:
+					{
+					int index = const_index(user->args[1]);
+					escapes = !vector || use.second != 0 || index < 0 || index >= length;
+					}
+					break;
+				case INSERT_V:
+					{
+					int index = const_index(user->args[2]);
+					escapes = !vector || use.second != 1 || index < 0 || index >= length;
+					}
+					break;
+				default: escapes = true; break;
+			}
+			if(escapes) break;
+		}
+		if(escapes) continue;
+
+		// the object is replaced by unit wherever it was kept
+		alloc->ins = new_unit();
+		std::map<std::string, int> fields;
+		auto slot_of = [&](std::string field){
+			if(fields.count(field) == 0) fields[field] = temp_base + temp_count++;
+			return fields[field];
+		};
+
+		for(int n = 0; n < length; n++){
+			IrValue *append = appends[n];
+			append->ins = set_stk(slot_of(std::to_string(n)));
+			append->args = { append->args[1] };
+		}
+		for(Use use : users[last]){
+			IrValue *user = use.first;
+			switch(user->kind == IR_STORE ? SET_STK : user->ins.op){
+				case SET_STK:
+					user->args[0] = alloc;
+					break;
+				case INSERT_S:
+					user->ins = set_stk(slot_of(user->ins.str));
+					user->args = { user->args[0] };
+					break;
+				case LOOKUP_S:
+					user->ins = load_stk(slot_of(user->ins.str));
+					user->args.clear();
+					break;
+				case LOOKUP_V:
+					user->ins = load_stk(slot_of(std::to_string(const_index(user->args[1]))));
+					user->args.clear();
+					break;
+				case INSERT_V:
+					user->ins = set_stk(slot_of(std::to_string(const_index(user->args[2]))));
+					user->args = { user->args[0] };
+					break;
+				default:
+					break;
+			}
+		}
+	}
+}
+
+void IrFunction::dominators(void){
+	std::vector<IrBlock *> order;
+	std::set<IrBlock *> visited;
+	std::vector<std::pair<IrBlock *, int>> stack = { { blocks[0], 0 } };
+	visited.insert(blocks[0]);
+	while(!stack.empty()){
+		IrBlock *b = stack.back().first;
+		int n = stack.back().second++;
+		IrBlock *succ = n == 0 ? b->next : n == 1 ? b->target : nullptr;
+		if(n >= 2){
+			order.push_back(b);
+			stack.pop_back();
+		} else if(succ != nullptr && visited.insert(succ).second){
+			stack.push_back({ succ, 0 });
+		}
+	}
+	std::reverse(order.begin(), order.end());
+	for(int n = 0; n < order.size(); n++){
+		order[n]->rpo = n;
+		order[n]->idom = nullptr;
+		order[n]->children.clear();
+	}
+
+	// Cooper, Harvey and Kennedy's iterative algorithm
+	IrBlock *entry = blocks[0];
+	entry->idom = entry;
+	bool changed = true;
+	while(changed){
+		changed = false;
+		for(IrBlock *b : order){
+			if(b == entry) continue;
+			IrBlock *idom = nullptr;
+			for(IrBlock *pred : b->preds){
+				if(pred->idom == nullptr) continue;
+				if(idom == nullptr){
+					idom = pred;
+					continue;
+				}
+				IrBlock *x = pred, *y = idom;
+				while(x != y){
+					while(x->rpo > y->rpo) x = x->idom;
+					while(y->rpo > x->rpo) y = y->idom;
+				}
+				idom = x;
+			}
+			if(idom != b->idom){
+				b->idom = idom;
+				changed = true;
+			}
+		}
+	}
+	for(IrBlock *b : order){
+		if(b != entry) b->idom->children.push_back(b);
+	}
+}
+
+static bool dominates(IrBlock *a, IrBlock *b){
+	while(true){
+		if(a == b) return true;
+		if(b->idom == b || b->idom == nullptr) return false;
+		b = b->idom;
+	}
+}
+
+/*
+ * Common subexpression elimination, pure values are numbered
+ * by walking the dominator tree.
+ */
+void IrFunction::gvn(IrBlock *b, std::map<std::vector<long>, IrValue *> &table){
+	std::vector<std::vector<long>> added;
+	for(IrValue *v : b->code){
+		if(v->replaced != nullptr || !is_pure(v)) continue;
+
+		std::vector<long> key = { v->ins.op };
+		if(v->ins.op == LOAD_IMM_F){
+			int bits;
+			memcpy(&bits, &v->ins.f, sizeof(bits));
+			key.push_back(bits);
+		} else if(v->ins.op == LOAD_IMM_I){
+			key.push_back(v->ins.i);
+		}
+		for(IrValue *arg : v->args) key.push_back(resolve(arg)->id);
+
+		auto found = table.find(key);
+		if(found != table.end()){
+			v->replaced = found->second;
+		} else{
+			table[key] = v;
+			added.push_back(key);
+		}
+	}
+
+	for(IrBlock *child : b->children) gvn(child, table);
+	for(auto &key : added) table.erase(key);
+}
+
+/*
+ * Loop invariant code motion, pure values whose arguments are all
+ * defined outside of a loop move to a new block in front of it.
+ */
+void IrFunction::licm(void){
+	typedef struct{
+		IrBlock *header;
+		std::set<IrBlock *> body;
+	} Loop;
+	std::vector<Loop> loops;
+
+	for(IrBlock *b : blocks){
+		if(!b->reachable) continue;
+		for(IrBlock *h : { b->target, b->next }){
+			if(h == nullptr || !dominates(h, b)) continue;
+
+			Loop *loop = nullptr;
+			for(Loop &l : loops) if(l.header == h) loop = &l;
+			if(loop == nullptr){
+				loops.push_back({ h, { h } });
+				loop = &loops.back();
+			}
+			std::vector<IrBlock *> work = { b };
+			while(!work.empty()){
+				IrBlock *x = work.back();
+				work.pop_back();
+				if(!loop->body.insert(x).second && x != b) continue;
+				if(x == h) continue;
+				for(IrBlock *pred : x->preds){
+					if(loop->body.count(pred) == 0) work.push_back(pred);
+				}
+			}
+		}
+	}
+
+	// inner loops first
+	std::sort(loops.begin(), loops.end(), [](const Loop &a, const Loop &b){
+		return a.body.size() < b.body.size();
+	});
+
+	for(Loop &loop : loops){
+		IrBlock *h = loop.header;
+		IrBlock *outside = nullptr;
+		bool single = true;
+		for(IrBlock *pred : h->preds){
+			if(loop.body.count(pred)) continue;
+			if(outside != nullptr && outside != pred) single = false;
+			outside = pred;
+		}
+		if(outside == nullptr || !single) continue;
+
+		std::vector<IrValue *> hoisted;
+		std::set<IrValue *> moved;
+		bool changed = true;
+		while(changed){
+			changed = false;
+			for(IrBlock *b : blocks){
+				if(loop.body.count(b) == 0) continue;
+				for(IrValue *v : b->code){
+					if(v->replaced != nullptr || moved.count(v)) continue;
+					if(!is_pure(v) || is_const(v)) continue;
+					// these can trap if the loop would never have run
+					if(v->ins.op == DIV || v->ins.op == MOD) continue;
+
+					bool invariant = true;
+					for(IrValue *arg : v->args){
+						arg = resolve(arg);
+						if(is_const(arg) || moved.count(arg)) continue;
+						if(loop.body.count(arg->block)) invariant = false;
+					}
+					if(!invariant) continue;
+					hoisted.push_back(v);
+					moved.insert(v);
+					changed = true;
+				}
+			}
+		}
+		if(hoisted.empty()) continue;
+
+		IrBlock *pre = new IrBlock();
+		pre->reachable = true;
+		pre->sealed = true;
+		pre->filled = true;
+		pre->exit = EXIT_FALL;
+		pre->next = h;
+		pre->preds.push_back(outside);
+		pre->entry = outside->defs;
+		pre->defs = outside->defs;
+		pre->idom = outside;
+		pre->id = blocks.size();
+
+		if(outside->next == h) outside->next = pre;
+		if(outside->target == h) outside->target = pre;
+		for(IrBlock *&pred : h->preds) if(pred == outside) pred = pre;
+		blocks.insert(std::find(blocks.begin(), blocks.end(), h), pre);
+
+		for(IrValue *v : hoisted){
+			auto &code = v->block->code;
+			code.erase(std::find(code.begin(), code.end(), v));
+			v->block = pre;
+			pre->code.push_back(v);
+		}
+
+		// the new block is part of any loop around this one
+		for(Loop &other : loops){
+			if(&other != &loop && other.body.count(h)) other.body.insert(pre);
+		}
+	}
+}
+
+/*
+ * Dead code elimination, removes values that nothing uses
+ * and don't have any effect.
+ */
+void IrFunction::dce(void){
+	std::set<IrValue *> live;
+	std::vector<IrValue *> work;
+	auto mark = [&](IrValue *v){
+		v = resolve(v);
+		if(live.insert(v).second) work.push_back(v);
+	};
+
+	// slots of scalar replaced objects that are never read
+	std::set<int> read;
+	for(IrBlock *b : blocks){
+		for(IrValue *v : b->code){
+			if(v->replaced == nullptr && v->kind == IR_OP && v->ins.op == LOAD_STK)
+				read.insert(v->ins.index);
+		}
+	}
+	auto dead_store = [&](IrValue *v){
+		return v->kind == IR_OP && v->ins.op == SET_STK && read.count(v->ins.index) == 0;
+	};
+
+	for(IrBlock *b : blocks){
+		if(!b->reachable) continue;
+		for(IrValue *v : b->code){
+			if(v->replaced == nullptr && !is_removable(v) && !dead_store(v)) mark(v);
+		}
+		if(b->operand != nullptr) mark(b->operand);
+	}
+	while(!work.empty()){
+		IrValue *v = work.back();
+		work.pop_back();
+		for(IrValue *arg : v->args) mark(arg);
+	}
+
+	for(IrBlock *b : blocks){
+		std::vector<IrValue *> code;
+		for(IrValue *v : b->code){
+			if(v->replaced == nullptr && live.count(v)) code.push_back(v);
+			else v->dead = true;
+		}
+		b->code = code;
+	}
+}
+
+static int join(int a, int b){
+	if(a == IR_NO_TYPE) return b;
+	if(b == IR_NO_TYPE || a == b) return a;
+	return IR_ANY_TYPE;
+}
+
+static int arith_type(int a, int b){
+	if(a == IR_NO_TYPE || b == IR_NO_TYPE) return IR_NO_TYPE;
+	if(a == INT && b == INT) return INT;
+	if(a == FLOAT && b == FLOAT) return FLOAT;
+	return IR_ANY_TYPE;
+}
+
+static int type_of(IrValue *v){
+	v = resolve(v);
+	switch(v->kind){
+		case IR_PHI:
+			{
+			int type = IR_NO_TYPE;
+			for(IrValue *arg : v->args) type = join(type, resolve(arg)->type);
+			return type;
+			}
+		case IR_OP:
+			break;
+		default:
+			return IR_ANY_TYPE;
+	}
+
+	switch(v->ins.op){
+		case LOAD_IMM_I: case NEW_UNIT:
+			return INT;
+		case LOAD_IMM_F:
+			return FLOAT;
+		case NEW_OBJ:
+			return DICT;
+		case NEW_VEC:
+			return ARRAY;
+		case NEW_STRING:
+			return STRING;
+		case ADD: case MIN: case MUL: case DIV:
+			return arith_type(resolve(v->args[0])->type, resolve(v->args[1])->type);
+		// these make an int out of anything
+		case MOD: case EQ: case LT: case LTE: case GT: case GTE:
+			return INT;
+		default:
+			return IR_ANY_TYPE;
+	}
+}
+
+/*
+ * Type inference, propagates the types of constants through the
+ * arithmetic and phis until nothing changes. Values start out knowing
+ * nothing so a loop counter that starts as an int and is only ever
+ * incremented stays an int. Locals only become values through SSA
+ * renaming so this is flow sensitive for free.
+ */
+void IrFunction::infer_types(void){
+	for(IrValue *v : values) v->type = IR_NO_TYPE;
+
+	bool changed = true;
+	while(changed){
+		changed = false;
+		for(IrValue *v : values){
+			if(v->replaced != nullptr) continue;
+			int type = type_of(v);
+			if(type != v->type){
+				v->type = type;
+				changed = true;
+			}
+		}
+	}
+}
+
+/*
+ * The unchecked version of an op if both of its operands are ints.
+ */
+static Instruction select_op(IrValue *v){
+	Instruction ins = v->ins;
+	if(v->args.size() != 2 ||
+		resolve(v->args[0])->type != INT || resolve(v->args[1])->type != INT)
+		return ins;
+
+	switch(ins.op){
+		case ADD: ins.op = ADD_II; break;
+		case MIN: ins.op = MIN_II; break;
+		case MUL: ins.op = MUL_II; break;
+		case DIV: ins.op = DIV_II; break;
+		case MOD: ins.op = MOD_II; break;
+		case LT: ins.op = LT_II; break;
+		case LTE: ins.op = LTE_II; break;
+		case GT: ins.op = GT_II; break;
+		case GTE: ins.op = GTE_II; break;
+		default: break;
+	}
+	return ins;
+}
+
+/*
+ * Lowering
+ *
+ * The code of a block is walked in order. Values with effects are emitted
+ * at their position, or deferred until they are used if that keeps them
+ * in order with everything else touching memory. Pure values are emitted
+ * where they're first used, and constants wherever they are used. A value
+ * used again later is found in whichever local holds it, or failing that
+ * in a temporary. As none of that is known up front the block is walked
+ * dry until the decisions stop changing.
+ */
+
+void IrFunction::count_uses(void){
+	uses.clear();
+	used_in_block.clear();
+	for(IrBlock *b : blocks){
+		if(!b->reachable) continue;
+		auto use = [&](IrValue *v, bool inline_use){
+			v = resolve(v);
+			uses[v]++;
+			if(inline_use && v->block == b) used_in_block.insert(v);
+		};
+		for(IrValue *v : b->code){
+			for(int n = 0; n < v->args.size(); n++){
+				// CLOS_CAP reads its variable from a slot
+				bool captured = v->kind == IR_OP && v->ins.op == CLOS_CAP && n == 1;
+				use(v->args[n], !captured);
+			}
+		}
+		if(b->operand != nullptr) use(b->operand, true);
+	}
+}
+
+bool IrFunction::threadable(IrBlock *b){
+	if(b->exit != EXIT_JUMP && b->exit != EXIT_FALL) return false;
+	for(IrValue *v : b->code) if(!is_const(v)) return false;
+	return true;
+}
+
+/*
+ * Follows jumps through empty blocks.
+ */
+IrBlock *IrFunction::thread(IrBlock *b){
+	for(int n = 0; n < 32 && threadable(b); n++){
+		b = b->exit == EXIT_JUMP ? b->target : b->next;
+	}
+	return b;
+}
+
+int IrFunction::label_of(IrBlock *b){
+	if(b->label < 0) b->label = labels.new_label();
+	return b->label;
+}
+
+void IrFunction::put(Instruction i){
+	if(!dry) out->push_back(i);
+}
+
+void IrFunction::violation(IrValue *v){
+	if(!dry){
+		ok = false;
+		return;
+	}
+	at_position.insert(v);
+	if(temp_of.count(v) == 0) temp_of[v] = temp_base + temp_count++;
+	changed = true;
+}
+
+/*
+ * Finds a slot holding an already computed value.
+ */
+int IrFunction::location(IrValue *v){
+	for(auto &var : cur){
+		if(resolve(var.second) == v) return var.first;
+	}
+	auto temp = temp_of.find(v);
+	if(temp != temp_of.end()) return temp->second;
+
+	// phis and entry values live in their local, losing track of one
+	// means the function's stores have been moved around
+	if(!dry || v->kind == IR_PHI || v->kind == IR_ENTRY){
+		ok = false;
+		return 0;
+	}
+	temp_of[v] = temp_base + temp_count++;
+	changed = true;
+	return temp_of[v];
+}
+
+void IrFunction::emit_operand(IrValue *v){
+	v = resolve(v);
+	if(is_const(v)){
+		put(v->ins);
+		return;
+	}
+	if(emitted.count(v) == 0 && v->block == block &&
+		(v->kind == IR_OP || v->kind == IR_CALL)){
+		compute(v, true);
+		return;
+	}
+	put(load_stk(location(v)));
+}
+
+/*
+ * Emits a value and everything it uses that hasn't been emitted yet.
+ */
+void IrFunction::compute(IrValue *v, bool inlined){
+	// CLOS_CAP's second argument is read straight from its slot
+	bool capture = v->kind == IR_OP && v->ins.op == CLOS_CAP;
+	int operands = capture ? 1 : v->args.size();
+	for(int n = 0; n < operands; n++) emit_operand(v->args[n]);
+
+	if(inlined && !is_pure(v)){
+		if(!pending.empty() && pending.front() == v) pending.pop_front();
+		else violation(v);
+	}
+
+	switch(v->kind){
+		case IR_STORE:
+			put(set_stk(v->var));
+			cur[v->var] = resolve(v->args[0]);
+			break;
+		case IR_CALL:
+			put(push_frame(v->args.size()));
+			put(v->ins);
+			break;
+		default:
+			if(capture) put(closure_capture(location(resolve(v->args[1]))));
+			else put(select_op(v));
+			break;
+	}
+	emitted.insert(v);
+
+	if(inlined && temp_of.count(v)){
+		put(set_stk(temp_of[v]));
+		put(load_stk(temp_of[v]));
+	}
+}
+
+void IrFunction::emit_block(IrBlock *b, IrBlock *next){
+	block = b;
+	cur.clear();
+	for(auto &var : b->entry) cur[var.first] = resolve(var.second);
+	pending.clear();
+
+	if(needs_label.count(b)) put(label(label_of(b)));
+
+	for(IrValue *v : b->code){
+		if(is_const(v) || emitted.count(v)) continue;
+
+		if(!produces_value(v) || uses.count(v) == 0){
+			compute(v, false);
+			if(produces_value(v)) put(drop());
+		} else if(at_position.count(v) || used_in_block.count(v) == 0){
+			if(temp_of.count(v) == 0) violation(v);
+			compute(v, false);
+			put(set_stk(temp_of[v]));
+		} else{
+			if(!is_pure(v)) pending.push_back(v);
+			continue;
+		}
+
+		if((has_memory_effect(v) || v->kind == IR_STORE) && !pending.empty()){
+			// something was deferred past an effect
+			for(IrValue *p : pending) violation(p);
+			pending.clear();
+		}
+	}
+
+	emit_exit(b, next);
+	for(IrValue *p : pending) violation(p);
+}
+
+void IrFunction::emit_exit(IrBlock *b, IrBlock *next){
+	auto jump = [&](IrBlock *target){
+		target = thread(target);
+		if(target == next) return;
+		needs_label.insert(target);
+		put(jmp_lbl(label_of(target)));
+	};
+
+	switch(b->exit){
+		case EXIT_FALL:
+			jump(b->next);
+			break;
+		case EXIT_JUMP:
+			jump(b->target);
+			break;
+		case EXIT_LOOP:
+			needs_label.insert(b->target);
+			put(loop_lbl(label_of(b->target)));
+			break;
+		case EXIT_COND:
+			{
+			emit_operand(b->operand);
+			IrBlock *taken = thread(b->target);
+			IrBlock *fall = thread(b->next);
+			put(jmp_cnd(2));
+			needs_label.insert(fall);
+			put(jmp_lbl(label_of(fall)));
+			if(taken != next){
+				needs_label.insert(taken);
+				put(jmp_lbl(label_of(taken)));
+			}
+			}
+			break;
+		case EXIT_RET:
+			emit_operand(b->operand);
+			put(ret());
+			break;
+		case EXIT_END:
+			break;
+	}
+}
+
+bool IrFunction::lower(std::vector<Instruction> &result){
+	count_uses();
+	if(temp_base == 0) for(int var : vars) temp_base = std::max(temp_base, var + 1);
+
+	std::vector<IrBlock *> layout;
+	for(IrBlock *b : blocks){
+		if(b->reachable && !threadable(b)) layout.push_back(b);
+	}
+	IrBlock *start = thread(blocks[0]);
+
+	std::vector<Instruction> code;
+	auto walk = [&](){
+		changed = false;
+		code.clear();
+		out = &code;
+		emitted.clear();
+
+		if(layout.empty() || layout[0] != start){
+			needs_label.insert(start);
+			put(jmp_lbl(label_of(start)));
+		}
+		for(int n = 0; n < layout.size() && ok; n++){
+			emit_block(layout[n], n+1 < layout.size() ? layout[n+1] : nullptr);
+		}
+	};
+
+	dry = true;
+	for(int pass = 0; pass < 16; pass++){
+		walk();
+		if(!ok) return false;
+		if(!changed) break;
+	}
+	if(changed) return false;
+	dry = false;
+	walk();
+	if(!ok) return false;
+
+	result = head;
+	for(int n = 0; n < temp_count; n++) result.push_back(new_unit());
+	result.insert(result.end(), code.begin(), code.end());
+	return true;
+}
+
+void IrFunction::copy_items(std::vector<Instruction> &out){
+	out.insert(out.end(), in.begin() + begin, in.begin() + end);
+}
+
+int IrFunction::optimise(std::vector<Instruction> &out){
+	if(ok) build();
+	if(ok){
+		remove_trivial_phis();
+		scalar_replace();
+		forward_globals();
+		dominators();
+		std::map<std::vector<long>, IrValue *> table;
+		gvn(blocks[0], table);
+		licm();
+		dce();
+		infer_types();
+	}
+
+	std::vector<Instruction> lowered;
+	if(ok && lower(lowered)){
+		out.insert(out.end(), lowered.begin(), lowered.end());
+		return temp_count;
+	}
+	copy_items(out);
+	return 0;
+}
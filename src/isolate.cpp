@@ -0,0 +1,16 @@
+#include "isolate.hpp"
+
+Isolate::Isolate(std::ostream &out) : out(out){
+	enter();
+	globals = new Dictionary();
+	leave();
+}
+
+void Isolate::enter(void){
+	outer = Heap::set(&heap);
+}
+
+void Isolate::leave(void){
+	Heap::set(outer);
+	outer = nullptr;
+}
@@ -0,0 +1,478 @@
+#include "jit.hpp"
+
+#include <iostream>
+
+TraceJit::TraceJit(ProgramView &is, Dictionary *globals)
+	: program(is), globals(globals){
+	hotness = std::vector<int>(is.size(), 0);
+	attempts = std::vector<int>(is.size(), 0);
+}
+
+/*
+ * Recording
+ */
+
+void TraceJit::start_recording(int header, int back_edge){
+	recording = true;
+	record_header = header;
+	record_end = back_edge;
+	recorded_ips.clear();
+	recorded_types.clear();
+}
+
+void TraceJit::abort_recording(void){
+	recording = false;
+	attempts[record_header]++;
+	hotness[record_header] = 0;
+}
+
+void TraceJit::record(Context *ctxt, int ip){
+	// a while loop body is contiguous, anything else means
+	// we've left the loop (break, calls etc.)
+	if(ip < record_header || ip > record_end ||
+		recorded_ips.size() >= MAX_TRACE_LENGTH){
+		abort_recording();
+		return;
+	}
+
+	Instruction i = program[ip];
+	int type = ANY_TYPE;
+	switch(i.op){
+		case PUSH_FRAME:
+		case RET:
+		case JMP_LNK:
+		case JMP_CLOS:
+		case SPEC_CALL: case SPEC_LOOKUP:
+		case FFI_LOAD:
+		case FFI_CALL_SYM:
+		case FFI_CALL:
+		case SPAWN: case SEND: case RECEIVE:
+		case PAR_MAP: case PAR_REDUCE: case PAR_FOR:
+		case FIBER: case YIELD: case JOIN:
+		case CHANNEL: case CHAN_SEND: case CHAN_RECEIVE:
+		case IO_READ: case IO_WRITE: case IO_LISTEN:
+		case IO_ACCEPT: case IO_CONNECT: case IO_SEND:
+		case IO_RECV: case IO_CLOSE: case AWAIT:
+		case GEN_START: case GEN_YIELD:
+		case CLOS_CAP: // reads a stack slot behind the trace's back
+			abort_recording();
+			return;
+		case ITER_NEXT:
+			// resuming a generator leaves the loop, the iterator
+			// comes from a slot so its type is checked on entry
+			if(ctxt->get(ctxt->frame_size() - 1).type == GENERATOR){
+				abort_recording();
+				return;
+			}
+			break;
+		case LOOP:
+			// inner loops get their own traces
+			if(ip != record_end){
+				abort_recording();
+				return;
+			}
+			break;
+		case LOAD_STK:
+			type = ctxt->get(i.index).type;
+			break;
+		case LOAD_GLB:
+			{
+			auto global = globals->find(i.str);
+			if(global == globals->end()){
+				abort_recording();
+				return;
+			}
+			type = global->second.type;
+			}
+			break;
+		default:
+			break;
+	}
+
+	recorded_ips.push_back(ip);
+	recorded_types.push_back(type);
+}
+
+/*
+ * Compiling
+ */
+
+static int pop_type(std::vector<int> &types){
+	if(types.empty()) return ANY_TYPE;
+	int t = types.back();
+	types.pop_back();
+	return t;
+}
+
+/*
+ * Picks the specialised version of an arithmetic op, returns
+ * false if there isn't one for these operand types.
+ */
+static bool specialise_arith(enum OpCode op, int a, int b,
+							 enum TraceOpCode *out, int *result){
+	*result = a;
+	if(a == INT && b == INT){
+		switch(op){
+			case ADD: *out = T_ADD_II; return true;
+			case MIN: *out = T_SUB_II; return true;
+			case MUL: *out = T_MUL_II; return true;
+			case DIV: *out = T_DIV_II; return true;
+			case MOD: *out = T_MOD_II; return true;
+			case EQ: *out = T_EQ_II; return true;
+			case LT: *out = T_LT_II; return true;
+			case LTE: *out = T_LTE_II; return true;
+			case GT: *out = T_GT_II; return true;
+			case GTE: *out = T_GTE_II; return true;
+			default: return false;
+		}
+	}
+	if(a == FLOAT && b == FLOAT){
+		*result = INT;
+		switch(op){
+			case ADD: *result = FLOAT; *out = T_ADD_FF; return true;
+			case MIN: *result = FLOAT; *out = T_SUB_FF; return true;
+			case MUL: *result = FLOAT; *out = T_MUL_FF; return true;
+			case DIV: *result = FLOAT; *out = T_DIV_FF; return true;
+			case LT: *out = T_LT_FF; return true;
+			case LTE: *out = T_LTE_FF; return true;
+			case GT: *out = T_GT_FF; return true;
+			case GTE: *out = T_GTE_FF; return true;
+			default: return false;
+		}
+	}
+	return false;
+}
+
+/*
+ * Finds (or allocates) the OsrFrame slot for a variable.
+ */
+static int find_slot(Trace &trace, std::vector<int> &slot_types,
+					 int index, ObjPtr *cell){
+	for(int s = 0; s < trace.slots.size(); s++){
+		if(cell != nullptr && trace.slots[s].cell == cell) return s;
+		if(cell == nullptr && trace.slots[s].cell == nullptr &&
+			trace.slots[s].index == index) return s;
+	}
+	trace.slots.push_back({ .index = index, .cell = cell, .type = ANY_TYPE });
+	slot_types.push_back(ANY_TYPE);
+	return trace.slots.size() - 1;
+}
+
+bool TraceJit::compile_trace(void){
+	Trace trace;
+	trace.header = record_header;
+
+	// what we know about the types on the stack
+	std::vector<int> types;
+	// what we know about the types in the OsrFrame
+	std::vector<int> slot_types;
+	// slots that have been accessed, the first access decides
+	// whether a slot's type is checked on entry
+	std::vector<bool> seen;
+
+	for(int k = 0; k < recorded_ips.size(); k++){
+		int ip = recorded_ips[k];
+		int next = k+1 < recorded_ips.size() ? recorded_ips[k+1] : record_header;
+		Instruction i = program[ip];
+
+		TraceOp t;
+		t.op = T_GENERIC;
+		t.ip = ip;
+		t.type = recorded_types[k];
+		t.ins = i;
+
+		switch(i.op){
+			case LABEL:
+			case JMP:
+			case LOOP:
+				// the trace is a straight line, jumps disappear
+				continue;
+			case LOAD_IMM_I:
+				t.op = T_LOAD_IMM_I;
+				t.i = i.i;
+				types.push_back(INT);
+				break;
+			case LOAD_IMM_F:
+				t.op = T_LOAD_IMM_F;
+				t.f = i.f;
+				types.push_back(FLOAT);
+				break;
+			case LOAD_STK:
+			case LOAD_GLB:
+			case SET_STK:
+			case SET_GLB:
+				{
+				ObjPtr *cell = nullptr;
+				if(i.op == LOAD_GLB || i.op == SET_GLB){
+					auto global = globals->find(i.str);
+					if(global == globals->end()) return false;
+					cell = &global->second;
+				}
+				int s = find_slot(trace, slot_types, i.index, cell);
+				if(s >= seen.size()) seen.push_back(false);
+				t.slot = s;
+
+				if(i.op == SET_STK || i.op == SET_GLB){
+					t.op = T_SET_SLOT;
+					slot_types[s] = pop_type(types);
+				} else if(!seen[s]){
+					// read before written, so the type is checked on entry
+					t.op = T_LOAD_SLOT;
+					trace.slots[s].type = t.type;
+					slot_types[s] = t.type;
+					types.push_back(t.type);
+				} else if(slot_types[s] != ANY_TYPE){
+					t.op = T_LOAD_SLOT;
+					types.push_back(slot_types[s]);
+				} else{
+					t.op = T_LOAD_SLOT_G;
+					slot_types[s] = t.type;
+					types.push_back(t.type);
+				}
+				seen[s] = true;
+				}
+				break;
+			case JMP_CND:
+				pop_type(types);
+				if(next == ip + 1){
+					// fell through, exit if the jump would be taken
+					t.op = T_GUARD_FALSE;
+					t.ip = ip + i.i;
+				} else{
+					t.op = T_GUARD_TRUE;
+					t.ip = ip + 1;
+				}
+				break;
+			case ADD: case MIN: case MUL: case DIV: case MOD:
+			case EQ: case LT: case LTE: case GT: case GTE:
+				{
+				int b = pop_type(types);
+				int a = pop_type(types);
+				int result = ANY_TYPE;
+				enum TraceOpCode op;
+				if(specialise_arith(i.op, a, b, &op, &result)){
+					t.op = op;
+				} else{
+					result = i.op == EQ ? INT : ANY_TYPE;
+				}
+				types.push_back(result);
+				}
+				break;
+			case ADD_II: case MIN_II: case MUL_II: case DIV_II: case MOD_II:
+			case LT_II: case LTE_II: case GT_II: case GTE_II:
+				{
+				// already proven to be ints by the compiler
+				static const enum TraceOpCode typed[] = {
+					T_ADD_II, T_SUB_II, T_MUL_II, T_DIV_II, T_MOD_II,
+					T_LT_II, T_LTE_II, T_GT_II, T_GTE_II
+				};
+				pop_type(types);
+				pop_type(types);
+				t.op = typed[i.op - ADD_II];
+				types.push_back(INT);
+				}
+				break;
+			case ADD_IG: case MIN_IG: case MUL_IG: case DIV_IG: case MOD_IG:
+			case LT_IG: case LTE_IG: case GT_IG: case GTE_IG:
+				{
+				// speculated by the Speculator, the trace has its own
+				// guards so a guard failure runs the generic op instead
+				static const enum OpCode generic[] = {
+					ADD, MIN, MUL, DIV, MOD, LT, LTE, GT, GTE
+				};
+				int b = pop_type(types);
+				int a = pop_type(types);
+				int result = ANY_TYPE;
+				enum TraceOpCode op;
+				t.ins.op = generic[i.op - ADD_IG];
+				if(specialise_arith(t.ins.op, a, b, &op, &result)){
+					t.op = op;
+				} else{
+					result = ANY_TYPE;
+				}
+				types.push_back(result);
+				}
+				break;
+			default:
+				{
+				int pops, pushes;
+				stack_effect(i, &pops, &pushes);
+				for(int n = 0; n < pops; n++) pop_type(types);
+				for(int n = 0; n < pushes; n++) types.push_back(ANY_TYPE);
+				}
+				break;
+		}
+		trace.ops.push_back(t);
+	}
+
+	// the next iteration relies on the entry types, so make sure
+	// the iteration that just ran didn't change them
+	for(int s = 0; s < trace.slots.size(); s++){
+		if(trace.slots[s].type == ANY_TYPE) continue;
+		if(slot_types[s] == trace.slots[s].type) continue;
+
+		TraceOp t;
+		t.op = T_GUARD_SLOT;
+		t.ip = record_header;
+		t.type = trace.slots[s].type;
+		t.slot = s;
+		trace.ops.push_back(t);
+	}
+
+	traces[record_header] = trace;
+	if(log != nullptr) *log << "jit: compiled trace for loop at " << record_header
+		<< " (" << trace.ops.size() << " ops, "
+		<< trace.slots.size() << " slots)" << std::endl;
+	return true;
+}
+
+/*
+ * Running
+ */
+
+#define INT_OP(OP) \
+	{ \
+	ObjPtr a = ctxt->pop(); \
+	ObjPtr b = ctxt->pop(); \
+	ctxt->push(ObjPtr((int32_t)(b.as_i() OP a.as_i()))); \
+	} \
+	break;
+
+#define FLOAT_OP(OP) \
+	{ \
+	ObjPtr a = ctxt->pop(); \
+	ObjPtr b = ctxt->pop(); \
+	ctxt->push(ObjPtr(b.as_f() OP a.as_f())); \
+	} \
+	break;
+
+#define FLOAT_CMP(OP) \
+	{ \
+	ObjPtr a = ctxt->pop(); \
+	ObjPtr b = ctxt->pop(); \
+	ctxt->push(ObjPtr((int32_t)(b.as_f() OP a.as_f()))); \
+	} \
+	break;
+
+bool TraceJit::osr_enter(Context *ctxt, Trace &trace, OsrFrame &frame){
+	frame.slots.resize(trace.slots.size());
+	for(int s = 0; s < trace.slots.size(); s++){
+		TraceSlot &slot = trace.slots[s];
+		ObjPtr o = slot.cell ? *slot.cell : ctxt->get(slot.index);
+		if(slot.type != ANY_TYPE && o.type != slot.type) return false;
+		frame.slots[s] = o;
+	}
+	return true;
+}
+
+void TraceJit::deoptimise(Context *ctxt, Trace &trace, OsrFrame &frame){
+	for(int s = 0; s < trace.slots.size(); s++){
+		TraceSlot &slot = trace.slots[s];
+		if(slot.cell) *slot.cell = frame.slots[s];
+		else ctxt->put(frame.slots[s], slot.index);
+	}
+}
+
+/*
+ * Runs the trace until a guard fails, returns the
+ * ip the interpreter should resume at.
+ */
+int TraceJit::run_trace(Context *ctxt, Trace &trace, OsrFrame &frame){
+	std::vector<ObjPtr> &slots = frame.slots;
+	for(;;){
+		for(TraceOp &t : trace.ops){
+			switch(t.op){
+				case T_GENERIC:
+					{
+					int ip = t.ip;
+					step_instruction(ctxt, t.ins, &ip, globals);
+					}
+					break;
+				case T_LOAD_IMM_I:
+					ctxt->push(ObjPtr(t.i));
+					break;
+				case T_LOAD_IMM_F:
+					ctxt->push(ObjPtr(t.f));
+					break;
+				case T_LOAD_SLOT:
+					ctxt->push(slots[t.slot]);
+					break;
+				case T_LOAD_SLOT_G:
+					if(slots[t.slot].type != t.type) return t.ip;
+					ctxt->push(slots[t.slot]);
+					break;
+				case T_SET_SLOT:
+					slots[t.slot] = ctxt->pop();
+					break;
+				case T_GUARD_SLOT:
+					if(slots[t.slot].type != t.type) return t.ip;
+					break;
+
+				case T_ADD_II: INT_OP(+)
+				case T_SUB_II: INT_OP(-)
+				case T_MUL_II: INT_OP(*)
+				case T_DIV_II: INT_OP(/)
+				case T_MOD_II: INT_OP(%)
+				case T_EQ_II: INT_OP(==)
+				case T_LT_II: INT_OP(<)
+				case T_LTE_II: INT_OP(<=)
+				case T_GT_II: INT_OP(>)
+				case T_GTE_II: INT_OP(>=)
+
+				case T_ADD_FF: FLOAT_OP(+)
+				case T_SUB_FF: FLOAT_OP(-)
+				case T_MUL_FF: FLOAT_OP(*)
+				case T_DIV_FF: FLOAT_OP(/)
+				case T_LT_FF: FLOAT_CMP(<)
+				case T_LTE_FF: FLOAT_CMP(<=)
+				case T_GT_FF: FLOAT_CMP(>)
+				case T_GTE_FF: FLOAT_CMP(>=)
+
+				case T_GUARD_TRUE:
+					if(ctxt->pop().as_i() != 1) return t.ip;
+					break;
+				case T_GUARD_FALSE:
+					if(ctxt->pop().as_i() == 1) return t.ip;
+					break;
+			}
+		}
+	}
+}
+
+int TraceJit::back_edge(Context *ctxt, int ip){
+	int header = ip + program[ip].i;
+	if(!enabled) return header;
+
+	// specialised functions are appended to the program as it runs
+	if(hotness.size() < program.size()){
+		hotness.resize(program.size(), 0);
+		attempts.resize(program.size(), 0);
+	}
+
+	if(recording && ip == record_end){
+		recording = false;
+		if(!compile_trace()) attempts[record_header]++;
+	}
+
+	auto found = traces.find(header);
+	if(found != traces.end()){
+		Trace &trace = found->second;
+		OsrFrame frame;
+		if(osr_enter(ctxt, trace, frame)){
+			int exit = run_trace(ctxt, trace, frame);
+			deoptimise(ctxt, trace, frame);
+			return exit;
+		}
+		// the loop's types have changed since it was recorded
+		if(++trace.entry_failures < MAX_ENTRY_FAILURES) return header;
+		traces.erase(found);
+		hotness[header] = 0;
+		attempts[header]++;
+	}
+
+	if(!recording && attempts[header] < MAX_RECORD_ATTEMPTS &&
+		++hotness[header] > HOT_LOOP_THRESHOLD){
+		start_recording(header, ip);
+	}
+	return header;
+}
@@ -0,0 +1,111 @@
+#include "lazy.hpp"
+#include "ir.hpp"
+#include "parallel.hpp"
+
+#include <memory>
+
+void LazyCompiler::save(CompilationState &state){
+	functions = state.all_functions();
+	reassigned = state.reassigned;
+	if(bodies.empty()) arena.reset();
+}
+
+std::vector<int> LazyCompiler::build(int n){
+	if(bodies[n].compiled) return {};
+	bodies[n].compiled = true;
+	compiled++;
+	// compiling the body can add more bodies
+	LazyBody b = bodies[n];
+
+	int first = code.size();
+	CompilationState state(labels, code);
+	state.lazy = &bodies;
+	state.inline_limit = inline_limit;
+	state.reassigned = reassigned;
+	state.set_functions(functions);
+	code[b.code].code.clear();
+	state.emit_body(b.code, b.body, b.context, b.frame_size, b.locals);
+
+	std::vector<int> made = { b.code };
+	for(int k = first; k < code.size(); k++) made.push_back(k);
+	if(use_ir){
+		for(int k : made) optimise(code[k], labels);
+	}
+	if(compiled == bodies.size()) arena.reset();
+	return made;
+}
+
+int LazyCompiler::compile(ProgramView &program, int ip){
+	std::vector<CodeObject> batch;
+	for(int k : build(program[ip].i)) batch.push_back(code[k]);
+
+	std::vector<Instruction> is = link_code(batch, labels, program.size());
+	for(auto &i : is) program.push_back(i);
+	program.add_functions(batch);
+
+	// the stub's label is only reached by calls
+	int start = batch[0].start;
+	program.set(ip - 1, jmp(start - (ip - 1)));
+	return start;
+}
+
+std::vector<int> LazyCompiler::compile_all(void){
+	std::vector<int> pending;
+	for(int n = 0; n < bodies.size(); n++){
+		if(!bodies[n].compiled) pending.push_back(n);
+	}
+
+	// where each body's code objects are in its thread's output
+	typedef struct Compiled{ int worker, first, count; } Compiled;
+	std::vector<Compiled> out(pending.size());
+	std::vector<std::vector<CodeObject>> local(threads);
+	std::vector<std::unique_ptr<CompilationState>> states(threads);
+
+	parallel_for(pending.size(), threads, [&](int k, int worker){
+		auto &state = states[worker];
+		if(state == nullptr){
+			state.reset(new CompilationState(labels, local[worker]));
+			state->inline_limit = inline_limit;
+			state->reassigned = reassigned;
+			state->set_functions(functions);
+		}
+		LazyBody &b = bodies[pending[k]];
+		std::vector<CodeObject> &objects = local[worker];
+		int first = objects.size();
+		objects.push_back(code[b.code]);
+		objects.back().code.clear();
+		ScopeInfo context = b.context;
+		state->emit_body(first, b.body, context, b.frame_size, b.locals);
+		out[k] = { worker, first, (int)objects.size() - first };
+	});
+
+	std::vector<int> made;
+	for(int k = 0; k < pending.size(); k++){
+		LazyBody &b = bodies[pending[k]];
+		Compiled &c = out[k];
+		std::vector<CodeObject> &objects = local[c.worker];
+		code[b.code] = std::move(objects[c.first]);
+		made.push_back(b.code);
+		for(int o = c.first + 1; o < c.first + c.count; o++){
+			made.push_back(code.size());
+			code.push_back(std::move(objects[o]));
+		}
+		b.compiled = true;
+		compiled++;
+	}
+	if(compiled == bodies.size()) arena.reset();
+	return made;
+}
+
+void LazyCompiler::optimise_all(const std::vector<int> &which){
+	if(!use_ir) return;
+	parallel_for(which.size(), threads, [&](int k, int worker){
+		optimise(code[which[k]], labels);
+	});
+}
+
+Program *LazyCompiler::finish(void){
+	optimise_all(compile_all());
+	std::vector<Instruction> is = link_code(code, labels);
+	return new Program(is, code);
+}
@@ -2,10 +2,11 @@
 
 #include <iostream>
 
-Object Object::object_list = Object();
+Heap Heap::shared;
+thread_local Heap *Heap::current = &Heap::shared;
 
 Object::Object(){
-	Object::object_list.insert_after(this);
+	Heap::current->insert(this);
 }
 
 
@@ -39,10 +40,10 @@ void gc_sweep_map(std::map<std::string, ObjPtr> &map){
 	}
 }
 
-void Object::gc_delete(void){
+void Heap::gc_delete(std::ostream &out){
 	int freed = 0;
 	int active = 0;
-	Object *o = Object::object_list.next;
+	Object *o = objects;
 
 	while(o != nullptr){
 		Object *next = o->next;
@@ -50,14 +51,42 @@ void Object::gc_delete(void){
 			o->active = false;
 			active++;
 		} else{
-			o->remove();
+			remove(o);
 			delete o;
 			freed++;
 		}
 		o = next;
 	}
 
-	std::cout << "gc_delete: freed " << freed << ", active " << active << std::endl;
+	out << "gc_delete: freed " << freed << ", active " << active << std::endl;
+}
+
+Heap::~Heap(){
+	while(objects != nullptr){
+		Object *o = objects;
+		remove(o);
+		delete o;
+	}
+}
+
+void Heap::adopt(Heap &other){
+	if(other.objects == nullptr) return;
+	Object *last = other.objects;
+	while(last->next != nullptr){
+		last->heap = this;
+		last = last->next;
+	}
+	last->heap = this;
+	last->next = objects;
+	if(objects != nullptr) objects->prev = last;
+	objects = other.objects;
+	other.objects = nullptr;
+}
+
+Heap *Heap::set(Heap *heap){
+	Heap *old = current;
+	current = heap;
+	return old;
 }
 
 //////////////////////////////////////////////////
@@ -66,23 +95,21 @@ void Object::gc_delete(void){
  * list operations
  */
 
-void Object::insert_after(Object *o){
-	Object *tmp = this->next;
-	this->next = o;
-	o->prev = this;
-	o->next = tmp;
-	if(tmp != nullptr) tmp->prev = o;
+void Heap::insert(Object *o){
+	o->heap = this;
+	o->prev = nullptr;
+	o->next = objects;
+	if(objects != nullptr) objects->prev = o;
+	objects = o;
 }
 
-void Object::remove(void){
-	Object *tmp = this->prev;
-	if(this->next != nullptr){
-		this->next->prev = tmp;
-	}
-	tmp->next = this->next;
+void Heap::remove(Object *o){
+	if(o->prev != nullptr) o->prev->next = o->next;
+	else objects = o->next;
+	if(o->next != nullptr) o->next->prev = o->prev;
 
-	this->prev = nullptr;
-	this->next = nullptr;
+	o->prev = nullptr;
+	o->next = nullptr;
 }
 
 //////////////////////////////////////////////////
@@ -162,8 +189,8 @@ void Closure::mark(void){
 	}
 }
 
-std::ostream& Closure::show(std::ostream&) const{
-	std::cout << "CLOSURE " << func_ptr;
+std::ostream& Closure::show(std::ostream& os) const{
+	return os << "CLOSURE " << func_ptr;
 }
 
 int Closure::get_func(void){
@@ -182,21 +209,65 @@ void Closure::push_var(ObjPtr o){
 	env.push_back(o);
 }
 
+/////////////////////////////////////////////////////
+// Iterators
+/////////////////////////////////////////////////////
+
+Iterator::Iterator(ObjPtr over){
+	if(over.type == ARRAY){
+		source = over;
+	} else if(Dictionary *dict = over.as_dict()){
+		ArrayList *keys = new ArrayList();
+		keys->reserve(dict->size());
+		for(auto &p : *dict) keys->push_back(ObjPtr(new StringObject(std::string(p.first))));
+		source = ObjPtr(keys);
+	}
+}
+
+bool Iterator::next(void){
+	ArrayList *arr = source.as_arr();
+	if(arr == nullptr || index >= arr->size()){
+		value = ObjPtr();
+		return false;
+	}
+	value = (*arr)[index++];
+	return true;
+}
+
+void Iterator::mark(void){
+	if(active) return;
+	active = true;
+	if(Object *obj = source.as_o()) obj->mark();
+	if(Object *obj = value.as_o()) obj->mark();
+}
+
+std::ostream& Iterator::show(std::ostream& os) const{
+	return os << "ITERATOR";
+}
+
 // StringObject implementations
 StringObject::StringObject(std::string&& str){
+	this->str = std::make_shared<const std::string>(std::move(str));
+}
+
+StringObject::StringObject(std::shared_ptr<const std::string> str){
 	this->str = str;
 }
 
+StringObject* StringObject::share(void){
+	return new StringObject(str);
+}
+
 void StringObject::mark(void){
 	active = true;
 }
 
 std::ostream& StringObject::show(std::ostream& os) const{
-	return os << this->str;
+	return os << *this->str;
 }
 
 StringObject* StringObject::add(StringObject* object){
-	return new StringObject(this->str + object->str);
+	return new StringObject(*this->str + *object->str);
 }
 
 /*
@@ -219,6 +290,7 @@ std::ostream& ObjPtr::show(std::ostream& os) {
 			}
 		}
 	}
+	return os;
 }
 
 ObjPtr::object_ptr(void){
@@ -256,6 +328,16 @@ ObjPtr::object_ptr(StringObject *c){
 	this->data = (int64_t)c >> 4;
 }
 
+ObjPtr::object_ptr(Iterator *c){
+	this->type = ITERATOR;
+	this->data = (int64_t)c >> 4;
+}
+
+ObjPtr::object_ptr(Generator *c){
+	this->type = GENERATOR;
+	this->data = (int64_t)c >> 4;
+}
+
 int32_t ObjPtr::as_i(void){
 	if(this->type == INT) return (int32_t)this->data;
 	return 0;
@@ -268,7 +350,8 @@ float ObjPtr::as_f(void){
 
 Object *ObjPtr::as_o(void){
 	void* ptr = (void*)(data << 4);
-	if(type == DICT || type == CLOSURE || type == ARRAY || type == STRING)
+	if(type == DICT || type == CLOSURE || type == ARRAY || type == STRING ||
+		type == ITERATOR || type == GENERATOR)
 		return (Object*)ptr;
 	return nullptr;
 }
@@ -289,10 +372,30 @@ StringObject* ObjPtr::as_string(void){
 	if(this->type == STRING) return (StringObject*)(data << 4);
 	return nullptr;
 }
+Iterator* ObjPtr::as_iter(void){
+	// a Generator's Iterator is at the start of it
+	if(this->type == ITERATOR || this->type == GENERATOR) return (Iterator*)(data << 4);
+	return nullptr;
+}
+Generator* ObjPtr::as_gen(void){
+	if(this->type == GENERATOR) return (Generator*)(data << 4);
+	return nullptr;
+}
 
 /*
  * Arithmetic etc
  */
+bool can_change(Object *o, const char *op){
+	if(o == nullptr || o->local()) return true;
+	// once for each thread, a worker would otherwise say it for each element
+	static thread_local bool said = false;
+	if(!said){
+		said = true;
+		std::cerr << std::string(op) + ": can't change an object another thread is sharing\n";
+	}
+	return false;
+}
+
 ObjPtr add(ObjPtr a, ObjPtr b){
 	ArrayList *arr = nullptr;
 	if(a.type == INT && b.type == INT) 
@@ -300,10 +403,12 @@ ObjPtr add(ObjPtr a, ObjPtr b){
 	if(a.type == FLOAT && b.type == FLOAT) 
 		return  ObjPtr(a.as_f() + b.as_f());
 	if(arr = a.as_arr()){
+		if(!can_change(arr, "add")) return ObjPtr();
 		arr->push_back(b);
 		return a;
 	}
 	if(arr = b.as_arr()){
+		if(!can_change(arr, "add")) return ObjPtr();
 		arr->insert(arr->begin(), a);
 		return b;
 	}
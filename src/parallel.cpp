@@ -0,0 +1,87 @@
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "parallel.hpp"
+
+void parallel_for(int count, int threads, const std::function<void(int, int)> &body){
+	if(threads > count) threads = count;
+	if(threads <= 1){
+		for(int n = 0; n < count; n++) body(n, 0);
+		return;
+	}
+
+	std::atomic<int> next(0);
+	auto work = [&](int worker){
+		for(int n = next++; n < count; n = next++) body(n, worker);
+	};
+	std::vector<std::thread> pool;
+	for(int w = 1; w < threads; w++) pool.emplace_back(work, w);
+	work(0);
+	for(auto &t : pool) t.join();
+}
+
+typedef struct Range{
+	std::mutex lock;
+	int lo = 0, hi = 0;	// what the owner hasn't taken yet
+} Range;
+
+void parallel_ranges(int count, int threads, int grain,
+					 const std::function<void(int, int, int)> &body){
+	if(grain < 1) grain = 1;
+	int chunks = (count + grain - 1) / grain;
+	if(threads > chunks) threads = chunks;
+	if(threads <= 1){
+		if(count > 0) body(0, count, 0);
+		return;
+	}
+
+	std::vector<Range> ranges(threads);
+	for(int w = 0; w < threads; w++){
+		ranges[w].lo = (long)count * w / threads;
+		ranges[w].hi = (long)count * (w + 1) / threads;
+	}
+
+	// the thief only holds one lock at a time, so two can't deadlock
+	auto steal = [&](int worker){
+		for(int k = 1; k < threads; k++){
+			Range &victim = ranges[(worker + k) % threads];
+			int lo, hi;
+			{
+				std::lock_guard<std::mutex> guard(victim.lock);
+				int left = victim.hi - victim.lo;
+				if(left <= grain) continue;
+				lo = victim.hi - left / 2;
+				hi = victim.hi;
+				victim.hi = lo;
+			}
+			Range &own = ranges[worker];
+			std::lock_guard<std::mutex> guard(own.lock);
+			own.lo = lo;
+			own.hi = hi;
+			return true;
+		}
+		return false;
+	};
+
+	auto work = [&](int worker){
+		Range &own = ranges[worker];
+		for(;;){
+			int lo, hi;
+			{
+				std::lock_guard<std::mutex> guard(own.lock);
+				lo = own.lo;
+				hi = std::min(own.hi, lo + grain);
+				own.lo = hi;
+			}
+			if(lo < hi) body(lo, hi, worker);
+			else if(!steal(worker)) return;
+		}
+	};
+	std::vector<std::thread> pool;
+	for(int w = 1; w < threads; w++) pool.emplace_back(work, w);
+	work(0);
+	for(auto &t : pool) t.join();
+}
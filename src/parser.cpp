@@ -5,860 +5,1282 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <map>
 
 #include "ast.hpp"
-
-#define MAKE_EXPR(EXP) std::shared_ptr<Expression>(EXP)
-#define MAKE_STMT(STMT) std::shared_ptr<Statement>(STMT)
-#define MAKE_ACCESS(EXP) std::shared_ptr<AccessorExp>(EXP)
+#include "arena.hpp"
+#include "tokenizer.hpp"
+#include "jit.hpp"
+#include "speculate.hpp"
+#include "bytecode.hpp"
+#include "cache.hpp"
+#include "ir.hpp"
+#include "lazy.hpp"
+#include "isolate.hpp"
+#include "actor.hpp"
+#include "parallel.hpp"
+#include "fiber.hpp"
+#include "io.hpp"
+#include "generator.hpp"
+
+#define MAKE(TYPE, ...) p->arena->make<TYPE>(__VA_ARGS__)
+/*
+ * A position in the token stream, cheap to copy so
+ * parsers can try an alternative and throw it away.
+ */
 class ParseInfo{
 	public:
+	const TokenStream *stream;
 	int index;
-	std::string input;
+	Arena *arena;	// where the tree is built
+	std::set<std::string> *assigned = nullptr;	// names given to with =
+	bool concurrent = false;	// whether spawn() or a parallel builtin is used
+	int functions = 0;	// bodies being parsed, yield is only allowed in one
 
-	ParseInfo(std::string i){
+	ParseInfo(const TokenStream &s, Arena &a){
+		stream = &s;
 		index = 0;
-		input = i;
+		arena = &a;
 	}
 
-	int skip_whitespace(void){
-		int i = index;
-		while(i< input.size() && isspace(input[i])){
-			i++;
-		}
-		return i;
+	const Token &current(void){
+		return stream->tokens[index];
 	}
 
-	bool peek(std::string matching){
-		
-		int i = skip_whitespace();
+	const Token &ahead(int n){
+		int i = index + n;
+		if(i >= stream->tokens.size()) i = stream->tokens.size() - 1;
+		return stream->tokens[i];
+	}
 
-		for(char c : matching){
-			if(i >= input.size()) return false;
-			if(c != input[i]) return false;
+	bool at(char c, int n = 0){
+		const Token &t = ahead(n);
+		return t.type == TOK_PUNCT && t.value == c;
+	}
 
-			i++;
-		}
-		return true;
+	bool at_word(const char *word, int n = 0){
+		const Token &t = ahead(n);
+		return t.type == TOK_WORD && stream->names[t.value] == word;
 	}
-	bool match(std::string matching){
-		
-		int i = skip_whitespace();
-		//printf("%d, %d\n", index, i);
 
-		for(char c : matching){
-			if(i >= input.size()) return false;
-			if(c != input[i]) return false;
+	// an = that isn't the start of ==
+	bool at_assign(int n){
+		return at('=', n) && !(at('=', n + 1) && stream->adjacent(index + n, index + n + 1));
+	}
 
+	/*
+	 * Returns the token after matching, or -1. A string can span
+	 * several tokens (e.g. "<=") as long as they are adjacent.
+	 */
+	int matches(const std::string &matching){
+		const std::string &source = stream->source;
+		int i = index;
+		int pos = 0;
+		while(pos < matching.size()){
+			const Token &t = stream->tokens[i];
+			if(t.type == TOK_END) return -1;
+			if(pos > 0 && !stream->adjacent(i - 1, i)) return -1;
+			int length = t.end - t.start;
+			if(length > matching.size() - pos) return -1;
+			if(source.compare(t.start, length, matching, pos, length) != 0) return -1;
+			pos += length;
 			i++;
 		}
+		return i;
+	}
+
+	bool peek(const std::string &matching){
+		return matches(matching) >= 0;
+	}
+
+	bool match(const std::string &matching){
+		int i = matches(matching);
+		if(i < 0) return false;
 		index = i;
 		return true;
 	}
 
-	bool character(char *out){
-		int i = index;
-		if( i >= input.size())
-			return false;
-		if(input[i] == '\'')
-			return false;
-		if(input[i] == '"')
-			return false;
-
-		if(input[i] == '\\'){
-			i++;
-			if( i >= input.size())
-				return false;
-			switch(input[i]){
-				case '0':
-					*out = '\0';
-					break;
-				case 't':
-					*out = '\t';
-					break;
-				case 'n':
-					*out = '\n';
-					break;
-				case '\'':
-					*out = '\'';
-					break;
-				case '"':
-					*out = '"';
-					break;
-				case '\\':
-					*out = '\\';
-					break;
-				default:
-					return false;
-			}
-			index = i+1;
-			return true;
-		}
-
+	bool char_literal(char *out){
+		if(current().type != TOK_CHAR) return false;
+		*out = current().value;
 		index++;
-		*out = input[i];
 		return true;
 	}
 
-	bool string(std::string *str){
-		int i = skip_whitespace();
-
-		if( i < input.size() && input[i] == '"'){
-			i++;
-			int start = i;
-			while(i < input.size()){
-				if(input[i] == '"'){
-						*str = input.substr(start, i-start);
-						index = i+1;
-						return true;
-				}
-				i++;
-			}
-		}
-		return false;
-		
+	bool string_literal(const std::string **out){
+		if(current().type != TOK_STRING) return false;
+		*out = &stream->strings[current().value];
+		index++;
+		return true;
 	}
 
 	bool integer(int *out){
-		*out = 0;
-		bool found = false;
-		int i = skip_whitespace();
-
-		while(i< input.size() && isdigit(input[i])){
-			*out *= 10;
-			*out += input[i] - 48;
-			found = true;
-			i++;
-		}
-		
-		if(found) index = i;
-		return found;
+		if(current().type != TOK_INT) return false;
+		*out = current().value;
+		index++;
+		return true;
 	}
 
 	bool identifier(std::string *out){
-		bool found = false;
-
-		int i = skip_whitespace();
-		int start = i;
-
-		while(i< input.size() && isalpha(input[i])){
-			found = true;
-			i++;
-		}
-		
-		if(found) {
-			index = i;
-			*out = input.substr(start, index-start);
-		}
-		return found;
+		if(current().type != TOK_WORD) return false;
+		*out = stream->names[current().value];
+		index++;
+		return true;
 	}
 
+	/*
+	 * Adjacent tokens up to whitespace or a bracket, for paths and
+	 * symbol names.
+	 */
 	bool non_whitespace(std::string *out){
-		bool found = false;
-
-		int i = skip_whitespace();
-		int start = i;
-
-		while(i< input.size() && 
-				!isspace(input[i]) &&
-				// There has to be a better way
-				// to do this.
-				input[i] != '(' && 
-				input[i] != ')' && 
-				input[i] != '[' && 
-				input[i] != ']'
-				){
-			found = true;
+		int i = index;
+		while(stream->tokens[i].type != TOK_END &&
+				(i == index || stream->adjacent(i - 1, i))){
+			const Token &t = stream->tokens[i];
+			if(t.type == TOK_PUNCT &&
+				(t.value == '(' || t.value == ')' || t.value == '[' || t.value == ']')){
+				break;
+			}
 			i++;
 		}
-		
-		if(found) {
-			index = i;
-			*out = input.substr(start, index-start);
-		}
-		return found;
-	}
-
-	
-};
-
-bool parse_commasep_expr(ParseInfo *p, std::vector<ExprPtr > *exps);
-
-std::string op_str[] = 
-	{ "==", "<=", "<", ">=", ">", "+", "-", "*", "/", "%"};
-enum BinOp op_enum[] = 
-	{EQ_OP, LTE_OP, LT_OP, GTE_OP, GT_OP, ADD_OP, MIN_OP, 
-	MUL_OP, DIV_OP, MOD_OP};
-bool parse_binop(ParseInfo *p, enum BinOp *b){
+		if(i == index) return false;
 
-	for(int i = 0; i < sizeof(op_str) / sizeof(op_str[1]); i++){
-		if( p->match(op_str[i]) ){
-			*b = op_enum[i];
-			return true;
-		}
-	}
-	return false;
-}
-
-ExprPtr  parse_expr0(ParseInfo *p);
-ExprPtr  parse_expr1(ParseInfo *p);
-ExprPtr  parse_expr2(ParseInfo *p);
-
-ExprPtr  parse_Expression(ParseInfo *p);
-
-ExprPtr  parse_ArithExpr(ParseInfo *p){
-	ParseInfo working = *p;
-	enum BinOp op;
-	ExprPtr exp1 = nullptr;
-	ExprPtr exp2 = nullptr;
-
-	if((exp1 = parse_expr1(&working)) &&
-	   parse_binop(&working, &op) &&
-	  (exp2 = parse_Expression(&working))
-	){
-
-		*p = working;
-		return MAKE_EXPR(new BinExp(op, exp1, exp2));
+		int start = stream->tokens[index].start;
+		*out = stream->source.substr(start, stream->tokens[i - 1].end - start);
+		index = i;
+		return true;
 	}
+};
 
-	return nullptr;
-}
-
-ExprPtr  parse_parens(ParseInfo *p){
-	ParseInfo working = *p;
-	ExprPtr exp1 = nullptr;
-
-
-	if(working.match("(") &&
-	   (exp1 = parse_Expression(&working)) &&
-	   working.match(")")
-	){
+/*
+ * A predictive parser: every production is picked from the next token
+ * or two and nothing is ever parsed twice. Binary expressions are
+ * parsed by a Pratt loop over the binding powers in op_power.
+ *
+ * Words that start statements (fun, if, while, for, return, break,
+ * continue, let, yield) are keywords there unless they are being
+ * assigned to. yield() on its own is the fiber builtin.
+ */
 
-		*p = working;
-		return exp1;
-	}
+ExprPtr parse_Expression(ParseInfo *p);
+ExprPtr parse_expr0(ParseInfo *p);
+BlockStmt *parse_block(ParseInfo *p);
+StmtPtr parse_statement(ParseInfo *p);
 
-	return nullptr;
+bool parse_commasep_expr(ParseInfo *p, char close, std::vector<ExprPtr > *exps){
+	if(p->at(close)) return true;
+	do{
+		ExprPtr exp = parse_Expression(p);
+		if(exp == nullptr) return false;
+		exps->push_back(exp);
+	} while(p->match(","));
+	return true;
 }
 
-AccessPtr parse_field_accessor(ParseInfo *p){
-	ParseInfo working = *p;
+bool parse_commasep_ident(ParseInfo *p, std::vector<std::string> *ids){
 	std::string id;
-	if( working.match(".") &&
-		working.identifier(&id)
-	  ){
-		*p = working;
-		return MAKE_ACCESS(new FieldAccessor(id));
-	}
-	return nullptr;
-}
+	if(!p->identifier(&id)) return true;
+	ids->push_back(id);
 
-AccessPtr parse_array_accessor(ParseInfo *p){
-	ParseInfo working = *p;
-	ExprPtr  exp = nullptr;
-	if( working.match("[") &&
-		(exp = parse_Expression(&working)) && 
-		working.match("]") 
-	  ){
-		*p = working;
-		return MAKE_ACCESS(new ArrayAccessor(exp));
+	while(p->match(",")){
+		if(!p->identifier(&id)) return false;
+		ids->push_back(id);
 	}
-	return nullptr;
+	return true;
 }
 
-AccessPtr parse_closure_call(ParseInfo *p){
-	ParseInfo working = *p;
-	ExprPtr clos = nullptr;
-	std::vector<ExprPtr> args;
+std::string op_str[] = 
+	{ "==", "<=", "<", ">=", ">", "+", "-", "*", "/", "%"};
+enum BinOp op_enum[] = 
+	{EQ_OP, LTE_OP, LT_OP, GTE_OP, GT_OP, ADD_OP, MIN_OP, 
+	MUL_OP, DIV_OP, MOD_OP};
+/*
+ * Operators have always grouped to the right without
+ * precedence (a * b + c is a * (b + c)), so they share a level.
+ */
+int op_power[] = 
+	{ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1};
 
-	if( working.match("(") &&
-		parse_commasep_expr(&working, &args) &&
-	  	working.match(")")
-	){
-		*p = working;
-		return MAKE_ACCESS(new ClosureCallExp(nullptr, args));
+/*
+ * Finds the operator at the current token without consuming
+ * it, returns its index and sets next to the token after it.
+ */
+int peek_binop(ParseInfo *p, int *next){
+	if(p->current().type != TOK_PUNCT) return -1;
+	for(int i = 0; i < sizeof(op_str) / sizeof(op_str[1]); i++){
+		if((*next = p->matches(op_str[i])) >= 0) return i;
 	}
-
-	return nullptr;
+	return -1;
 }
 
-AccessPtr  parse_accessor(ParseInfo *p){
-	AccessPtr out = nullptr;
-	if((out = parse_field_accessor(p)) ||
-		(out = parse_closure_call(p)) ||
-		(out = parse_array_accessor(p)) ){
-			return out;
+/*
+ * Applies any .field, (args) and [index] accessors to exp,
+ * last is set to the outermost one.
+ */
+ExprPtr parse_accessors(ParseInfo *p, ExprPtr exp, AccessPtr *last){
+	for(;;){
+		AccessPtr acc = nullptr;
+		if(p->match(".")){
+			std::string id;
+			if(!p->identifier(&id)) return nullptr;
+			acc = MAKE(FieldAccessor, id);
+		} else if(p->match("(")){
+			std::vector<ExprPtr> args;
+			if(!parse_commasep_expr(p, ')', &args) || !p->match(")")) return nullptr;
+			acc = MAKE(ClosureCallExp, nullptr, std::move(args));
+		} else if(p->match("[")){
+			ExprPtr index = parse_Expression(p);
+			if(index == nullptr || !p->match("]")) return nullptr;
+			acc = MAKE(ArrayAccessor, index);
+		} else{
+			return exp;
 		}
-	return nullptr;
-}
-
-bool parse_accessors(ParseInfo *p, std::vector<AccessPtr > *accs){
-	ParseInfo working = *p;
-	AccessPtr  acc = nullptr;
-	if(!(acc = parse_accessor(&working)) ) return false;
-	
-	accs->push_back(acc);
-
-	while((acc = parse_accessor(&working)) ){
-		accs->push_back(acc);
+		acc->set_sub_expr(exp);
+		exp = acc;
+		if(last) *last = acc;
 	}
-
-	*p = working;
-	return true;
 }
 
-//can't really fail
-bool parse_commasep_expr(ParseInfo *p, std::vector<ExprPtr > *exps){
-	ParseInfo working = *p;
-	ExprPtr exp = nullptr;
-	
-	if(!(exp = parse_Expression(&working))) return true;
-	exps->push_back(exp);
-
-	*p = working;
+ExprPtr parse_expr1(ParseInfo *p){
+	ExprPtr exp = parse_expr0(p);
+	if(exp == nullptr) return nullptr;
+	return parse_accessors(p, exp, nullptr);
+}
 
-	while(working.match(",") &&
-	      (exp = parse_Expression(&working))
-		 ){
-		exps->push_back(exp);
-		*p = working;
+/*
+ * The Pratt loop, left is the operand that has already been parsed.
+ */
+ExprPtr parse_binary(ParseInfo *p, ExprPtr left, int min_power){
+	int next;
+	int op;
+	while(left != nullptr && (op = peek_binop(p, &next)) >= 0 &&
+		op_power[op] >= min_power){
+		p->index = next;
+		// right associative, so the right operand takes
+		// any operators of the same power
+		ExprPtr right = parse_binary(p, parse_expr1(p), op_power[op]);
+		if(right == nullptr) return nullptr;
+		left = MAKE(BinExp, op_enum[op], left, right);
 	}
-	return true;
+	return left;
 }
 
-//can't really fail
-bool parse_commasep_ident(ParseInfo *p, std::vector<std::string> *ids){
-	ParseInfo working = *p;
-	std::string id;
-	
-	//if can't find any return early
-	if(!working.identifier(&id)) return true;
-	ids->push_back(id);
-
-	*p = working;
+ExprPtr parse_Expression(ParseInfo *p){
+	return parse_binary(p, parse_expr1(p), 0);
+}
 
-	while(working.match(",") &&
-	      working.identifier(&id)
-		 ){
-		ids->push_back(id);
-		*p = working;
-	}
-	return true;
+ExprPtr parse_parens(ParseInfo *p){
+	if(!p->match("(")) return nullptr;
+	ExprPtr exp = parse_Expression(p);
+	if(exp == nullptr || !p->match(")")) return nullptr;
+	return exp;
 }
 
-ExprPtr  parse_ffi_call(ParseInfo *p){
-	ParseInfo working = *p;
+ExprPtr parse_ffi_call(ParseInfo *p){
 	std::string name;
 	std::vector<ExprPtr > args;
 
-	if( working.match("foreign") &&
-		working.non_whitespace(&name)&&
-	  	working.match("(") &&
-		parse_commasep_expr(&working, &args) &&
-	  	working.match(")")
+	if( p->match("foreign") &&
+		p->non_whitespace(&name)&&
+	  	p->match("(") &&
+		parse_commasep_expr(p, ')', &args) &&
+	  	p->match(")")
 	){
-		*p = working;
-		return MAKE_EXPR(new FFICallExp(name, args));
+		return MAKE(FFICallExp, name, std::move(args));
 	}
-
-	return nullptr;
-}
-ExprPtr  parse_closcall(ParseInfo *p){
-	ParseInfo working = *p;
-	ExprPtr clos = nullptr;
-	std::vector<ExprPtr> args;
-
-	if( working.match("call") &&
-	  	working.match("[") &&
-		(clos = parse_Expression(&working)) &&
-	  	working.match("]") &&
-	  	working.match("(") &&
-		parse_commasep_expr(&working, &args) &&
-	  	working.match(")")
-	){
-		*p = working;
-		return MAKE_EXPR(new ClosureCallExp(clos, args));
-	}
-
 	return nullptr;
 }
 
-ExprPtr parse_funcall(ParseInfo *p){
-	ParseInfo working = *p;
-	std::string id;
-	std::vector<ExprPtr > args;
+ExprPtr parse_string(ParseInfo *p){
+	const std::string *str;
 
-	if( working.identifier(&id) &&
-	  	working.match("(") &&
-		parse_commasep_expr(&working, &args) &&
-	  	working.match(")")
-	){
-		*p = working;
-		return MAKE_EXPR(new CallExp(id, args));
-	}
+	if(!p->string_literal(&str))
+		return nullptr;
 
-	return nullptr;
+	return MAKE(StringExp, *str);
 }
 
-ExprPtr parse_fieldaccess(ParseInfo *p){
-	ParseInfo working = *p;
-	std::vector<AccessPtr > accs;
-	ExprPtr exp = nullptr;
+ExprPtr parse_vector(ParseInfo *p){
+	std::vector<ExprPtr> elems;
 
-	if((exp = parse_expr0(&working)) && 
-	  parse_accessors(&working, &accs)
+	if(p->match("[") &&
+		parse_commasep_expr(p, ']', &elems) &&
+		p->match("]")
 	){
-		for(auto& acc : accs){
-			//exp = MAKE_EXPR(new GetFieldExp(acc, exp));
-			acc->set_sub_expr(exp);
-			exp = acc;
-		}
-		*p = working;
-		return exp;
+		return MAKE(VectorExp, std::move(elems));
 	}
-
 	return nullptr;
 }
 
-ExprPtr parse_char(ParseInfo *p){
-	char c;
-	ParseInfo working = *p;
+ExprPtr parse_closure(ParseInfo *p){
+	std::vector<std::string> args;
+	BlockStmt *body;
 
-	if(working.match("'") && working.character(&c) && working.match("'")){
-		*p = working;
-		return MAKE_EXPR(new IntExp((int)c));
+	if(!(p->match("closure") &&
+	   p->match("(") && 
+	   parse_commasep_ident(p, &args) &&
+	   p->match(")")
+	  )){
+		return nullptr;
 	}
-	return nullptr;
+	p->functions++;
+	body = parse_block(p);
+	p->functions--;
+	if(body == nullptr) return nullptr;
+	return MAKE(ClosureExp, args, body);
 }
 
-ExprPtr  parse_int(ParseInfo *p){
-	int i;
-	ParseInfo working = *p;
+/*
+ * spawn(f, args...), send(to, value), transfer(to, value) or receive().
+ */
+ExprPtr parse_actor(ParseInfo *p){
+	std::string name;
+	std::vector<ExprPtr> args;
 
-	if(working.integer(&i)){
-		*p = working;
-		return MAKE_EXPR(new IntExp(i));
+	if(!(p->identifier(&name) &&
+		 p->match("(") &&
+		 parse_commasep_expr(p, ')', &args) &&
+		 p->match(")")
+		)){
+		return nullptr;
 	}
-	return nullptr;
+	if(name == "spawn"){
+		if(args.empty()) return nullptr;
+		p->concurrent = true;
+	}
+	if((name == "send" || name == "transfer") && args.size() != 2) return nullptr;
+	if(name == "receive" && !args.empty()) return nullptr;
+	return MAKE(ActorExp, name, std::move(args));
 }
 
-ExprPtr  parse_var(ParseInfo *p){
-	std::string s;
-	ParseInfo working = *p;
-
-	if(working.identifier(&s)){
-		*p = working;
-		return MAKE_EXPR( new VarExp(s) );
-	}
-	return nullptr;
+bool actor_follows(ParseInfo *p){
+	return (p->at_word("spawn") || p->at_word("send") || p->at_word("transfer") ||
+			p->at_word("receive")) &&
+		p->at('(', 1);
 }
 
-ExprPtr  parse_unit(ParseInfo *p){
-	ParseInfo working = *p;
+/*
+ * parallel_map(array, f), parallel_reduce(array, f, initial)
+ * or parallel_for(low, high, f).
+ */
+ExprPtr parse_parallel(ParseInfo *p){
+	std::string name;
+	std::vector<ExprPtr> args;
 
-	if(working.match("null")){
-		*p = working;
-		return MAKE_EXPR(new UnitExp());
+	if(!(p->identifier(&name) &&
+		 p->match("(") &&
+		 parse_commasep_expr(p, ')', &args) &&
+		 p->match(")")
+		)){
+		return nullptr;
 	}
-	return nullptr;
+	if(args.size() != (name == "parallel_map" ? 2 : 3)) return nullptr;
+	p->concurrent = true;
+	return MAKE(ParallelExp, name, std::move(args));
 }
 
-ExprPtr  parse_object(ParseInfo *p){
-	ParseInfo working = *p;
-
-	if(working.match("{}")){
-		*p = working;
-		return MAKE_EXPR( new ObjectExp() );
-	}
-	return nullptr;
+bool parallel_follows(ParseInfo *p){
+	return (p->at_word("parallel_map") || p->at_word("parallel_reduce") ||
+			p->at_word("parallel_for")) && p->at('(', 1);
 }
 
-ExprPtr parse_string(ParseInfo *p){
-	ParseInfo working = *p;
-	std::vector<char> chars;
+// the number of arguments each fiber builtin takes, -1 for one or more
+static const std::map<std::string, int> fiber_builtins = {
+	{"fiber", -1}, {"yield", 0}, {"join", 1},
+	{"channel", 0}, {"chan_send", 2}, {"chan_receive", 1},
+};
 
-	if(!working.match("\""))
-		return nullptr;
-	
-	char c = '\0';
-	while(working.character(&c)){
-		chars.push_back(c);
-	}
+/*
+ * fiber(f, args...), yield(), join(fiber), channel(),
+ * chan_send(channel, value) or chan_receive(channel).
+ */
+ExprPtr parse_fiber(ParseInfo *p){
+	std::string name;
+	std::vector<ExprPtr> args;
 
-	if(!working.match("\""))
+	if(!(p->identifier(&name) &&
+		 p->match("(") &&
+		 parse_commasep_expr(p, ')', &args) &&
+		 p->match(")")
+		)){
 		return nullptr;
-	
-	*p = working;
-
-	return MAKE_EXPR(new StringExp(chars));
+	}
+	int arity = fiber_builtins.at(name);
+	if(arity < 0 ? args.empty() : args.size() != arity) return nullptr;
+	return MAKE(FiberExp, name, std::move(args));
 }
 
-ExprPtr  parse_vector(ParseInfo *p){
-	ParseInfo working = *p;
-	std::vector<ExprPtr> elems;
-
-	if(working.match("[") &&
-		parse_commasep_expr(&working, &elems) &&
-		working.match("]")
-	){
-		*p = working;
-		return std::shared_ptr<Expression>(new VectorExp(elems));
+bool fiber_follows(ParseInfo *p){
+	for(auto &builtin : fiber_builtins){
+		if(p->at_word(builtin.first.c_str()) && p->at('(', 1)) return true;
 	}
-	return nullptr;
+	return false;
 }
 
-std::shared_ptr<BlockStmt> parse_block(ParseInfo *p);
+// the instruction and number of arguments of each I/O builtin
+static const std::map<std::string, std::pair<enum OpCode, int>> io_builtins = {
+	{"io_read", {IO_READ, 1}}, {"io_write", {IO_WRITE, 2}},
+	{"io_listen", {IO_LISTEN, 1}}, {"io_accept", {IO_ACCEPT, 1}},
+	{"io_connect", {IO_CONNECT, 1}}, {"io_send", {IO_SEND, 2}},
+	{"io_recv", {IO_RECV, 1}}, {"io_close", {IO_CLOSE, 1}},
+	{"await", {AWAIT, 1}},
+};
 
-ExprPtr parse_closure(ParseInfo *p){
-	ParseInfo working = *p;
-	std::string id;
-	std::vector<std::string> args;
-	std::shared_ptr<BlockStmt> body;
+ExprPtr parse_io(ParseInfo *p){
+	std::string name;
+	std::vector<ExprPtr> args;
 
-	if(working.match("closure") &&
-	   working.match("(") && 
-	   parse_commasep_ident(&working, &args) &&
-	   working.match(")") && 
-	   (body = parse_block(&working))
-	  ){
-	  	*p = working;
-		return MAKE_EXPR(new ClosureExp(args, body));
+	if(!(p->identifier(&name) &&
+		 p->match("(") &&
+		 parse_commasep_expr(p, ')', &args) &&
+		 p->match(")")
+		)){
+		return nullptr;
 	}
-
-	return nullptr;
-}
-
-ExprPtr  parse_expr0(ParseInfo *p){
-	ExprPtr out = nullptr;
-	if( out = parse_parens(p)) return out;
-	else if( out = parse_ffi_call(p)) return out;
-	//else if( out = parse_closcall(p)) return out;
-	else if( out = parse_closure(p)) return out;
-	//else if( out = parse_funcall(p)) return out;
-	else if( out = parse_unit(p)) return out;
-	else if( out = parse_char(p)) return out;
-	else if( out = parse_int(p)) return out;
-	else if( out = parse_var(p)) return out;
-	else if( out = parse_object(p)) return out;
-	else if( out = parse_string(p)) return out;
-	else if( out = parse_vector(p)) return out;
-	return out;
+	auto builtin = io_builtins.at(name);
+	if(args.size() != builtin.second) return nullptr;
+	return MAKE(IoExp, builtin.first, std::move(args));
 }
 
-ExprPtr  parse_expr1(ParseInfo *p){
-	ExprPtr out = nullptr;
-	if( out = parse_fieldaccess(p)) return out;
-	else if( out = parse_expr0(p)) return out;
-	return out;
+bool io_follows(ParseInfo *p){
+	for(auto &builtin : io_builtins){
+		if(p->at_word(builtin.first.c_str()) && p->at('(', 1)) return true;
+	}
+	return false;
 }
 
-ExprPtr  parse_expr2(ParseInfo *p){
-	ExprPtr out = nullptr;
-	if( out = parse_ArithExpr(p)) return out;
-	else if( out = parse_expr1(p)) return out;
-	return out;
+/*
+ * Whether the token after foreign can start a library::symbol name.
+ */
+bool ffi_name_follows(ParseInfo *p){
+	const Token &t = p->ahead(1);
+	if(t.type == TOK_WORD) return true;
+	if(t.type != TOK_PUNCT) return false;
+	return strchr("()[]{};,=+-*/%<>", t.value) == nullptr;
 }
 
-ExprPtr  parse_Expression(ParseInfo *p){
-	ExprPtr out = nullptr;
-	if( out = parse_expr2(p)) return out;
-	return out;
+ExprPtr parse_expr0(ParseInfo *p){
+	const Token &t = p->current();
+	switch(t.type){
+		case TOK_INT:
+			p->index++;
+			return MAKE(IntExp, t.value);
+		case TOK_CHAR:
+			p->index++;
+			return MAKE(IntExp, t.value);
+		case TOK_STRING:
+			return parse_string(p);
+		case TOK_WORD:
+			{
+			if(p->at_word("null")){
+				p->index++;
+				return MAKE(UnitExp);
+			}
+			if(p->at_word("closure") && p->at('(', 1)) return parse_closure(p);
+			if(p->at_word("foreign") && ffi_name_follows(p)) return parse_ffi_call(p);
+			if(actor_follows(p)) return parse_actor(p);
+			if(parallel_follows(p)) return parse_parallel(p);
+			if(fiber_follows(p)) return parse_fiber(p);
+			if(io_follows(p)) return parse_io(p);
+			std::string id;
+			p->identifier(&id);
+			return MAKE(VarExp, id);
+			}
+		case TOK_PUNCT:
+			if(t.value == '(') return parse_parens(p);
+			if(t.value == '[') return parse_vector(p);
+			if(p->match("{}")) return MAKE(ObjectExp);
+			return nullptr;
+		default:
+			return nullptr;
+	}
 }
 
-StmtPtr parse_statement(ParseInfo *p);
-
 StmtPtr parse_return(ParseInfo *p){
-	ParseInfo working = *p;
 	ExprPtr exp = nullptr;
 
-	if(working.match("return") &&
-	   (exp = parse_Expression(&working)) &&
-	   working.match(";")
+	if(p->match("return") &&
+	   (exp = parse_Expression(p)) &&
+	   p->match(";")
 	  ){
-	  	*p = working;
-		return MAKE_STMT(new ReturnStmt(exp));
-	  }
-
-	  return nullptr;
+		return MAKE(ReturnStmt, exp);
+	}
+	return nullptr;
 }
 
 StmtPtr parse_break(ParseInfo *p){
-	ParseInfo working = *p;
-
-	if(working.match("break") && working.match(";")){
-		*p = working;
-		return MAKE_STMT(new BreakStmt());
-	  }
-	  return nullptr;
+	if(p->match("break") && p->match(";")){
+		return MAKE(BreakStmt);
+	}
+	return nullptr;
 }
 
 StmtPtr parse_continue(ParseInfo *p){
-	ParseInfo working = *p;
-
-	if(working.match("continue") && working.match(";")){
-		*p = working;
-		return MAKE_STMT(new ContinueStmt());
-	  }
-	  return nullptr;
+	if(p->match("continue") && p->match(";")){
+		return MAKE(ContinueStmt);
+	}
+	return nullptr;
 }
 
 StmtPtr parse_let(ParseInfo *p){
-	ParseInfo working = *p;
 	std::string id;
 	ExprPtr exp = nullptr;
 
-	if(working.match("let") &&
-	   working.identifier(&id) &&
-	   working.match("=") &&
-	   (exp = parse_Expression(&working)) &&
-	   working.match(";")
+	if(p->match("let") &&
+	   p->identifier(&id) &&
+	   p->match("=") &&
+	   (exp = parse_Expression(p)) &&
+	   p->match(";")
 	  ){
-	  	*p = working;
-		return MAKE_STMT(new DeclareStmt(exp, id));
-	  }
-
-	  return nullptr;
-}
-
-StmtPtr parse_bare_expression(ParseInfo *p){
-	ParseInfo working = *p;
-	ExprPtr expr0 = nullptr;
-	if((expr0 = parse_Expression(&working)) &&
-	   working.match(";")){
-		*p = working;
-		return MAKE_STMT(new ExpressionStmt(expr0));
+		return MAKE(DeclareStmt, exp, id);
 	}
 	return nullptr;
 }
 
-StmtPtr parse_setfield(ParseInfo *p){
-	ParseInfo working = *p;
-	std::vector<AccessPtr> accs;
-	ExprPtr exp = nullptr;
-	ExprPtr obj = nullptr;
-	AccessPtr acc = nullptr;
-
-	if((obj = parse_expr0(&working)) &&
-	   parse_accessors(&working, &accs) &&
-		working.match("=") &&
-	   (exp = parse_Expression(&working)) &&
-	   working.match(";")
-	  ){
-		acc = accs[0];
-		acc->set_sub_expr(obj);
-		for(int i = 1; i < accs.size(); i++){
-			//exp = MAKE_EXPR(new GetFieldExp(acc, exp));
-			auto a = accs[i];
-			a->set_sub_expr(acc);
-			acc = a;
-		}
-	  	*p = working;
-		return MAKE_STMT(new SetFieldStmt(acc, exp));
-	}
-
-	return nullptr;
-}
-
 StmtPtr parse_assign(ParseInfo *p){
-	ParseInfo working = *p;
 	std::string id;
 	ExprPtr exp = nullptr;
 
-	if(working.identifier(&id) &&
-	   working.match("=") &&
-	   (exp = parse_Expression(&working)) &&
-	   working.match(";")
+	if(p->identifier(&id) &&
+	   p->match("=") &&
+	   (exp = parse_Expression(p)) &&
+	   p->match(";")
 	  ){
-	  	*p = working;
-		return MAKE_STMT( new AssignStmt(exp, id) );
+		if(p->assigned != nullptr) p->assigned->insert(id);
+		return MAKE(AssignStmt, exp, id);
 	}
-
 	return nullptr;
 }
 
-std::shared_ptr<BlockStmt> parse_block(ParseInfo *p){
-	ParseInfo working = *p;
-	std::string id;
-	ExprPtr exp = nullptr;
+/*
+ * Either obj.accessors = exp; or a bare exp;
+ * they share a prefix so they're parsed together.
+ */
+StmtPtr parse_expression_statement(ParseInfo *p){
+	AccessPtr last = nullptr;
+	ExprPtr exp = parse_expr0(p);
+	if(exp == nullptr) return nullptr;
+	exp = parse_accessors(p, exp, &last);
+
+	if(last != nullptr && p->at_assign(0)){
+		p->index++;
+		ExprPtr value = parse_Expression(p);
+		if(value == nullptr || !p->match(";")) return nullptr;
+		return MAKE(SetFieldStmt, last, value);
+	}
 
-	if(working.match("{")){
-		std::vector<StmtPtr > stmts;
-		StmtPtr stmt = nullptr;
-		int i = 0;
-		while(!working.peek("}") && (stmt = parse_statement(&working))){
-			stmts.push_back(stmt);
-			i++;
-		}
-		//putchar('\n');
+	exp = parse_binary(p, exp, 0);
+	if(exp == nullptr || !p->match(";")) return nullptr;
+	return MAKE(ExpressionStmt, exp);
+}
 
-		if(working.match("}")){
-			*p = working;
-			return std::shared_ptr<BlockStmt>(new BlockStmt(stmts));
-		}
-		//TODO DELETE statments
-	}
+BlockStmt *parse_block(ParseInfo *p){
+	if(!p->match("{")) return nullptr;
 
-	return nullptr;
+	std::vector<StmtPtr > stmts;
+	while(!p->at('}')){
+		StmtPtr stmt = parse_statement(p);
+		if(stmt == nullptr) return nullptr;
+		stmts.push_back(stmt);
+	}
+	p->index++;
+	return MAKE(BlockStmt, std::move(stmts));
 }
 
 StmtPtr parse_funcdef(ParseInfo *p){
-	ParseInfo working = *p;
 	std::string id;
 	std::vector<std::string> args;
-	std::shared_ptr<BlockStmt> body;
-
-	//arguments not working at the moment
-	if(working.match("fun") &&
-	   working.identifier(&id) &&
-	   working.match("(") && 
-	   parse_commasep_ident(&working, &args) &&
-	   working.match(")") && 
-	   (body = parse_block(&working))
+	BlockStmt *body;
+
+	if(!(p->match("fun") &&
+	   p->identifier(&id) &&
+	   p->match("(") && 
+	   parse_commasep_ident(p, &args) &&
+	   p->match(")")
+	  )){
+		return nullptr;
+	}
+	p->functions++;
+	body = parse_block(p);
+	p->functions--;
+	if(body == nullptr) return nullptr;
+	return MAKE(FunctionStmt, id, std::move(args), body);
+}
+
+StmtPtr parse_while(ParseInfo *p){
+	ExprPtr exp;
+	BlockStmt *body;
+
+	if(p->match("while") &&
+	   (exp = parse_parens(p)) &&
+	   (body = parse_block(p))
 	  ){
-	  	*p = working;
-		return MAKE_STMT(new FunctionStmt(id, args, body));
+		return MAKE(WhileStmt, exp, body);
 	}
+	return nullptr;
+}
 
+StmtPtr parse_for(ParseInfo *p){
+	std::string id;
+	ExprPtr exp;
+	BlockStmt *body;
+
+	if(p->match("for") &&
+	   p->match("(") &&
+	   p->identifier(&id) &&
+	   p->match("in") &&
+	   (exp = parse_Expression(p)) &&
+	   p->match(")") &&
+	   (body = parse_block(p))
+	  ){
+		return MAKE(ForStmt, id, exp, body);
+	}
 	return nullptr;
 }
 
-StmtPtr parse_while(ParseInfo *p){
-	ParseInfo working = *p;
+StmtPtr parse_yield(ParseInfo *p){
 	ExprPtr exp;
-	std::shared_ptr<BlockStmt> body;
 
-	//arguments not working at the moment
-	if(working.match("while") &&
-	   (exp = parse_parens(&working)) &&
-	   (body = parse_block(&working))
+	if(p->functions > 0 &&
+	   p->match("yield") &&
+	   (exp = parse_Expression(p)) &&
+	   p->match(";")
 	  ){
-	  	*p = working;
-		return MAKE_STMT(new WhileStmt(exp, body));
+		return MAKE(YieldStmt, exp);
 	}
-
 	return nullptr;
 }
 
 StmtPtr parse_if(ParseInfo *p){
-	ParseInfo working = *p;
 	ExprPtr exp;
 	StmtPtr body;
 	StmtPtr _else = nullptr;
 
-	//arguments not working at the moment
-	if(working.match("if") &&
-	   (exp = parse_parens(&working)) &&
-	   (body = parse_statement(&working))
-	  ){
-	  	*p = working;
-		if(working.match("else") &&
-			(_else = parse_statement(&working))){
-	  		*p = working;
-			return MAKE_STMT(new IfStmt(exp, body, _else));
-		}
-		return MAKE_STMT(new IfStmt(exp, body));
+	if(!(p->match("if") &&
+	   (exp = parse_parens(p)) &&
+	   (body = parse_statement(p))
+	  )){
+		return nullptr;
 	}
-
-	return nullptr;
+	if(p->at_word("else")){
+		p->index++;
+		if(!(_else = parse_statement(p))) return nullptr;
+		return MAKE(IfStmt, exp, body, _else);
+	}
+	return MAKE(IfStmt, exp, body);
 }
 
 StmtPtr parse_FFI_load(ParseInfo *p){
-	ParseInfo working = *p;
 	std::string ffi;
 
-	if(working.match("#load") &&
-	   working.non_whitespace(&ffi)
+	if(p->match("#load") &&
+	   p->non_whitespace(&ffi)
 	  ){
-	  	*p = working;
-		return MAKE_STMT(new LoadFFIStmt(ffi));
+		return MAKE(LoadFFIStmt, ffi);
 	}
-
 	return nullptr;
 }
 
 StmtPtr parse_statement(ParseInfo *p){
-	StmtPtr  out = nullptr;
-
-	if(out = parse_FFI_load(p)) return out;
-	if(out = parse_funcdef(p)) return out;
-	if(out = parse_if(p)) return out;
-	if(out = parse_while(p)) return out;
-	if(out = parse_return(p)) return out;
-	if(out = parse_break(p)) return out;
-	if(out = parse_continue(p)) return out;
-	if(out = parse_setfield(p)) return out;
-	if(out = parse_let(p)) return out;
-	if(out = parse_assign(p)) return out;
-	if(out = parse_block(p)) return out;
-	if(out = parse_bare_expression(p)) return out;
+	const Token &t = p->current();
+
+	if(t.type == TOK_WORD && !p->at_assign(1)){
+		if(p->at_word("fun")) return parse_funcdef(p);
+		if(p->at_word("if")) return parse_if(p);
+		if(p->at_word("while")) return parse_while(p);
+		if(p->at_word("for")) return parse_for(p);
+		if(p->at_word("yield") && !(p->at('(', 1) && p->at(')', 2))) return parse_yield(p);
+		if(p->at_word("return")) return parse_return(p);
+		if(p->at_word("break")) return parse_break(p);
+		if(p->at_word("continue")) return parse_continue(p);
+		if(p->at_word("let")) return parse_let(p);
+	}
+	if(t.type == TOK_WORD) return p->at_assign(1) ? parse_assign(p) : parse_expression_statement(p);
+	if(p->peek("#load")) return parse_FFI_load(p);
+	// {} followed by an accessor is an object, otherwise a block
+	if(t.type == TOK_PUNCT && t.value == '{' && !p->peek("{}.") &&
+		!p->peek("{}(") && !p->peek("{}[")){
+		return parse_block(p);
+	}
+	return parse_expression_statement(p);
+}
 
-	return nullptr;
+/*
+ * Creates closures for all the named functions
+ */
+void create_closures(ProgramView &program, Dictionary *globals){
+	for(auto &f : program.functions){
+		if(f.name < 0) continue;
+		globals->emplace(program.name(f.name), ObjPtr(new Closure(f.start)));
+	}
 }
 
 /*
- * Creates closures for all the top level functions
+ * Emits the program, leaving space at the bottom of the top level frame
+ * for calls inlined there. If a function that was inlined turns out to
+ * be assigned to, the program is compiled again without inlining it.
+ * Bodies left as stubs can't be checked, so anything the program
+ * assigns to is never inlined when they are.
  */
-void create_closures(std::vector<Instruction> &ins, Dictionary *globals){
-
-	// scan for label addresses
-	for(int ins_ptr = 0; ins_ptr < ins.size(); ins_ptr++){
-		Instruction instr = ins[ins_ptr];
-		// HACKY, but we check for . so we don't include loop labels etc.
-		if(instr.op == LABEL && instr.str[0] != '.'){
-			globals->emplace(instr.str, ObjPtr(new Closure(ins_ptr)));
+void compile_program(StmtPtr stmt, LazyCompiler &lazy,
+					 std::set<std::string> &reassigned){
+	std::vector<CodeObject> &code = lazy.code;
+	LabelTable &labels = lazy.labels;
+	for(;;){
+		labels = LabelTable();
+		code = std::vector<CodeObject>(1);
+		lazy.bodies.clear();
+		CompilationState state(labels, code);
+		if(lazy.defers()) state.lazy = &lazy.bodies;
+		state.inline_limit = lazy.inline_limit;
+		state.reassigned = reassigned;
+
+		std::vector<Instruction> body;
+		auto c = std::map<std::string, int>();
+		auto outer = state.begin_frame(0);
+		stmt->emit(state, c, body);
+		int extra = state.end_frame(0, outer);
+		code[0].frame_size = extra;
+		code[0].code = std::vector<Instruction>(extra, new_unit());
+		code[0].code.insert(code[0].code.end(), body.begin(), body.end());
+
+		bool ok = true;
+		for(auto &f : code) ok = state.check_inlined(f.code) && ok;
+		if(ok){
+			lazy.save(state);
+			return;
 		}
+		reassigned = state.reassigned;
 	}
 }
 
-int main(int argc, char **argv){
-	if(argc < 2) return 0;
-
-	std::stringstream input;
-	std::ifstream file;
-	file.open(argv[1]);
-	input << file.rdbuf();
-
-	std::string s = input.str();
+void show_code(std::vector<CodeObject> &code, std::ostream &out){
+	for(auto &c : code){
+		if(c.label >= 0){
+			out << (c.name.empty() ? "closure" : c.name) <<
+				" (" << c.arity << " args, frame " << c.frame_size << "):\n";
+		}
+		int position = 0;
+		for(auto i : c.code){
+			out << position << ":\t" << i << "\n";
+			position++;
+		}
+	}
+}
 
-	ParseInfo p = ParseInfo(s);
+/*
+ * Parses and compiles a source file, printing the
+ * code before and after optimisation.
+ */
+Program *compile_source(std::string &s, LazyCompiler &lazy, std::ostream &out){
+	TokenStream tokens(s);
+	// the tree is freed in one go once every body has been compiled
+	ParseInfo p = ParseInfo(tokens, lazy.arena);
+	std::set<std::string> reassigned;
+	if(lazy.defers()) p.assigned = &reassigned;
 
-	
 	StmtPtr stmt = parse_statement(&p);
-	if(stmt == nullptr){
-		puts("no parse");
-		return 0;
-	} 
-
-	Context ctx = Context();
-	CompilationState state;
-
-	std::vector<Instruction> is= std::vector<Instruction>();
-	auto c = std::map<std::string, int>();
-	stmt->emit(state, c, is);
-
+	if(stmt == nullptr) return nullptr;
+	// actors and workers share the program, so it can't change under them
+	if(p.concurrent) lazy.enabled = false;
+
+	std::vector<CodeObject> &code = lazy.code;
+	LabelTable &labels = lazy.labels;
+	compile_program(stmt, lazy, reassigned);
+	if(!lazy.enabled) lazy.compile_all();
+	show_code(code, out);
+
+	std::vector<int> all(code.size());
+	for(int k = 0; k < code.size(); k++) all[k] = k;
+	lazy.optimise_all(all);
+	std::vector<Instruction> is = link_code(code, labels);
+
+	out << "===================================================\n";
 	int position = 0;
 	for(auto i : is){
-		std::cout << position << ":\t" << i << "\n";
+		out << position << ":\t" << i << "\n";
 		position++;
 	}
+	return new Program(is, code);
+}
 
-	auto globals = new Dictionary();
-	create_closures(is, globals);
-	process_labels(is);
+/*
+ * Times tokenizing and parsing a source file, for bench/gen_script.py.
+ */
+int parse_only(std::string &source){
+	using clock = std::chrono::steady_clock;
+	auto start = clock::now();
+	TokenStream tokens(source);
+	auto tokenized = clock::now();
+	Arena arena;
+	ParseInfo p = ParseInfo(tokens, arena);
+	StmtPtr stmt = parse_statement(&p);
+	auto parsed = clock::now();
+
+	auto ms = [](clock::duration d){
+		return std::chrono::duration<double, std::milli>(d).count();
+	};
+	std::cout << source.size() << " bytes, " << tokens.tokens.size() << " tokens\n";
+	std::cout << "tokenize: " << ms(tokenized - start) << " ms\n";
+	std::cout << "parse: " << ms(parsed - tokenized) << " ms\n";
+	if(stmt == nullptr) puts("no parse");
+	return stmt == nullptr;
+}
 
-	std::cout << "===================================================\n";
-	position = 0;
-	for(auto i : is){
-		std::cout << position << ":\t" << i << "\n";
-		position++;
+typedef struct Options{
+	bool use_jit = true;
+	bool use_spec = true;
+	bool show_feedback = false;
+	bool use_cache = true;
+	bool use_ir = true;
+	bool use_lazy = true;
+	int inline_limit = 16;
+	int threads = 1;
+	char *output = nullptr;
+} Options;
+
+/*
+ * A script's program, shared by every isolate running it, and the
+ * compiler for its lazy functions. Programs run by more than one
+ * isolate, or that spawn actors, are compiled in full, as lazily
+ * compiled code would be written to them as they run.
+ */
+typedef struct Script{
+	const char *filename;
+	int uses = 0;	// isolates running it
+	LazyCompiler lazy;
+	std::shared_ptr<const Program> program;
+	// the cache is written once the lazy bodies have been compiled
+	std::string to_cache;
+} Script;
+
+void run_actor(Script &, Options &, Actors &, int self, Message &, std::ostream &);
+
+/*
+ * Runs code in an isolate, which has to be entered: the isolate's
+ * view of the program and the jit and speculator watching it run.
+ * self is the isolate's mailbox.
+ */
+class Interpreter{
+	public:
+	Script &script;
+	Options &opts;
+	Isolate &iso;
+	Actors &actors;
+	int self;
+	ProgramView program;
+	TraceJit jit;
+	Speculator spec;
+	Fibers fibers;
+	IoLoop io;
+	Generators generators;
+	int nested = 0;	// calls being made by call(), fibers can't switch in them
+
+	Interpreter(Script &, Options &, Isolate &, Actors &, int self);
+
+	// runs from ip until it returns out of the frame it started in
+	void execute(int ip);
+	ObjPtr call(ObjPtr closure, const std::vector<ObjPtr> &args);
+	// lets the other fibers finish once the top level has
+	void finish_fibers(void){ execute(fibers.exit()); }
+	// not in a call() or a generator
+	bool can_switch(void){ return nested == 0 && !generators.busy(); }
+};
+
+Interpreter::Interpreter(Script &script, Options &opts, Isolate &iso,
+						 Actors &actors, int self)
+	: script(script), opts(opts), iso(iso), actors(actors), self(self),
+	  program(script.program), jit(program, iso.globals), spec(program),
+	  fibers(iso.ctxt), io(fibers, iso.ctxt), generators(iso.ctxt){
+	// fibers awaiting I/O are woken by the loop
+	fibers.idle = [this](bool block){ return io.busy() && io.poll(block); };
+	jit.enabled = opts.use_jit;
+	// only asked for along with the speculator's feedback
+	if(opts.show_feedback) jit.log = &iso.out;
+	spec.enabled = opts.use_spec;
+}
+
+/*
+ * The call can be made while the interpreter is already running,
+ * a trace being recorded is given up when the closure returns.
+ */
+ObjPtr Interpreter::call(ObjPtr closure, const std::vector<ObjPtr> &args){
+	Closure *clos = closure.as_c();
+	if(clos == nullptr) return ObjPtr();
+	// returning to -1 stops execute()
+	nested++;
+	execute(iso.ctxt.enter(clos, args, -1));
+	nested--;
+	return iso.ctxt.pop();
+}
+
+/*
+ * Runs body(worker, lo, hi) over [0, count) on interpreters of their
+ * own, spread over the threads with parallel_ranges(). The workers
+ * read the caller's objects where they are, so nothing is copied going
+ * in, and get a copy of its globals so the caller's never change under
+ * it. The caller's objects aren't in a worker's heap, so changing one
+ * there is an error (see can_change()), apart from replacing elements of
+ * an array, which never moves anything. Workers that replace the same
+ * element leave one of their values in it. What the workers allocate
+ * is moved into the caller's heap once they have all finished. On one
+ * thread body just runs on the caller.
+ */
+void run_workers(Interpreter &caller, int count,
+				 const std::function<void(Interpreter &, int, int)> &body){
+	int threads = caller.opts.threads;
+	int grain = std::max(1, std::min(MAX_GRAIN, count / (threads * 8)));
+	if(threads <= 1 || count <= grain){
+		if(count > 0) body(caller, 0, count);
+		return;
 	}
 
-	for(int ip = 0; ip >= 0 && ip < is.size(); ){
-		auto i = is[ip];
+	std::vector<std::stringstream> outs(threads);
+	std::vector<std::unique_ptr<Isolate>> isolates(threads);
+	std::vector<std::unique_ptr<Interpreter>> workers(threads);
+	Dictionary *globals = caller.iso.globals;
+	parallel_ranges(count, threads, grain, [&](int lo, int hi, int w){
+		if(isolates[w] == nullptr){
+			isolates[w].reset(new Isolate(outs[w]));
+			Isolate &iso = *isolates[w];
+			iso.enter();
+			iso.globals->insert(globals->begin(), globals->end());
+			workers[w].reset(new Interpreter(caller.script, caller.opts, iso,
+											 caller.actors, caller.self));
+			iso.leave();
+		}
+		isolates[w]->enter();
+		body(*workers[w], lo, hi);
+		isolates[w]->leave();
+	});
+
+	workers.clear();
+	for(int w = 0; w < threads; w++){
+		if(isolates[w] == nullptr) continue;
+		isolates[w]->move_objects(*Heap::get());
+		caller.iso.out << outs[w].str();
+	}
+}
+
+void Interpreter::execute(int ip){
+	Context &ctx = iso.ctxt;
+	Dictionary *globals = iso.globals;
+
+	for(;;){
+		if(ip == FIBER_EXIT) ip = fibers.exit();
+		if(ip == GENERATOR_EXIT) ip = generators.exit();
+		if(ip < 0 || ip >= program.size()) break;
+		if(jit.is_recording()) jit.record(&ctx, ip);
+		if(spec.enabled) spec.profile(&ctx, ip);
+		Instruction i = program[ip];
+		if(i.op == LOOP){
+			ip = jit.back_edge(&ctx, ip);
+			continue;
+		}
+		if(i.op == SPEC_ENTRY){
+			ip = spec.enter(&ctx, ip);
+			continue;
+		}
+		if(i.op == SPEC_CALL){
+			ip = spec.call(&ctx, ip);
+			continue;
+		}
+		if(i.op == SPEC_LOOKUP){
+			ip = spec.lookup(&ctx, ip);
+			continue;
+		}
+		if(i.op == LAZY_COMPILE){
+			ip = script.lazy.compile(program, ip);
+			spec.code_added();
+			continue;
+		}
+		if(i.op == SPAWN){
+			// the closure is under its arguments
+			std::vector<ObjPtr> start(i.i + 1);
+			for(int n = i.i; n >= 0; n--) start[n] = ctx.pop();
+			Script &script = this->script;
+			Options &opts = this->opts;
+			Actors &actors = this->actors;
+			int actor = actors.spawn(Actors::pack(start),
+				[&script, &opts, &actors](int self, Message &m, std::ostream &out){
+					run_actor(script, opts, actors, self, m, out);
+				});
+			ctx.push(ObjPtr(actor));
+			ip++;
+			continue;
+		}
+		if(i.op == SEND){
+			std::vector<ObjPtr> value = { ctx.pop() };
+			int to = ctx.pop().as_i();
+			actors.send(to, Actors::pack(value, i.i == 1));
+			ctx.push(ObjPtr());
+			ip++;
+			continue;
+		}
+		if(i.op == RECEIVE){
+			std::unique_ptr<Message> m = actors.receive(self);
+			ctx.push(Actors::unpack(*m)[0]);
+			ip++;
+			continue;
+		}
+		if(i.op == PAR_MAP){
+			ObjPtr f = ctx.pop();
+			ArrayList *from = ctx.pop().as_arr();
+			ArrayList *to = new ArrayList();
+			if(from != nullptr){
+				to->resize(from->size());
+				run_workers(*this, from->size(), [&](Interpreter &w, int lo, int hi){
+					for(int n = lo; n < hi; n++) (*to)[n] = w.call(f, { (*from)[n] });
+				});
+			}
+			ctx.push(ObjPtr(to));
+			ip++;
+			continue;
+		}
+		if(i.op == PAR_REDUCE){
+			ObjPtr acc = ctx.pop();
+			ObjPtr f = ctx.pop();
+			ArrayList *from = ctx.pop().as_arr();
+			if(from != nullptr){
+				// each range is folded on its own, then they're folded in order
+				std::mutex lock;
+				std::map<int, ObjPtr> folded;
+				run_workers(*this, from->size(), [&](Interpreter &w, int lo, int hi){
+					ObjPtr part = (*from)[lo];
+					for(int n = lo + 1; n < hi; n++) part = w.call(f, { part, (*from)[n] });
+					std::lock_guard<std::mutex> guard(lock);
+					folded[lo] = part;
+				});
+				for(auto &part : folded) acc = call(f, { acc, part.second });
+			}
+			ctx.push(acc);
+			ip++;
+			continue;
+		}
+		if(i.op == PAR_FOR){
+			ObjPtr f = ctx.pop();
+			int hi = ctx.pop().as_i();
+			int lo = ctx.pop().as_i();
+			run_workers(*this, std::max(0, hi - lo), [&](Interpreter &w, int first, int last){
+				for(int n = first; n < last; n++) w.call(f, { ObjPtr(lo + n) });
+			});
+			ctx.push(ObjPtr());
+			ip++;
+			continue;
+		}
+		switch(i.op){
+			case FIBER: ip = fibers.start(ip, i.i); continue;
+			case YIELD: ip = fibers.yield(ip, can_switch()); continue;
+			case JOIN: ip = fibers.join(ip, can_switch()); continue;
+			case CHANNEL: ip = fibers.channel(ip); continue;
+			case CHAN_SEND: ip = fibers.send(ip); continue;
+			case CHAN_RECEIVE: ip = fibers.receive(ip, can_switch()); continue;
+			case IO_READ: case IO_WRITE: case IO_LISTEN:
+			case IO_ACCEPT: case IO_CONNECT: case IO_SEND:
+			case IO_RECV: case IO_CLOSE: case AWAIT:
+				ip = io.execute(i, ip, can_switch());
+				continue;
+			case GEN_START: ip = generators.start(ip); continue;
+			case GEN_YIELD: ip = generators.yield(ip); continue;
+			case ITER_NEXT:
+				if(ctx.get(ctx.frame_size() - 1).type != GENERATOR) break;
+				ip = generators.resume(ip);
+				continue;
+			case FFI_CALL_SYM:
+				{
+				// the call site calls the function directly from now on
+				void *func = ctx.ffi_resolve(i.str);
+				i = ffi_call(func);
+				// one that can't be found is looked for again next time
+				if(func != nullptr) program.set(ip, i);
+				}
+				break;
+			default: break;
+		}
 		step_instruction(&ctx, i, &ip, globals);
 	}
+}
+
+/*
+ * Runs the program in an isolate, which the calling thread enters.
+ */
+void run_program(Script &script, Options &opts, Isolate &iso){
+	iso.enter();
+	Actors actors;
+	Interpreter interp(script, opts, iso, actors, 0);
+	create_closures(interp.program, iso.globals);
+	interp.execute(0);
+	interp.finish_fibers();
+	if(opts.show_feedback) interp.spec.dump(iso.out);
+	actors.join(iso.out);
+
+	iso.out << *iso.globals;
+	iso.garbage_collect();
+	iso.leave();
+}
+
+/*
+ * Calls the closure the actor was spawned with, in a new isolate.
+ */
+void run_actor(Script &script, Options &opts, Actors &actors, int self,
+			   Message &start, std::ostream &out){
+	Isolate iso(out);
+	iso.enter();
+	{
+		Interpreter interp(script, opts, iso, actors, self);
+		create_closures(interp.program, iso.globals);
+
+		std::vector<ObjPtr> values = Actors::unpack(start);
+		std::vector<ObjPtr> args(values.begin() + 1, values.end());
+		Closure *clos = values[0].as_c();
+		if(clos != nullptr) interp.execute(iso.ctxt.enter(clos, args, -1));
+		interp.finish_fibers();
+		if(opts.show_feedback) interp.spec.dump(iso.out);
+	}
+	iso.leave();
+}
+
+/*
+ * Loads or compiles a script, returns false if it didn't parse.
+ */
+bool load_script(Script &script, Options &opts, std::ostream &out){
+	LazyCompiler &lazy = script.lazy;
+	lazy.use_ir = opts.use_ir;
+	lazy.inline_limit = opts.inline_limit;
+	lazy.threads = opts.threads;
+	// a saved program has every function in it
+	lazy.enabled = opts.use_lazy && opts.output == nullptr && script.uses == 1;
+
+	// compiled programs are run without parsing
+	Program *loaded = Program::load(script.filename);
+	if(loaded == nullptr){
+		std::stringstream input;
+		std::ifstream file;
+		file.open(script.filename);
+		input << file.rdbuf();
+		std::string source = input.str();
+
+		std::string options = std::string(opts.use_ir ? "opt" : "no-opt") +
+			" inline=" + std::to_string(opts.inline_limit);
+		std::string cached = opts.use_cache ? cache_path(source, options) : "";
+		loaded = cache_load(cached);
+		if(loaded == nullptr){
+			loaded = compile_source(source, lazy, out);
+			if(loaded != nullptr && !lazy.enabled) cache_store(*loaded, cached);
+			else script.to_cache = cached;
+		}
+	}
+	if(loaded == nullptr){
+		out << "no parse\n";
+		return false;
+	}
+	script.program.reset(loaded);
+	return true;
+}
+
+void finish_script(Script &script){
+	if(script.to_cache.empty()) return;
+	Program *whole = script.lazy.finish();
+	cache_store(*whole, script.to_cache);
+	delete whole;
+}
+
+/*
+ * More than one script runs them at the same time, each on a thread
+ * and in an isolate of its own. A script given more than once is only
+ * compiled once, and its isolates share the program. The output is
+ * printed in order once they have all finished.
+ */
+int main(int argc, char **argv){
+	Options opts;
+	opts.threads = std::max(1u, std::thread::hardware_concurrency());
+	bool only_parse = false;
+	std::vector<char *> filenames;
+	for(int i = 1; i < argc; i++){
+		std::string arg = argv[i];
+		if(arg == "--no-jit") opts.use_jit = false;
+		else if(arg == "--no-opt") opts.use_ir = false;
+		else if(arg == "--no-lazy") opts.use_lazy = false;
+		else if(arg == "--no-spec") opts.use_spec = false;
+		else if(arg == "--feedback") opts.show_feedback = true;
+		else if(arg == "--no-cache") opts.use_cache = false;
+		else if(arg == "--parse-only") only_parse = true;
+		else if(arg == "--no-inline") opts.inline_limit = 0;
+		else if(arg.rfind("--inline=", 0) == 0) opts.inline_limit = std::stoi(arg.substr(9));
+		else if(arg.rfind("--threads=", 0) == 0) opts.threads = std::max(1, std::stoi(arg.substr(10)));
+		else if(arg == "--compile" && i + 1 < argc) opts.output = argv[++i];
+		else filenames.push_back(argv[i]);
+	}
+	if(filenames.empty()) return 0;
+
+	if(only_parse){
+		std::stringstream input;
+		std::ifstream file;
+		file.open(filenames.back());
+		input << file.rdbuf();
+		std::string source = input.str();
+		return parse_only(source);
+	}
+	if(filenames.size() == 1 || opts.output != nullptr){
+		Script script;
+		script.filename = filenames.back();
+		script.uses = 1;
+		if(!load_script(script, opts, std::cout)) return 0;
+		if(opts.output != nullptr){
+			if(!script.program->save(opts.output)){
+				std::cout << "couldn't write " << opts.output << "\n";
+				return 1;
+			}
+			return 0;
+		}
+		Isolate iso(std::cout);
+		run_program(script, opts, iso);
+		finish_script(script);
+		return 0;
+	}
+
+	// each script is loaded once, into the output of its first isolate
+	std::map<std::string, Script> scripts;
+	std::vector<Script *> script_of;
+	std::vector<Script *> loading;
+	std::vector<int> first_use;
+	for(int k = 0; k < filenames.size(); k++){
+		Script &script = scripts[filenames[k]];
+		if(script.uses++ == 0){
+			script.filename = filenames[k];
+			loading.push_back(&script);
+			first_use.push_back(k);
+		}
+		script_of.push_back(&script);
+	}
+
+	std::vector<std::stringstream> outputs(filenames.size());
+	std::vector<std::thread> workers;
+	for(int k = 0; k < loading.size(); k++){
+		workers.emplace_back([&, k](){
+			load_script(*loading[k], opts, outputs[first_use[k]]);
+		});
+	}
+	for(auto &t : workers) t.join();
+	workers.clear();
+
+	for(int k = 0; k < filenames.size(); k++){
+		Script &script = *script_of[k];
+		if(script.program == nullptr) continue;
+		workers.emplace_back([&, k](){
+			Isolate iso(outputs[k]);
+			run_program(*script_of[k], opts, iso);
+		});
+	}
+	for(auto &t : workers) t.join();
+	for(auto *script : loading){
+		if(script->program != nullptr) finish_script(*script);
+	}
 
-	std::cout << *globals;
-	ctx.garbage_collect();
+	for(auto &out : outputs) std::cout << out.str();
 	return 0;
 }
@@ -0,0 +1,472 @@
+#include "speculate.hpp"
+#include "jit.hpp"
+
+static const char *type_names[] = {
+	"int", "float", "closure", "array", "dict", "string", "iterator", "generator"
+};
+
+static bool is_arith(enum OpCode op){
+	switch(op){
+		case ADD: case MIN: case MUL: case DIV: case MOD:
+		case LT: case LTE: case GT: case GTE:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static bool is_guarded(enum OpCode op){
+	return op >= ADD_IG && op <= GTE_IG;
+}
+
+/*
+ * Maps ADD..GTE (excluding EQ) onto their position in the typed ops.
+ */
+static int arith_index(enum OpCode op){
+	static const enum OpCode generic[] = {
+		ADD, MIN, MUL, DIV, MOD, LT, LTE, GT, GTE
+	};
+	for(int k = 0; k < 9; k++){
+		if(generic[k] == op) return k;
+	}
+	return -1;
+}
+
+static uint8_t mask_of(ObjPtr o){
+	return 1 << o.type;
+}
+
+/*
+ * The type a mask describes, if it only has one.
+ */
+static int mono_type(uint8_t mask){
+	for(int t = INT; t <= GENERATOR; t++){
+		if(mask == 1 << t) return t;
+	}
+	return ANY_TYPE;
+}
+
+static void show_mask(std::ostream &out, uint8_t mask){
+	bool first = true;
+	for(int t = INT; t <= GENERATOR; t++){
+		if(!(mask & 1 << t)) continue;
+		out << (first ? "" : "|") << type_names[t];
+		first = false;
+	}
+	if(first) out << "none";
+}
+
+static bool is_watched(Instruction &i){
+	return is_arith(i.op) || i.op == JMP_CLOS || i.op == LOOKUP_S;
+}
+
+Speculator::Speculator(ProgramView &is) : program(is){
+	code_added();
+}
+
+void Speculator::code_added(void){
+	feedback.resize(program.size());
+	entries.resize(program.size());
+	for(int ip = watched.size(); ip < program.size(); ip++){
+		Instruction i = program[ip];
+		watched.push_back(is_watched(i));
+	}
+	// function labels are only reached through JMP_CLOS, so they count calls
+	for(; functions_seen < program.functions.size(); functions_seen++){
+		FunctionProto &f = program.functions[functions_seen];
+		entries[f.start].end = f.end;
+		watched[f.start] = true;
+	}
+}
+
+/*
+ * Profiling
+ */
+
+void Speculator::profile_site(Context *ctxt, int ip){
+	Instruction i = program[ip];
+	if(i.op == LABEL){
+		record_entry(ctxt, ip);
+		return;
+	}
+
+	int top = ctxt->frame_size() - 1;
+	SiteFeedback &site = feedback[ip];
+	if(i.op == JMP_CLOS){
+		Closure *clos = ctxt->get(top).as_c();
+		int target = clos != nullptr ? clos->func_ptr : -1;
+		if(site.count > 0 && site.target != target) site.polymorphic = true;
+		site.target = target;
+	} else if(i.op == LOOKUP_S){
+		ObjPtr o = ctxt->get(top);
+		site.receiver |= mask_of(o);
+		Dictionary *dict = o.as_dict();
+		if(dict != nullptr){
+			auto found = dict->find(i.str);
+			if(found != dict->end()) site.value |= mask_of(found->second);
+		}
+	} else{
+		int left = mask_of(ctxt->get(top - 1));
+		int right = mask_of(ctxt->get(top));
+		site.left |= left;
+		site.right |= right;
+		// a failed guard (or a refused entry) lands here
+		if(site.spec >= 0 && (left | right) != 1 << INT) deopt(specs[site.spec]);
+	}
+	// guarded sites have to keep noticing deopts
+	if(++site.count >= SITE_SAMPLES && site.spec < 0) watched[ip] = false;
+}
+
+void Speculator::record_entry(Context *ctxt, int ip){
+	EntryFeedback &e = entries[ip];
+	int size = ctxt->frame_size();
+	if(e.count++ == 0) e.slots = std::vector<uint8_t>(size, 0);
+	if(e.slots.size() != size){
+		e.blocked = true;
+		unwatch(ip, true);
+		return;
+	}
+	for(int s = 0; s < size; s++) e.slots[s] |= mask_of(ctxt->get(s));
+
+	if(e.count == HOT_FUNCTION_THRESHOLD) specialise(ip);
+}
+
+/*
+ * Recompiling
+ */
+
+typedef std::vector<int> TypeState;
+
+static bool join_state(TypeState &into, const TypeState &from, bool *changed){
+	if(into.size() != from.size()) return false;
+	for(int k = 0; k < into.size(); k++){
+		if(into[k] == from[k] || into[k] == ANY_TYPE) continue;
+		into[k] = ANY_TYPE;
+		*changed = true;
+	}
+	return true;
+}
+
+/*
+ * A forward analysis of the types of the frame (locals and operand
+ * stack alike) at each instruction of the copy, rewriting arithmetic
+ * into typed ops. Returns false if the code couldn't be analysed.
+ */
+bool Speculator::analyse(std::vector<Instruction> &code, int base, int start,
+						 std::vector<int> &entry_types, int *rewrites){
+	static const enum OpCode unchecked[] = {
+		ADD_II, MIN_II, MUL_II, DIV_II, MOD_II, LT_II, LTE_II, GT_II, GTE_II
+	};
+	static const enum OpCode guarded[] = {
+		ADD_IG, MIN_IG, MUL_IG, DIV_IG, MOD_IG, LT_IG, LTE_IG, GT_IG, GTE_IG
+	};
+
+	int n = code.size();
+	std::vector<TypeState> in(n);
+	std::vector<bool> seen(n, false);
+
+	// sites we speculate on always produce ints
+	std::vector<bool> speculate(n, false);
+	for(int k = 0; k < n; k++){
+		SiteFeedback &site = feedback[base + k];
+		if(is_arith(code[k].op)){
+			speculate[k] = site.count > 0 &&
+				site.left == 1 << INT && site.right == 1 << INT;
+		} else if(code[k].op == LOOKUP_S){
+			speculate[k] = site.count > 0 &&
+				site.receiver == 1 << DICT && site.value == 1 << INT;
+		}
+	}
+
+	std::vector<int> work;
+	in[0] = entry_types;
+	seen[0] = true;
+	work.push_back(0);
+	while(!work.empty()){
+		int k = work.back();
+		work.pop_back();
+		TypeState state = in[k];
+		Instruction &i = code[k];
+
+		std::vector<int> succs;
+		switch(i.op){
+			case JMP: case LOOP:
+				succs.push_back(k + i.i);
+				break;
+			case JMP_CND:
+				state.pop_back();
+				succs.push_back(k + 1);
+				succs.push_back(k + i.i);
+				break;
+			case RET:
+				break;
+			case LOAD_STK:
+				state.push_back(i.index < state.size() ? state[i.index] : ANY_TYPE);
+				succs.push_back(k + 1);
+				break;
+			case SET_STK:
+				{
+				int t = state.back();
+				state.pop_back();
+				if(i.index >= state.size()) return false;
+				state[i.index] = t;
+				succs.push_back(k + 1);
+				}
+				break;
+			default:
+				{
+				int pops, pushes;
+				stack_effect(i, &pops, &pushes);
+				if(pops > state.size()) return false;
+				int b = pops >= 1 ? state[state.size() - 1] : ANY_TYPE;
+				int a = pops >= 2 ? state[state.size() - 2] : ANY_TYPE;
+				state.resize(state.size() - pops);
+
+				int result = ANY_TYPE;
+				switch(i.op){
+					case LOAD_IMM_I: case NEW_UNIT: result = INT; break;
+					case LOAD_IMM_F: result = FLOAT; break;
+					case NEW_OBJ: result = DICT; break;
+					case NEW_VEC: result = ARRAY; break;
+					case NEW_STRING: result = STRING; break;
+					case NEW_CLOS: case CLOS_CAP: result = CLOSURE; break;
+					case EQ: result = INT; break;
+					case LOOKUP_S: if(speculate[k]) result = INT; break;
+					case ADD_II: case MIN_II: case MUL_II: case DIV_II: case MOD_II:
+					case LT_II: case LTE_II: case GT_II: case GTE_II:
+						result = INT;
+						break;
+					default:
+						if(!is_arith(i.op)) break;
+						if(speculate[k] || (a == INT && b == INT)){
+							result = INT;
+						} else if(i.op == MOD || i.op >= LT){
+							result = INT;
+						} else if(a == FLOAT && b == FLOAT){
+							result = FLOAT;
+						}
+						break;
+				}
+				for(int p = 0; p < pushes; p++) state.push_back(result);
+				succs.push_back(k + 1);
+				}
+				break;
+		}
+
+		for(int s : succs){
+			// leaving the copy means we've misread the function
+			if(s < 0 || s >= n) return false;
+			bool changed = false;
+			if(!seen[s]){
+				seen[s] = true;
+				in[s] = state;
+				changed = true;
+			} else if(!join_state(in[s], state, &changed)){
+				return false;
+			}
+			if(changed) work.push_back(s);
+		}
+	}
+
+	// the specialisation a call can go straight to, if any
+	auto callee_of = [&](int k){
+		SiteFeedback &site = feedback[base + k];
+		if(k == 0 || code[k - 1].op != PUSH_FRAME || !seen[k - 1]) return -1;
+		if(site.count == 0 || site.polymorphic || site.target < 0 ||
+			site.target >= entries.size()) return -1;
+		// a lazily compiled function is reached through its stub
+		int entry = site.target;
+		if(program[entry].op == JMP) entry += program[entry].i;
+		int callee = entries[entry].spec;
+		if(callee < 0 || !specs[callee].valid) return -1;
+		// the arguments are under the closure
+		TypeState &state = in[k - 1];
+		int args = code[k - 1].i - 1;
+		std::vector<int> &types = specs[callee].types;
+		if(types.size() != args || state.size() < args + 1) return -1;
+		for(int p = 0; p < args; p++){
+			int t = state[state.size() - 1 - args + p];
+			if(types[p] != ANY_TYPE && types[p] != t) return -1;
+		}
+		return callee;
+	};
+
+	*rewrites = 0;
+	int spec = specs.size();
+	for(int k = 0; k < n; k++){
+		Instruction &i = code[k];
+		if(!seen[k]) continue;
+		if(i.op == LOOKUP_S && speculate[k]){
+			SpecSite site = { spec, base + k };
+			site.name = i.str;
+			i = spec_lookup(sites.size());
+			sites.push_back(site);
+			(*rewrites)++;
+			continue;
+		}
+		if(i.op == JMP_CLOS){
+			int callee = callee_of(k);
+			if(callee < 0) continue;
+			SpecSite site = { spec, base + k };
+			site.callee = callee;
+			site.target = feedback[base + k].target;
+			i = spec_call(sites.size());
+			sites.push_back(site);
+			(*rewrites)++;
+			continue;
+		}
+		if(!is_arith(i.op)) continue;
+		TypeState &state = in[k];
+		int b = state[state.size() - 1];
+		int a = state[state.size() - 2];
+		int index = arith_index(i.op);
+		if(a == INT && b == INT){
+			i.op = unchecked[index];
+		} else if(speculate[k]){
+			// deoptimise to the same instruction in the baseline
+			i.op = guarded[index];
+			i.i = base - start;
+		} else{
+			continue;
+		}
+		(*rewrites)++;
+	}
+	return true;
+}
+
+void Speculator::unwatch(int entry, bool guarded){
+	int end = std::min(entries[entry].end, (int)watched.size());
+	for(int ip = entry; ip < end; ip++){
+		if(guarded || feedback[ip].spec < 0) watched[ip] = false;
+	}
+}
+
+void Speculator::specialise(int entry){
+	EntryFeedback &e = entries[entry];
+	e.blocked = true;	// one attempt per function
+	// nothing more is learnt from the baseline, apart from failed guards
+	unwatch(entry, false);
+
+	int base = entry + 1;
+	int end_ip = e.end;
+	if(end_ip < base || end_ip > program.size() || end_ip - base >= MAX_FUNCTION_LENGTH) return;
+
+	Specialisation s;
+	s.entry = entry;
+	s.label = program[entry];
+	s.start = program.size();
+	s.end = s.start + end_ip - base;
+	for(uint8_t mask : e.slots) s.types.push_back(mono_type(mask));
+
+	std::vector<Instruction> code;
+	for(int ip = base; ip < end_ip; ip++) code.push_back(program[ip]);
+	int rewrites = 0;
+	if(!analyse(code, base, s.start, s.types, &rewrites) || rewrites == 0) return;
+
+	for(auto &i : code) program.push_back(i);
+	watched.resize(program.size(), false);
+	for(int k = 0; k < code.size(); k++){
+		if(!is_guarded(code[k].op)) continue;
+		feedback[base + k].spec = specs.size();
+		watched[base + k] = true;
+	}
+	program.set(entry, spec_entry(specs.size()));
+	e.spec = specs.size();
+	specs.push_back(s);
+}
+
+/*
+ * Deoptimising
+ */
+
+void Speculator::invalidate(Specialisation &s){
+	if(!s.valid) return;
+	s.valid = false;
+	program.set(s.entry, s.label);
+	unwatch(s.entry, true);
+}
+
+void Speculator::deopt(Specialisation &s){
+	if(s.valid && ++s.deopts >= MAX_DEOPTS) invalidate(s);
+}
+
+int Speculator::enter(Context *ctxt, int ip){
+	Specialisation &s = specs[program[ip].i];
+	bool ok = ctxt->frame_size() == s.types.size();
+	for(int k = 0; ok && k < s.types.size(); k++){
+		if(s.types[k] != ANY_TYPE && ctxt->get(k).type != s.types[k]) ok = false;
+	}
+	if(ok) return s.start;
+	deopt(s);
+	return ip + 1;
+}
+
+int Speculator::call(Context *ctxt, int ip){
+	SpecSite &site = sites[program[ip].i];
+	Specialisation &s = specs[site.callee];
+	ObjPtr o = ctxt->pop();
+	Closure *clos = o.as_c();
+	if(clos == nullptr || clos->func_ptr != site.target){
+		// some other function, which the baseline calls
+		ctxt->push(o);
+		deopt(specs[site.caller]);
+		return site.baseline;
+	}
+	ctxt->link(ip + 1);
+	// the argument types were proven, so there's nothing to check
+	if(s.valid && clos->env.empty()) return s.start;
+	for(auto v : clos->env) ctxt->push(v);
+	return s.entry;
+}
+
+int Speculator::lookup(Context *ctxt, int ip){
+	SpecSite &site = sites[program[ip].i];
+	ObjPtr o = ctxt->pop();
+	Dictionary *dict = o.as_dict();
+	if(dict != nullptr){
+		auto found = dict->find(site.name);
+		if(found != dict->end() && found->second.type == INT){
+			ctxt->push(found->second);
+			return ip + 1;
+		}
+	}
+	ctxt->push(o);
+	deopt(specs[site.caller]);
+	return site.baseline;
+}
+
+void Speculator::dump(std::ostream &out){
+	for(int ip = 0; ip < feedback.size(); ip++){
+		SiteFeedback &site = feedback[ip];
+		if(site.count == 0) continue;
+		Instruction i = program[ip];
+		out << ip << ":\t" << instruction_names[i.op] << " ";
+		if(i.op == JMP_CLOS){
+			out << (site.polymorphic ? "polymorphic" : "target ");
+			if(!site.polymorphic) out << site.target;
+		} else if(i.op == LOOKUP_S){
+			out << i.str << " on ";
+			show_mask(out, site.receiver);
+			out << " gives ";
+			show_mask(out, site.value);
+		} else{
+			show_mask(out, site.left);
+			out << ", ";
+			show_mask(out, site.right);
+		}
+		out << " (" << site.count << ")\n";
+	}
+	for(int ip = 0; ip < entries.size(); ip++){
+		if(entries[ip].count == 0) continue;
+		out << ip << ":\tentered " << entries[ip].count << " with";
+		for(uint8_t mask : entries[ip].slots){
+			out << " ";
+			show_mask(out, mask);
+		}
+		out << "\n";
+	}
+	for(auto &s : specs){
+		out << "specialised " << s.entry << " at " << s.start <<
+			(s.valid ? "" : " (dropped)") << ", " << s.deopts << " deopts\n";
+	}
+}
@@ -0,0 +1,112 @@
+#include "tokenizer.hpp"
+
+#include <ctype.h>
+
+int TokenStream::intern(std::string &&name){
+	auto found = name_index.find(name);
+	if(found != name_index.end()) return found->second;
+	int index = names.size();
+	name_index.emplace(name, index);
+	names.push_back(std::move(name));
+	return index;
+}
+
+/*
+ * Reads one character of a string or character literal starting at i,
+ * returns false at an unescaped quote or a bad escape.
+ */
+static bool literal_char(const std::string &s, int *i, char *out){
+	if(*i >= s.size() || s[*i] == '\'' || s[*i] == '"') return false;
+	if(s[*i] != '\\'){
+		*out = s[(*i)++];
+		return true;
+	}
+	if(*i + 1 >= s.size()) return false;
+	switch(s[*i + 1]){
+		case '0': *out = '\0'; break;
+		case 't': *out = '\t'; break;
+		case 'n': *out = '\n'; break;
+		case '\'': *out = '\''; break;
+		case '"': *out = '"'; break;
+		case '\\': *out = '\\'; break;
+		default: return false;
+	}
+	*i += 2;
+	return true;
+}
+
+TokenStream::TokenStream(std::string s) : source(std::move(s)){
+	const std::string &in = source;
+	int size = in.size();
+	int line = 1;
+	int i = 0;
+	for(;;){
+		while(i < size && isspace(in[i])){
+			if(in[i] == '\n') line++;
+			i++;
+		}
+		Token t;
+		t.start = i;
+		t.line = line;
+		if(i >= size){
+			t.type = TOK_END;
+			t.value = 0;
+			t.end = i;
+			tokens.push_back(t);
+			return;
+		}
+
+		char c = in[i];
+		if(isalpha(c)){
+			// names go on with digits and underscores
+			while(i < size && (isalnum(in[i]) || in[i] == '_')) i++;
+			t.type = TOK_WORD;
+			t.value = intern(in.substr(t.start, i - t.start));
+		} else if(isdigit(c)){
+			int value = 0;
+			while(i < size && isdigit(in[i])) value = value * 10 + (in[i++] - '0');
+			t.type = TOK_INT;
+			t.value = value;
+		} else if(c == '"'){
+			// a literal that doesn't close is left as a lone quote
+			int j = i + 1;
+			std::string contents;
+			char ch;
+			while(literal_char(in, &j, &ch)) contents.push_back(ch);
+			if(j < size && in[j] == '"'){
+				i = j + 1;
+				t.type = TOK_STRING;
+				t.value = strings.size();
+				strings.push_back(std::move(contents));
+			} else{
+				i++;
+				t.type = TOK_PUNCT;
+				t.value = c;
+			}
+		} else if(c == '\''){
+			// whitespace is allowed before the closing quote
+			int j = i + 1;
+			char ch;
+			bool ok = literal_char(in, &j, &ch);
+			while(ok && j < size && isspace(in[j])) j++;
+			if(ok && j < size && in[j] == '\''){
+				i = j + 1;
+				t.type = TOK_CHAR;
+				t.value = ch;
+			} else{
+				i++;
+				t.type = TOK_PUNCT;
+				t.value = c;
+			}
+		} else{
+			i++;
+			t.type = TOK_PUNCT;
+			t.value = c;
+		}
+		t.end = i;
+		tokens.push_back(t);
+		if(t.type == TOK_STRING || t.type == TOK_CHAR){
+			for(int k = t.start; k < t.end; k++) if(in[k] == '\n') line++;
+		}
+	}
+}
@@ -0,0 +1,49 @@
+{
+fun echo(n){
+	let i = 0;
+	while(i < n){
+		let m = receive();
+		send(0, [m[0] + 1, m[1]]);
+		i = i + 1;
+	}
+	return 0;
+}
+fun relay(depth){
+	if(depth == 0){
+		send(0, "bottom");
+		return 0;
+	}
+	spawn(relay, depth - 1);
+	return 0;
+}
+fun sum(){
+	let a = receive();
+	let t = 0;
+	for(x in a){ t = t + x; }
+	send(0, [t, a]);
+	return 0;
+}
+fun mk(k){
+	return closure(x){ send(0, x + k); return 0; };
+}
+e = spawn(echo, 2);
+send(e, [1, "one"]);
+r1 = receive();
+send(e, [r1[0], {}]);
+r2 = receive();
+spawn(relay, 4);
+deep = receive();
+spawn(mk(10), 32);
+captured = receive();
+arr = [1, 2, 3];
+d = {};
+d.v = arr;
+s1 = spawn(sum);
+send(s1, arr);
+copied = receive();
+s2 = spawn(sum);
+transfer(s2, arr);
+moved = receive();
+left = arr;
+still = d.v;
+}
@@ -0,0 +1,53 @@
+{
+wrote = await(io_write("/tmp/psuedo-js-await.txt", "hello file"));
+back = await(io_read("/tmp/psuedo-js-await.txt"));
+missing = await(io_read("/tmp/psuedo-js-await-none/x"));
+plain = await(5 + 0);
+fun both(){
+	let r = io_read("/tmp/psuedo-js-await.txt");
+	let m = io_read("/tmp/psuedo-js-await-none/x");
+	return [await(m), await(r)];
+}
+reversed = both();
+bad = await(io_send(12345, "x"));
+io_close(12345);
+
+fun handle(c){
+	let got = await(io_recv(c));
+	await(io_send(c, "echo:" + got));
+	io_close(c);
+	return got;
+}
+fun server(l, n){
+	let i = 0;
+	let handlers = [];
+	while(i < n){
+		handlers = handlers + fiber(handle, await(io_accept(l)));
+		i = i + 1;
+	}
+	let got = 0;
+	for(h in handlers){ got = got + 1; join(h); }
+	return got;
+}
+fun client(m){
+	let c = await(io_connect("/tmp/psuedo-js-await.sock"));
+	await(io_send(c, m));
+	let r = await(io_recv(c));
+	let eof = await(io_recv(c));
+	io_close(c);
+	return [r, eof];
+}
+fun talk(){
+	let l = io_listen("/tmp/psuedo-js-await.sock");
+	let srv = fiber(server, l, 3);
+	let c1 = fiber(client, "a");
+	let c2 = fiber(client, "b");
+	let c3 = fiber(client, "c");
+	let replies = [join(c1), join(c2), join(c3)];
+	let served = join(srv);
+	io_close(l);
+	return [replies, served];
+}
+talked = talk();
+refused = await(io_connect("/tmp/psuedo-js-await-none.sock"));
+}
@@ -0,0 +1,10 @@
+{
+fun fib(n){
+	if(n < 2){ return n; }
+	return fib(n - 1) + fib(n - 2);
+}
+fun unused(x){ return x * 3; }
+fun pair(a, b){ return [a, b]; }
+r = fib(15);
+p = pair(r, "x");
+}
@@ -0,0 +1,39 @@
+{
+fun pick(c){
+	let a = 0;
+	if(c){ a = [1, 2]; }
+	return a;
+}
+fun obj(c){
+	let o = 1;
+	if(c){ o = {}; o.x = 5; }
+	return o;
+}
+fun chain(c){
+	let a = 0;
+	if(c){ a = [3]; }
+	let b = 0;
+	if(c){ b = a; }
+	return b;
+}
+fun nest(n){
+	let i = 0;
+	let k = 0;
+	while(k < n){ i = [i]; k = k + 1; }
+	return i;
+}
+fun grow(n){
+	let o = {};
+	o.v = 0;
+	let k = 0;
+	while(k < n){ let p = {}; p.v = o.v + 1; o = p; k = k + 1; }
+	return o;
+}
+p1 = pick(1);
+p0 = pick(0);
+o1 = obj(1);
+o0 = obj(0);
+c1 = chain(1);
+n3 = nest(3);
+g = grow(5);
+}
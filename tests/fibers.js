@@ -0,0 +1,61 @@
+{
+order = [];
+fun tick(tag, n){
+	let i = 0;
+	while(i < n){
+		order = order + (tag + i);
+		yield();
+		i = i + 1;
+	}
+	return tag;
+}
+a = fiber(tick, 10, 3);
+b = fiber(tick, 20, 2);
+ra = join(a);
+rb = join(b);
+fun produce(c, n){
+	let i = 0;
+	while(i < n){
+		chan_send(c, i * i);
+		i = i + 1;
+	}
+	chan_send(c, 0 - 1);
+	return n;
+}
+fun consume(c){
+	let got = [];
+	let v = chan_receive(c);
+	while(v >= 0){
+		got = got + v;
+		v = chan_receive(c);
+	}
+	return got;
+}
+c = channel();
+cons = fiber(consume, c);
+prod = fiber(produce, c, 5);
+squares = join(cons);
+sent = join(prod);
+fun ping(inbox, outbox, n){
+	let i = 0;
+	let last = 0;
+	while(i < n){
+		last = chan_receive(inbox);
+		chan_send(outbox, last + 1);
+		i = i + 1;
+	}
+	return last;
+}
+x = channel();
+y = channel();
+p = fiber(ping, x, y, 100);
+q = fiber(ping, y, x, 100);
+chan_send(x, 0);
+rp = join(p);
+rq = join(q);
+fun wait(c){ return chan_receive(c); }
+stuck = fiber(wait, channel());
+early = fiber(tick, 30, 1);
+again = join(early);
+twice = join(early);
+}
@@ -0,0 +1,109 @@
+{
+fun count(n){
+	let i = 0;
+	while(i < n){
+		yield i;
+		i = i + 1;
+	}
+}
+fun evens(src){
+	for(x in src){
+		if((x % 2) == 0) yield x;
+	}
+}
+fun squares(src){
+	for(x in src){
+		yield x * x;
+	}
+}
+piped = [];
+for(v in squares(evens(count(10)))){ piped = piped + v; }
+arr = [];
+for(v in [1, 2, 3]){ arr = arr + (v * 10); }
+d = {};
+d.a = 1;
+d.b = 2;
+keys = [];
+for(k in d){ keys = keys + k; }
+fun sum(g){
+	let s = 0;
+	for(x in g){
+		if(x > 50) break;
+		if(x == 3) continue;
+		s = s + x;
+	}
+	return s;
+}
+partial = sum(count(1000));
+g = count(5);
+first = [];
+for(x in g){ first = first + x; break; }
+rest = [];
+for(x in g){ rest = rest + x; }
+again = [];
+for(x in g){ again = again + x; }
+fun find(src, want){
+	for(x in src){
+		if(x == want) return x * 100;
+	}
+	return null;
+}
+found = find(count(1000), 7);
+fun nested(){
+	for(a in count(3)){
+		for(b in count(2)){
+			yield (a * 10) + b;
+		}
+	}
+}
+pairs = [];
+for(p in nested()){ pairs = pairs + p; }
+fun early(){
+	yield 1;
+	return 5;
+	yield 2;
+}
+e = [];
+for(x in early()){ e = e + x; }
+fun tree(depth, base){
+	if(depth == 0){
+		yield base;
+		return null;
+	}
+	for(x in tree(depth - 1, base * 2)){ yield x; }
+	for(x in tree(depth - 1, (base * 2) + 1)){ yield x; }
+}
+leaves = [];
+for(x in tree(3, 1)){ leaves = leaves + x; }
+mk = closure(a){ yield a; yield a + 1; };
+cl = [];
+for(x in mk(5)){ cl = cl + x; }
+fun abandon(n){
+	let t = 0;
+	let k = 0;
+	while(k < n){
+		for(x in count(100)){
+			if(x == 2) break;
+			t = t + x;
+		}
+		k = k + 1;
+	}
+	return t;
+}
+dropped = abandon(500);
+fun total(src){
+	let s = 0;
+	for(x in src){ s = s + x; }
+	return s;
+}
+mixed = 0;
+k = 0;
+while(k < 300){
+	if((k % 2) == 0) mixed = mixed + total(count(10));
+	else mixed = mixed + total([1, 2, 3]);
+	k = k + 1;
+}
+none = [];
+for(x in null){ none = none + x; }
+for(x in 5){ none = none + x; }
+}
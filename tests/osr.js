@@ -0,0 +1,56 @@
+{
+s = 0;
+i = 0;
+while(i < 5000){
+	s = s + (i % 7);
+	i = i + 1;
+}
+v = 0;
+j = 0;
+while(j < 3000){
+	if(j == 2995){ v = [v]; }
+	v = v + 1;
+	j = j + 1;
+}
+fun mix(n){
+	let a = 0;
+	let k = 0;
+	while(k < n){
+		if(k == (n - 5)){ a = [a]; }
+		a = a + k;
+		k = k + 1;
+	}
+	return a;
+}
+m = mix(1000);
+fun sum(a, n){
+	let k = 0;
+	while(k < n){
+		a = a + 1;
+		k = k + 1;
+	}
+	return a;
+}
+fun alternate(n){
+	let out = [];
+	let k = 0;
+	while(k < n){
+		if((k % 2) == 0){ out = out + sum(k, 200); }
+		else { out = out + sum([k], 2); }
+		k = k + 1;
+	}
+	return out;
+}
+alt = alternate(10);
+fun stop(n){
+	let t = 0;
+	let k = 0;
+	while(k < n){
+		t = t + k;
+		if(t > 100000){ return k; }
+		k = k + 1;
+	}
+	return t;
+}
+e = stop(100000);
+}
@@ -0,0 +1,12 @@
+{
+d = {};
+d.a = 1;
+arr = [1, 2, 3, 4, 5, 6, 7, 8];
+cap = [];
+f = closure(x){ let r = cap + x; return x * 2; };
+g = closure(x){ d.b = x; return d.a + x; };
+h = closure(x){ let n = 0; for(k in d){ n = n + 1; } for(v in arr){ n = n + v; } return n; };
+m1 = parallel_map(arr, f);
+m2 = parallel_map(arr, g);
+m3 = parallel_map(arr, h);
+}
@@ -0,0 +1,49 @@
+{
+fun f(a, b){
+	let c = 0;
+	c = (a * b) + (a - b);
+	if(c > 10){ c = c % 7; }
+	return c;
+}
+fun fields(o){ return (o.x + o.y); }
+fun add(a, b){ return (a + b) + 1; }
+fun getx(o){ return o.x * 2; }
+fun runo(o, n){
+	let i = 0;
+	let t = 0;
+	while(i < n){
+		t = t + getx(o);
+		i = i + 1;
+	}
+	return t;
+}
+fun main(){
+	let i = 0;
+	let s = 0;
+	let t = 0;
+	let p = {};
+	while(i < 300){
+		s = s + f(i, 3);
+		p.x = i;
+		p.y = 2;
+		t = t + fields(p);
+		s = s + add(i, t);
+		t = t + runo(p, 3);
+		i = i + 1;
+	}
+	return s + t;
+}
+hot = main();
+p = {};
+p.x = "a";
+p.y = "b";
+strs = fields(p);
+arrs = add([1], 2);
+q = {};
+q.x = [4];
+q.y = 1;
+fun other(o){ return 7; }
+getx = other;
+retargeted = runo(q, 2);
+back = main();
+}